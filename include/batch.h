@@ -0,0 +1,44 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "glfuncs.h"
+
+// Number of watermark groups a batch can hide quads by
+#define BATCH_MAX_GROUPS 16
+
+// One solid-coloured rectangle, drawn as an instance of a unit quad.
+// Quads with scroll set are positioned relative to the judge line: their y is an
+// offset from where the chart position given by position currently sits on screen.
+// Quads in a group (group >= 0) are hidden while sequence is below the group's watermark.
+typedef struct {
+	float x, y, w, h;
+	float position;
+	float scroll;
+	float group;
+	float sequence;
+	unsigned char top[4];
+	unsigned char bottom[4];
+} BatchQuad;
+
+// A buffer of quad instances, uploaded once (static) or every frame (dynamic)
+typedef struct {
+	GLuint buffer;
+	BatchQuad* quads;
+	int count;
+	int capacity;
+	int uploaded_capacity;
+	int dynamic;
+} Batch;
+
+int Batch_init();
+void Batch_shutdown();
+Batch* Batch_create(int capacity, int dynamic);
+void Batch_clear(Batch* batch);
+int Batch_add(Batch* batch, const BatchQuad* quad);
+void Batch_upload(Batch* batch);
+void Batch_set_watermarks(const int* watermarks, int count);
+void Batch_set_view(double position, double measure_height, double judge_line);
+void Batch_draw(Batch* batch, int first, int count);
+void Batch_free(Batch* batch);
+
+#endif
@@ -0,0 +1,9 @@
+#ifndef BENCHMARK_H
+#define BENCHMARK_H
+
+#define BENCHMARK_DEFAULT_FPS 60
+#define BENCHMARK_REPORT_FILE "benchmark.csv"
+
+int Benchmark_run(int frames, int fps);
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef BGA_H
+#define BGA_H
+
+#include "bms.h"
+
+// BGA images are shown at 256x256, the size charts are authored for
+#define BGA_SIZE 256
+
+// How far ahead of the chart position images are decoded and uploaded, in seconds
+#define BGA_LOOKAHEAD 2.0
+
+void Bga_set_synchronous(int enabled);
+int Bga_init(BMS* bms);
+void Bga_draw(double position, double velocity, int poor, float x, float y, float size);
+void Bga_destroy();
+
+#endif
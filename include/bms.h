@@ -1,6 +1,10 @@
 #ifndef BMS_H
 #define BMS_H
 
+#include "cache.h"
+#include "directory.h"
+#include "mixer.h"
+
 #include <stdlib.h>
 
 // Formats
@@ -74,13 +78,24 @@ enum {
 #define DEFAULT_PLAYLEVEL 0
 #define DEFAULT_RANK 0
 #define DEFAULT_TOTAL 160.0
+#define DEFAULT_VOLWAV 100.0
+
+// Playable lanes, the most any format has (PMS's nine buttons)
+#define BMS_LANES 9
+
+// How far either side of a note a press can be and still be judged, in seconds
+#define BMS_JUDGE_WINDOW 0.200
 
 // A wav object definition
 // #WAVxx <filename>
+// Short sounds are shared through the sample cache, while long sounds are
+// streamed rather than decoded up front, in which case stream is set and data is NULL
 typedef struct {
 	char* file;
 	float* data;
 	size_t size;
+	Sample* sample;
+	MixerStream* stream;
 } WavDef;
 
 // A bitmap object definition
@@ -90,16 +105,24 @@ typedef struct {
 } BmpDef;
 
 // A channel object
+// lane_index is the object's place among the visible objects of its lane, in chart order
 typedef struct {
 	int id;
 	int visible;
 	int activated;
 	double ypos;
 	int lane;
+	int lane_index;
 	double timing;
 	int judgment;
 } Object;
 
+// A note in a lane's list, and where it falls in actual measures
+typedef struct {
+	Object* object;
+	double actual_measure;
+} LaneNote;
+
 // An internal representation of a single channel/column.
 typedef struct {
 	Object** objects;
@@ -121,6 +144,7 @@ typedef struct {
 	char* file;
 	char* extension;
 	char* directory;
+	Directory* index;
 	int play_type;
 	char* genre;
 	char* title;
@@ -155,17 +179,32 @@ typedef struct {
 	double current_measure_part;
 	int current_measure;
 	int total_measures;
+	double* measure_positions;
 	double current_bpm;
 	double mps;
 	long measure_duration;
 	int format;
 	int lane_channels[1295];
+
+	// Each lane's notes in chart order (a note's place is its lane_index), and the
+	// first of them that is neither judged nor gone past, owned by the logic thread
+	LaneNote* lane_notes[BMS_LANES];
+	int lane_note_counts[BMS_LANES];
+	int lane_next[BMS_LANES];
+
+	// Notes that went past the judgment window without being hit
+	int missed;
 } BMS;
 
 BMS* BMS_load(const char* path);
 void BMS_step(BMS* bms, long dt);
-void BMS_handle_button_press(BMS* bms, int lane);
+Object* BMS_handle_button_press(BMS* bms, int lane, long offset);
+void BMS_play_keysound(BMS* bms, int id);
 Measure** BMS_get_renderable_objects(BMS* bms);
+void BMS_free_renderable_objects(BMS* bms, Measure** measures);
+double BMS_get_position(BMS* bms);
+double BMS_get_velocity(BMS* bms);
+int BMS_find_measure(BMS* bms, double position);
 void BMS_free(BMS* bms);
 void BMS_print_info(BMS* bms);
 
@@ -0,0 +1,30 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdlib.h>
+
+// Unreferenced samples are kept around until the cache grows past this many bytes
+#define CACHE_DEFAULT_BUDGET ((size_t)512 * 1024 * 1024)
+
+// A decoded sound, shared by every #WAV definition that resolves to the same file
+typedef struct Sample {
+	char* path;
+	float* data;
+	size_t size;
+	int refcount;
+
+	// Hash bucket chain
+	struct Sample* next;
+
+	// Least-recently-used list of samples with no references
+	struct Sample* lru_prev;
+	struct Sample* lru_next;
+} Sample;
+
+void Cache_set_budget(size_t bytes);
+Sample* Cache_acquire(const char* path, int decode_long, int* result);
+void Cache_release(Sample* sample);
+size_t Cache_get_size();
+void Cache_destroy();
+
+#endif
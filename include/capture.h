@@ -0,0 +1,20 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+// How captured frames are written
+enum {
+	CAPTURE_RAW = 0,
+	CAPTURE_PNG
+};
+
+// Frames that can wait for the writer thread before new ones are dropped
+#define CAPTURE_QUEUE_FRAMES 8
+
+int Capture_start(const char* prefix, int format);
+void Capture_stop();
+int Capture_parse_format(const char* name);
+void Capture_init_renderer();
+void Capture_frame();
+void Capture_destroy_renderer();
+
+#endif
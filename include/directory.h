@@ -0,0 +1,27 @@
+#ifndef DIRECTORY_H
+#define DIRECTORY_H
+
+// One file or subdirectory in an indexed directory
+typedef struct DirectoryEntry {
+	char* name;
+	char* stem;
+	char* extension;
+	struct Directory* child;
+	int child_indexed;
+	struct DirectoryEntry* next;
+} DirectoryEntry;
+
+// A directory listed once into a hash index keyed by lower-cased file stem,
+// so that names can be resolved without touching the filesystem again
+typedef struct Directory {
+	char* path;
+	DirectoryEntry** buckets;
+	int bucket_count;
+	int entry_count;
+} Directory;
+
+Directory* Directory_open(const char* path);
+char* Directory_resolve(Directory* directory, const char* name, const char** extensions);
+void Directory_free(Directory* directory);
+
+#endif
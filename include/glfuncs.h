@@ -0,0 +1,64 @@
+#ifndef GLFUNCS_H
+#define GLFUNCS_H
+
+#include <SDL2/SDL_opengl.h>
+
+// OpenGL entry points beyond 1.1, loaded at runtime once a context exists.
+// Called through the global table, e.g. gl.GenBuffers(1, &buffer).
+typedef struct {
+	// Buffers
+	PFNGLGENBUFFERSPROC GenBuffers;
+	PFNGLDELETEBUFFERSPROC DeleteBuffers;
+	PFNGLBINDBUFFERPROC BindBuffer;
+	PFNGLBUFFERDATAPROC BufferData;
+	PFNGLBUFFERSUBDATAPROC BufferSubData;
+	PFNGLMAPBUFFERPROC MapBuffer;
+	PFNGLUNMAPBUFFERPROC UnmapBuffer;
+
+	// Shaders
+	PFNGLCREATESHADERPROC CreateShader;
+	PFNGLDELETESHADERPROC DeleteShader;
+	PFNGLSHADERSOURCEPROC ShaderSource;
+	PFNGLCOMPILESHADERPROC CompileShader;
+	PFNGLGETSHADERIVPROC GetShaderiv;
+	PFNGLGETSHADERINFOLOGPROC GetShaderInfoLog;
+	PFNGLCREATEPROGRAMPROC CreateProgram;
+	PFNGLDELETEPROGRAMPROC DeleteProgram;
+	PFNGLATTACHSHADERPROC AttachShader;
+	PFNGLBINDATTRIBLOCATIONPROC BindAttribLocation;
+	PFNGLLINKPROGRAMPROC LinkProgram;
+	PFNGLGETPROGRAMIVPROC GetProgramiv;
+	PFNGLGETPROGRAMINFOLOGPROC GetProgramInfoLog;
+	PFNGLUSEPROGRAMPROC UseProgram;
+	PFNGLGETUNIFORMLOCATIONPROC GetUniformLocation;
+	PFNGLUNIFORM1IPROC Uniform1i;
+	PFNGLUNIFORM2FPROC Uniform2f;
+	PFNGLUNIFORM3FPROC Uniform3f;
+	PFNGLUNIFORM1FVPROC Uniform1fv;
+
+	// Vertex attributes and instancing
+	PFNGLENABLEVERTEXATTRIBARRAYPROC EnableVertexAttribArray;
+	PFNGLDISABLEVERTEXATTRIBARRAYPROC DisableVertexAttribArray;
+	PFNGLVERTEXATTRIBPOINTERPROC VertexAttribPointer;
+	PFNGLVERTEXATTRIBDIVISORARBPROC VertexAttribDivisor;
+	PFNGLDRAWARRAYSINSTANCEDARBPROC DrawArraysInstanced;
+
+	// Timer queries, which are optional and NULL when unsupported
+	PFNGLGENQUERIESPROC GenQueries;
+	PFNGLDELETEQUERIESPROC DeleteQueries;
+	PFNGLBEGINQUERYPROC BeginQuery;
+	PFNGLENDQUERYPROC EndQuery;
+	PFNGLGETQUERYOBJECTIVPROC GetQueryObjectiv;
+	PFNGLGETQUERYOBJECTUI64VPROC GetQueryObjectui64v;
+} GLFuncs;
+
+extern GLFuncs gl;
+
+int GLFuncs_load(void* (*get_proc_address)(const char*));
+int GLFuncs_get_draw_calls();
+void GLFuncs_reset_draw_calls();
+int GLFuncs_has_timer_queries();
+GLuint GLFuncs_compile_shader(GLenum type, const char* source);
+int GLFuncs_link_program(GLuint program);
+
+#endif
@@ -8,6 +8,26 @@
 #define GRAPHICS_WIN_TITLE "dreamnote"
 #define GRAPHICS_WIN_WIDTH 800
 #define GRAPHICS_WIN_HEIGHT 600
+#define GRAPHICS_DEFAULT_FPS_CAP 240
+
+// Frame pacing modes
+enum {
+	GRAPHICS_PACING_VSYNC = 0,
+	GRAPHICS_PACING_UNCAPPED,
+	GRAPHICS_PACING_CAPPED,
+	GRAPHICS_PACING_LOW_LATENCY
+};
+
+// Times of the most recent frame, and smoothed over recent frames, in milliseconds
+// GPU times are negative when the driver has no timer queries
+typedef struct {
+	double frame_ms;
+	double cpu_ms;
+	double gpu_ms;
+	double average_frame_ms;
+	double average_cpu_ms;
+	double average_gpu_ms;
+} GraphicsFrameStats;
 
 int Graphics_init();
 int Graphics_thread();
@@ -16,7 +36,8 @@ SDL_Window* Graphics_get_window();
 void Graphics_clear();
 void Graphics_present();
 void Graphics_destroy();
-int Graphics_get_render_counter();
-void Graphics_reset_render_counter();
+void Graphics_set_pacing(int mode, int fps);
+int Graphics_parse_pacing(const char* name);
+void Graphics_get_frame_stats(GraphicsFrameStats* out);
 
 #endif
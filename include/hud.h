@@ -0,0 +1,22 @@
+#ifndef HUD_H
+#define HUD_H
+
+#include "scheduler.h"
+
+// Frames of history each graph shows
+#define HUD_HISTORY 120
+
+// How often resident memory is looked up, in nanoseconds
+#define HUD_MEMORY_INTERVAL 500000000LL
+
+// Performance overlay with rolling graphs of frame time, logic tick jitter,
+// audio callback load and active voices, plus memory use
+// Drawn by the render thread as one batch; anything may toggle it
+void Hud_watch_scheduler(Scheduler* scheduler);
+void Hud_toggle();
+int Hud_is_visible();
+void Hud_init_renderer();
+void Hud_draw();
+void Hud_destroy_renderer();
+
+#endif
@@ -5,34 +5,72 @@
 
 #define NUM_BUTTONS 20
 
-// Bindings for all 20 buttons
+// Events each button can have waiting to be handled
+#define INPUT_QUEUE_SIZE 64
+
+// Gamepads that can be held down at once; each gets its own slot by instance id
+#define INPUT_MAX_DEVICES 8
+
+// Smallest movement of an axis, out of 32768, that counts as the turntable turning
+#define INPUT_AXIS_THRESHOLD 256
+
+// How long a turntable has to stop turning before its button is released
+#define INPUT_AXIS_RELEASE_NS 80000000LL
+
+// Bindings for all 20 buttons, with SDL_SCANCODE_UNKNOWN, SDL_CONTROLLER_BUTTON_INVALID
+// and SDL_CONTROLLER_AXIS_INVALID meaning unbound
 // Example:
 // scancodes[0] = SDL_SCANCODE_Z; | Button 1 = scancode for the Z key
-// gamepad[0] = SDL_CONTROLLER_BUTTON_A | Button 1 = A button on the gamepad
+// gamepad[0] = SDL_CONTROLLER_BUTTON_A | Button 1 = A button on any gamepad
+// axes[0] = SDL_CONTROLLER_AXIS_LEFTX | Button 1 = turning the turntable on any gamepad
 typedef struct {
 	SDL_Scancode scancodes[NUM_BUTTONS];
 	SDL_GameControllerButton gamepad[NUM_BUTTONS];
+	SDL_GameControllerAxis axes[NUM_BUTTONS];
 } InputMapping;
 
-// The composite state of all scancode and gamepad bindings
+// Last reading and movement of one axis of one gamepad
 typedef struct {
-	int buttons[NUM_BUTTONS];
-	int pressed[NUM_BUTTONS];
-	int released[NUM_BUTTONS];
-	int scancodes[NUM_BUTTONS];
-	int gamepad[NUM_BUTTONS];
+	int valid;
+	int value;
+	int direction;
+	long long last_motion;
+} InputAxisState;
+
+// Which sources are holding each button down, as bits for the keyboard and each
+// gamepad's buttons and axes
+// Only touched by the thread handling events
+typedef struct {
+	unsigned int sources[NUM_BUTTONS];
+	InputAxisState axes[INPUT_MAX_DEVICES][SDL_CONTROLLER_AXIS_MAX];
 } InputState;
 
+// A button going down or up, and when, on the same clock as get_time_ns
+typedef struct {
+	int button;
+	int pressed;
+	long long time;
+} InputEvent;
+
+// Called on the event thread the moment a button goes down
+typedef void (*InputPressHandler)(int button, long long time);
+
 int Input_init();
+void Input_destroy();
 void Input_set_default_bindings();
-void Input_key_pressed(SDL_Scancode key);
-void Input_key_released(SDL_Scancode key);
-void Input_gamepad_pressed(SDL_GameControllerButton button);
-void Input_gamepad_released(SDL_GameControllerButton button);
-void Input_swap_state();
-void Input_write_state();
+void Input_bind_key(int button, SDL_Scancode key);
+void Input_bind_gamepad(int button, SDL_GameControllerButton gamepad_button);
+void Input_bind_axis(int button, SDL_GameControllerAxis axis);
+void Input_set_press_handler(InputPressHandler handler);
+void Input_device_added(int device_index);
+void Input_device_removed(SDL_JoystickID device, long long time);
+void Input_key_pressed(SDL_Scancode key, long long time);
+void Input_key_released(SDL_Scancode key, long long time);
+void Input_gamepad_pressed(SDL_JoystickID device, SDL_GameControllerButton button, long long time);
+void Input_gamepad_released(SDL_JoystickID device, SDL_GameControllerButton button, long long time);
+void Input_gamepad_axis(SDL_JoystickID device, SDL_GameControllerAxis axis, int value, long long time);
+void Input_update(long long time);
 int Input_is_down(int button);
-int Input_was_pressed(int button);
-int Input_was_released(int button);
+int Input_poll_event(int button, InputEvent* event);
 
 #endif
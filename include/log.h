@@ -1,6 +1,8 @@
 #ifndef LOG_H
 #define LOG_H
 
+#include <SDL2/SDL_atomic.h>
+
 #define COLOR_RED     "\x1b[31m"
 #define COLOR_RED_B   "\x1b[31;1m"
 #define COLOR_GREEN   "\x1b[32m"
@@ -10,16 +12,41 @@
 #define COLOR_CYAN    "\x1b[36m"
 #define COLOR_RESET   "\x1b[0m"
 
-enum {
-	LOG_OFF = 0,
-	LOG_FATAL,
-	LOG_ERROR,
-	LOG_WARN,
-	LOG_INFO,
-	LOG_DEBUG,
-	LOG_ALL
-};
+// Bytes of messages each thread can have waiting for the writer thread
+// Messages that don't fit are dropped and counted, rather than waited for
+#define LOG_RING_SIZE (64 * 1024)
+
+// Threads that can log at once, each with its own ring
+#define LOG_MAX_THREADS 32
+
+// How often the writer thread wakes to write out messages, in milliseconds
+#define LOG_FLUSH_INTERVAL 10
+
+// Levels are macros so the preprocessor can compare them
+#define LOG_OFF   0
+#define LOG_FATAL 1
+#define LOG_ERROR 2
+#define LOG_WARN  3
+#define LOG_INFO  4
+#define LOG_DEBUG 5
+#define LOG_ALL   6
 
+// The least severe level compiled in; calls below it are removed along with their
+// arguments, e.g. -DLOG_MIN_LEVEL=LOG_INFO drops every Log_debug
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_DEBUG
+#endif
+
+// How often one call site of Log_limited has logged in the current second
+typedef struct {
+	SDL_SpinLock lock;
+	long long window_start;
+	int count;
+	int suppressed;
+} LogLimit;
+
+// Messages are formatted later on the writer thread, so fmt must be a string
+// literal; %s arguments are copied when logged
 int Log_start(const char* file, int level, int mirror_to_console);
 void Log_set_level(int level);
 void Log_set_mirror_to_console(int mirror_to_console);
@@ -28,6 +55,42 @@ void Log_info(const char* fmt, ...);
 void Log_warn(const char* fmt, ...);
 void Log_error(const char* fmt, ...);
 void Log_fatal(const char* fmt, ...);
+void Log_flush();
 void Log_destroy();
+int Log_limit(LogLimit* limit, int per_second, int* suppressed);
+
+// Never defined; removed calls only name it inside sizeof, which keeps their
+// arguments type checked and used without evaluating anything
+int Log_discard(const char* fmt, ...);
+
+#if LOG_MIN_LEVEL < LOG_DEBUG
+#define Log_debug(...) ((void)sizeof(Log_discard(__VA_ARGS__)))
+#endif
+#if LOG_MIN_LEVEL < LOG_INFO
+#define Log_info(...) ((void)sizeof(Log_discard(__VA_ARGS__)))
+#endif
+#if LOG_MIN_LEVEL < LOG_WARN
+#define Log_warn(...) ((void)sizeof(Log_discard(__VA_ARGS__)))
+#endif
+#if LOG_MIN_LEVEL < LOG_ERROR
+#define Log_error(...) ((void)sizeof(Log_discard(__VA_ARGS__)))
+#endif
+#if LOG_MIN_LEVEL < LOG_FATAL
+#define Log_fatal(...) ((void)sizeof(Log_discard(__VA_ARGS__)))
+#endif
+
+// Log through one of the Log_* functions, but at most per_second times a second
+// from this call site, noting how many were left out in between
+// e.g. Log_limited(Log_warn, 5, "Object is null!");
+#define Log_limited(log, per_second, ...) do { \
+	static LogLimit log_limit_; \
+	int log_suppressed_; \
+	if (Log_limit(&log_limit_, (per_second), &log_suppressed_)) { \
+		if (log_suppressed_ > 0) { \
+			log("%d similar messages were suppressed", log_suppressed_); \
+		} \
+		log(__VA_ARGS__); \
+	} \
+} while (0)
 
 #endif
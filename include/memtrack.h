@@ -0,0 +1,31 @@
+#ifndef MEMTRACK_H
+#define MEMTRACK_H
+
+#include <stdlib.h>
+
+// What memory is used for; each has its own live and peak byte counts
+#define MEMTRACK_CHART_PARSE 0
+#define MEMTRACK_CHART_OBJECTS 1
+#define MEMTRACK_SAMPLES 2
+#define MEMTRACK_RENDER 3
+#define MEMTRACK_LOG 4
+#define MEMTRACK_TAGS 5
+
+// Allocation wrappers that count each block against a subsystem
+// Blocks from these must be freed with Memtrack_free, and nothing else may be
+// Memory allocated elsewhere (e.g. by the GPU driver) can be counted with
+// Memtrack_track and Memtrack_untrack instead
+// Counts are exposed as the metrics memory.<tag>.live_kb and memory.<tag>.peak_kb
+void Memtrack_init();
+void* Memtrack_malloc(int tag, size_t size);
+void* Memtrack_calloc(int tag, size_t count, size_t size);
+void* Memtrack_recalloc(int tag, void* array, size_t elem_size, int old_count, int new_count);
+char* Memtrack_strdup(int tag, const char* str);
+void Memtrack_free(void* ptr);
+void Memtrack_track(int tag, size_t size);
+void Memtrack_untrack(int tag, size_t size);
+long long Memtrack_get_live(int tag);
+long long Memtrack_get_peak(int tag);
+void Memtrack_print_summary(const char* when);
+
+#endif
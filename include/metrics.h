@@ -0,0 +1,39 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+// Most metrics that can be registered, and the longest a name can be
+#define METRICS_MAX 64
+#define METRICS_NAME_LENGTH 48
+
+// Histograms split each power of two into this many buckets, so a recorded value
+// is known to within about 20%
+#define METRICS_SUB_BUCKETS 4
+#define METRICS_BUCKETS (32 * METRICS_SUB_BUCKETS)
+
+// How often metrics are written out while running, in milliseconds
+#define METRICS_DUMP_INTERVAL 1000
+
+#define METRICS_COUNTER 0
+#define METRICS_GAUGE 1
+#define METRICS_HISTOGRAM 2
+
+// Counters only go up, gauges hold the latest value set, and histograms count
+// how often values fall in logarithmic buckets, from which percentiles are estimated
+// Updates are lock-free and safe from any thread, including the audio callback
+// Registering is not, so modules register what they need during setup and keep
+// the pointer; registering a name twice returns the same metric
+typedef struct Metric Metric;
+
+Metric* Metrics_counter(const char* name);
+Metric* Metrics_gauge(const char* name);
+Metric* Metrics_histogram(const char* name);
+void Metrics_add(Metric* metric, int amount);
+void Metrics_set(Metric* metric, int value);
+void Metrics_record(Metric* metric, int value);
+int Metrics_get(Metric* metric);
+int Metrics_get_percentile(Metric* metric, double fraction);
+int Metrics_start(const char* path, int interval);
+int Metrics_write();
+void Metrics_stop();
+
+#endif
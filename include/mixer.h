@@ -7,12 +7,48 @@
 #define MIXER_PLAYING 1
 #define MIXER_PAUSED 2
 
+// Sounds that would take up more than this many samples once decoded
+// (about 16 MB of float stereo) are streamed from disk instead
+#define MIXER_STREAM_THRESHOLD (4 * 1024 * 1024)
+
+// What Mixer_load_file did with a file
+#define MIXER_LOAD_FAILED 0
+#define MIXER_LOAD_DECODED 1
+#define MIXER_LOAD_TOO_LONG 2
+
+// Every sound is mixed into one of these buses, each with its own gain
+#define MIXER_BUS_BGM 0
+#define MIXER_BUS_KEY 1
+#define MIXER_NUM_BUSES 2
+
+// Longest Mixer_halt waits for the audio callback, in milliseconds
+#define MIXER_HALT_TIMEOUT 1000
+
+// Limits for the playback rate of the whole mix
+#define MIXER_MIN_RATE 0.5
+#define MIXER_MAX_RATE 2.0
+
+typedef struct MixerStream MixerStream;
+
+// Receives every block of mixed interleaved stereo output, on the audio thread
+// It must not block, allocate or do I/O
+typedef void (*MixerTap)(const float* samples, unsigned long frames);
+
 int Mixer_init();
+int Mixer_init_silent(int rate);
 void Mixer_destroy();
-int Mixer_load_file(const char* path, float** buffer, size_t* size);
-int Mixer_add(float* data, size_t size);
+int Mixer_load_file(const char* path, int decode_long, float** buffer, size_t* size);
+MixerStream* Mixer_open_stream(const char* path);
+void Mixer_close_stream(MixerStream* stream);
+int Mixer_add(float* data, size_t size, int bus);
+int Mixer_add_stream(MixerStream* stream, int bus);
+void Mixer_set_rate(double rate);
+void Mixer_set_bus_gain(int bus, double gain);
+void Mixer_set_chart_gain(double gain);
 void Mixer_play();
 void Mixer_pause();
-void Mixer_halt();
+int Mixer_halt();
+void Mixer_set_tap(MixerTap tap);
+int Mixer_get_sample_rate();
 
 #endif
@@ -4,7 +4,11 @@
 void Play_init(char* path);
 void Play_destroy();
 void Play_change_scroll_speed(int diff);
-void Play_update(long dt);
-void Play_draw();
+void Play_change_rate(double diff);
+void Play_update(long dt, long long time);
+void Play_handle_press(int button, long long time);
+void Play_init_renderer();
+void Play_destroy_renderer();
+void Play_draw(long long now);
 
 #endif
@@ -0,0 +1,49 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "metrics.h"
+
+#include <SDL2/SDL.h>
+
+// Longest and shortest the scheduler will spin before a deadline, in nanoseconds
+#define SCHEDULER_MIN_SPIN 20000LL
+#define SCHEDULER_MAX_SPIN 2000000LL
+
+// How often each scheduler logs how well it kept time, in nanoseconds
+#define SCHEDULER_REPORT_INTERVAL 10000000000LL
+
+// Wakes one thread at absolute deadlines, sleeping for as long as the OS can be
+// trusted to wake it on time and spinning only for the rest
+// Each scheduler belongs to the thread that waits on it
+typedef struct {
+	const char* name;
+	long long period;
+	long long next;
+
+	// How long to spin before each deadline, which tracks how late sleeps wake up
+	long long spin;
+	long long oversleep;
+
+	// Wakeups since the last report, and how late they were
+	long long report_start;
+	long long report_cpu_start;
+	int wakeups;
+	int late;
+	long long total_jitter;
+	long long max_jitter;
+
+	// <name>.wakeups and <name>.jitter_us, in lower case
+	Metric* wakeup_metric;
+	Metric* jitter_metric;
+
+	// Worst jitter since Scheduler_take_max_jitter last read it, in microseconds
+	SDL_atomic_t peak_jitter;
+} Scheduler;
+
+Scheduler* Scheduler_create(const char* name, long long period);
+long long Scheduler_wait(Scheduler* scheduler);
+void Scheduler_wait_until(Scheduler* scheduler, long long deadline);
+int Scheduler_take_max_jitter(Scheduler* scheduler);
+void Scheduler_free(Scheduler* scheduler);
+
+#endif
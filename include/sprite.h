@@ -0,0 +1,27 @@
+#ifndef SPRITE_H
+#define SPRITE_H
+
+#include "glfuncs.h"
+
+#include <SDL2/SDL.h>
+
+// Size of the square texture every sprite is packed into
+#define SPRITE_ATLAS_SIZE 1024
+
+// Most sprites that can be queued between flushes
+#define SPRITE_MAX_QUEUED 1024
+
+// A rectangle of the atlas, in texture coordinates, and its size in pixels
+typedef struct {
+	float u0, v0, u1, v1;
+	int w, h;
+} SpriteRegion;
+
+int Sprite_init();
+void Sprite_shutdown();
+int Sprite_pack(SDL_Surface* surface, int x, int y, int w, int h, SpriteRegion* region);
+void Sprite_draw(const SpriteRegion* region, float x, float y, const unsigned char* color);
+void Sprite_flush();
+void Sprite_draw_texture(GLuint texture, float x, float y, float w, float h, const unsigned char* color);
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// Where a trace goes when none was named on the command line
+#define TRACE_DEFAULT_FILE "trace.json"
+
+// Spans each thread can have waiting for the writer thread
+// Spans that don't fit are dropped and counted, rather than waited for
+#define TRACE_RING_SIZE 8192
+
+// Threads that can record spans, each with its own ring
+// Every ring is allocated by Trace_init, so recording never allocates
+#define TRACE_MAX_THREADS 32
+
+// How often the writer thread wakes to write out spans, in milliseconds
+#define TRACE_FLUSH_INTERVAL 50
+
+// Records spans of work on each thread and writes them out in Chrome's trace
+// event format, for chrome://tracing or Perfetto
+// While tracing is off, Trace_begin is a single atomic read and Trace_end returns at once
+//
+// long long span = Trace_begin();
+// BMS_step(bms, dt);
+// Trace_end("BMS_step", span);
+//
+// Span and thread names aren't copied, so they must be string literals
+void Trace_init();
+int Trace_start(const char* path);
+void Trace_stop();
+int Trace_is_enabled();
+void Trace_name_thread(const char* name);
+long long Trace_begin();
+void Trace_end(const char* name, long long start);
+void Trace_destroy();
+
+#endif
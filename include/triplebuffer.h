@@ -0,0 +1,23 @@
+#ifndef TRIPLEBUFFER_H
+#define TRIPLEBUFFER_H
+
+#include <stdlib.h>
+#include <SDL2/SDL_atomic.h>
+
+// Lock-free handoff of fixed-size snapshots from one writer thread to one reader thread.
+// The writer fills the back slot and publishes it; the reader always gets the most
+// recently published complete slot, and neither side ever waits for the other.
+typedef struct {
+	void* slots[3];
+	SDL_atomic_t middle;
+	int back;
+	int front;
+} TripleBuffer;
+
+TripleBuffer* TripleBuffer_create(size_t size);
+void* TripleBuffer_get_write(TripleBuffer* buffer);
+void TripleBuffer_publish(TripleBuffer* buffer);
+void* TripleBuffer_get_read(TripleBuffer* buffer);
+void TripleBuffer_free(TripleBuffer* buffer);
+
+#endif
@@ -13,5 +13,8 @@ double measure_duration(double bpm, double metre);
 const char* get_extension(const char *file);
 struct timespec timespec_diff(struct timespec start, struct timespec end);
 struct timespec timespec_add_ns(struct timespec time, long ns);
+long long timespec_to_ns(struct timespec time);
+long long get_time_ns();
+long long get_resident_memory();
 
 #endif
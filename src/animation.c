@@ -1,127 +1,84 @@
 #include "animation.h"
-#include "graphics.h"
-#include "util.h"
+#include "log.h"
 
-/*static Animation** animations = NULL;
-static int animation_count = 0;
-
-extern SDL_Renderer* renderer;
-
-// Load an animation sheet from a PNG file
+// Load an animation sheet from an image file, packing its frames into the sprite atlas
+// Must be called on the thread that owns the OpenGL context
 Animation* Animation_load_from_file(const char* path, int total_frames, int frame_width, double frame_duration, int loop, int hide_when_stopped) {
-	Animation* animation = calloc(1, sizeof(Animation));
-
-	// Load the image
-	animation->texture = IMG_LoadTexture(renderer, path);
+	SDL_Surface* sheet = IMG_Load(path);
 
 	// Return NULL if the image doesn't load
-	if (animation->texture == NULL) {
-		free(animation);
+	if (sheet == NULL) {
+		Log_error("Error loading animation %s: %s", path, IMG_GetError());
 		return NULL;
 	}
 
+	Animation* animation = calloc(1, sizeof(Animation));
+	animation->frames = calloc(total_frames, sizeof(SpriteRegion));
+
 	// Initialize all fields
 	animation->total_frames = total_frames;
 	animation->frame_width = frame_width;
-	animation->frame_duration = frame_duration;
+	animation->height = sheet->h;
+	animation->frame_duration = (long)(frame_duration * 1E9);
 	animation->loop = loop;
 	animation->hide_when_stopped = hide_when_stopped;
-	animation->current_frame = 0;
-	animation->frame_timer = 0;
-	animation->playing = 0;
-	SDL_QueryTexture(animation->texture, NULL, NULL, NULL, &animation->height);
 
-	// Add the animation to the global animation array
-	animations = recalloc(animations, sizeof(Animation*), animation_count, animation_count + 1);
-	animations[animation_count] = animation;
-	animation_count++;
+	for (int i = 0; i < total_frames; i++) {
+		if (!Sprite_pack(sheet, i * frame_width, 0, frame_width, sheet->h, &animation->frames[i])) {
+			SDL_FreeSurface(sheet);
+			Animation_free(animation);
+			return NULL;
+		}
+	}
+
+	SDL_FreeSurface(sheet);
 
 	return animation;
 }
 
-// Play the animation
-void Animation_play(Animation* animation) {
-	if (animation == NULL) {
-		return;
+// Returns the frame shown elapsed nanoseconds after the animation started,
+// or -1 if it has finished and isn't looping
+int Animation_get_frame(Animation* animation, long long elapsed) {
+	if (elapsed < 0) {
+		elapsed = 0;
 	}
 
-	animation->playing = 1;
-}
+	long long frame = animation->frame_duration > 0 ? elapsed / animation->frame_duration : 0;
 
-// Pause the animation
-void Animation_pause(Animation* animation) {
-	if (animation == NULL) {
-		return;
+	if (animation->loop) {
+		return (int)(frame % animation->total_frames);
+	} else if (frame >= animation->total_frames) {
+		return -1;
 	}
 
-	animation->playing = 0;
+	return (int)frame;
 }
 
-// Stop the animation and reset the frame to 0
-void Animation_stop(Animation* animation) {
+// Queue the animation to be drawn at the given coordinates, as it looks elapsed
+// nanoseconds after it started. It is drawn with the next Sprite_flush.
+void Animation_draw(Animation* animation, int x, int y, long long elapsed) {
 	if (animation == NULL) {
 		return;
 	}
 
-	animation->playing = 0;
-	animation->current_frame = 0;
-	animation->frame_timer = 0;
-}
-
-// Update all animations currently loaded
-void Animation_update_all(long dt) {
-	for (int i = 0; i < animation_count; i++) {
-		Animation_update(animations[i], dt);
-	}
-}
+	int frame = Animation_get_frame(animation, elapsed);
 
-// Update a particular animation
-void Animation_update(Animation* animation, long dt) {
-	// Do nothing if animation isn't playing
-	if (!animation->playing) {
-		return;
-	}
-	// Advance the timer
-	animation->frame_timer += dt;
-
-	// If the frame duration has passed, advance the frame and reset the timer
-	while (animation->frame_timer >= (animation->frame_duration * 1E9)) {
-		animation->frame_timer -= animation->frame_duration;
-		animation->current_frame = ++animation->current_frame % animation->total_frames;
-
-		// If frame wrapped around and loop is disabled, stop the animation
-		if (!animation->loop && animation->current_frame == 0) {
-			animation->playing = 0;
-			animation->current_frame = 0;
-			animation->frame_timer = 0;
+	// Once stopped, a non-looping animation rests on its first frame unless it should hide
+	if (frame == -1) {
+		if (animation->hide_when_stopped) {
+			return;
 		}
+		frame = 0;
 	}
+
+	Sprite_draw(&animation->frames[frame], x, y, NULL);
 }
 
-// Draw the animation to the screen at the given coordinates
-void Animation_draw(Animation* animation, int x, int y) {
-	//  If set to hide when stopped and the animation is stopped, don't draw it
-	if (!animation->playing && animation->hide_when_stopped) {
+void Animation_free(Animation* animation) {
+	if (animation == NULL) {
 		return;
 	}
 
-	// Source rectangle
-	SDL_Rect src;
-	src.x = animation->current_frame * animation->frame_width;
-	src.y = 0;
-	src.w = animation->frame_width;
-	src.h = animation->height;
-
-	// Destination rectangle
-	SDL_Rect dst;
-	dst.x = x;
-	dst.y = y;
-	dst.w = animation->frame_width;
-	dst.h = animation->height;
-
-	// Draw to the screen
-	SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255);
-	SDL_RenderCopy(renderer, animation->texture, &src, &dst);
+	free(animation->frames);
+	free(animation);
 }
-*/
-
@@ -0,0 +1,223 @@
+#include "batch.h"
+#include "graphics.h"
+#include "log.h"
+#include "memtrack.h"
+#include "util.h"
+
+#include <stddef.h>
+#include <string.h>
+
+// Attribute locations shared by the shader and the draw calls
+enum {
+	ATTRIB_CORNER = 0,
+	ATTRIB_RECT,
+	ATTRIB_SCROLL,
+	ATTRIB_TOP,
+	ATTRIB_BOTTOM,
+	ATTRIB_ORDER
+};
+
+// Scrolling quads are placed relative to the judge line, and culled once they
+// reach it. Quads below their group's watermark and culled quads are collapsed off screen.
+static const char* vertex_source =
+	"#version 120\n"
+	"attribute vec2 a_corner;\n"
+	"attribute vec4 a_rect;\n"
+	"attribute vec2 a_scroll;\n"
+	"attribute vec4 a_top;\n"
+	"attribute vec4 a_bottom;\n"
+	"attribute vec2 a_order;\n"
+	"uniform vec2 u_screen;\n"
+	"uniform vec3 u_view;\n"
+	"uniform float u_watermarks[16];\n"
+	"varying vec4 v_color;\n"
+	"void main() {\n"
+	"	float y = a_rect.y + a_scroll.y * (u_view.z - (a_scroll.x - u_view.x) * u_view.y);\n"
+	"	float hidden = step(0.0, a_order.x) * step(a_order.y + 0.5, u_watermarks[int(max(a_order.x, 0.0))]);\n"
+	"	float culled = max(hidden, a_scroll.y * step(u_view.z + 0.5, y + a_rect.w));\n"
+	"	vec2 p = mix(vec2(a_rect.x, y) + a_corner * a_rect.zw, vec2(-1.0e5), culled);\n"
+	"	gl_Position = vec4(p.x / u_screen.x * 2.0 - 1.0, 1.0 - p.y / u_screen.y * 2.0, 0.0, 1.0);\n"
+	"	v_color = mix(a_top, a_bottom, a_corner.y);\n"
+	"}\n";
+
+static const char* fragment_source =
+	"#version 120\n"
+	"varying vec4 v_color;\n"
+	"void main() {\n"
+	"	gl_FragColor = v_color;\n"
+	"}\n";
+
+static GLuint program;
+static GLuint corner_buffer;
+static GLint screen_location;
+static GLint view_location;
+static GLint watermarks_location;
+
+// Compile the quad shader and create the shared unit quad
+// Must be called on the thread that owns the OpenGL context
+int Batch_init() {
+	GLuint vertex = GLFuncs_compile_shader(GL_VERTEX_SHADER, vertex_source);
+	GLuint fragment = GLFuncs_compile_shader(GL_FRAGMENT_SHADER, fragment_source);
+
+	if (vertex == 0 || fragment == 0) {
+		return 0;
+	}
+
+	program = gl.CreateProgram();
+	gl.AttachShader(program, vertex);
+	gl.AttachShader(program, fragment);
+	gl.BindAttribLocation(program, ATTRIB_CORNER, "a_corner");
+	gl.BindAttribLocation(program, ATTRIB_RECT, "a_rect");
+	gl.BindAttribLocation(program, ATTRIB_SCROLL, "a_scroll");
+	gl.BindAttribLocation(program, ATTRIB_TOP, "a_top");
+	gl.BindAttribLocation(program, ATTRIB_BOTTOM, "a_bottom");
+	gl.BindAttribLocation(program, ATTRIB_ORDER, "a_order");
+	int linked = GLFuncs_link_program(program);
+	gl.DeleteShader(vertex);
+	gl.DeleteShader(fragment);
+
+	if (!linked) {
+		return 0;
+	}
+
+	screen_location = gl.GetUniformLocation(program, "u_screen");
+	view_location = gl.GetUniformLocation(program, "u_view");
+	watermarks_location = gl.GetUniformLocation(program, "u_watermarks");
+
+	gl.UseProgram(program);
+	gl.Uniform2f(screen_location, GRAPHICS_WIN_WIDTH, GRAPHICS_WIN_HEIGHT);
+	gl.UseProgram(0);
+
+	// Triangle strip corners of the unit quad every instance is stretched from
+	static const GLfloat corners[] = { 0.f, 0.f, 1.f, 0.f, 0.f, 1.f, 1.f, 1.f };
+	gl.GenBuffers(1, &corner_buffer);
+	gl.BindBuffer(GL_ARRAY_BUFFER, corner_buffer);
+	gl.BufferData(GL_ARRAY_BUFFER, sizeof corners, corners, GL_STATIC_DRAW);
+	gl.BindBuffer(GL_ARRAY_BUFFER, 0);
+
+	Log_debug("Successfully initialized quad batching");
+
+	return 1;
+}
+
+void Batch_shutdown() {
+	gl.DeleteBuffers(1, &corner_buffer);
+	gl.DeleteProgram(program);
+}
+
+// Create a batch with room for capacity quads to begin with
+// Dynamic batches are expected to be cleared, refilled and uploaded every frame
+Batch* Batch_create(int capacity, int dynamic) {
+	Batch* batch = Memtrack_calloc(MEMTRACK_RENDER, 1, sizeof(Batch));
+	batch->capacity = capacity > 0 ? capacity : 1;
+	batch->quads = Memtrack_calloc(MEMTRACK_RENDER, batch->capacity, sizeof(BatchQuad));
+	batch->dynamic = dynamic;
+
+	gl.GenBuffers(1, &batch->buffer);
+
+	return batch;
+}
+
+void Batch_clear(Batch* batch) {
+	batch->count = 0;
+}
+
+// Append a quad, growing the batch if needed
+// Returns the index of the new quad
+int Batch_add(Batch* batch, const BatchQuad* quad) {
+	if (batch->count == batch->capacity) {
+		int old_capacity = batch->capacity;
+		batch->capacity *= 2;
+		batch->quads = Memtrack_recalloc(MEMTRACK_RENDER, batch->quads, sizeof(BatchQuad), old_capacity, batch->capacity);
+	}
+
+	batch->quads[batch->count] = *quad;
+
+	return batch->count++;
+}
+
+// Send the batch's quads to the GPU
+void Batch_upload(Batch* batch) {
+	GLenum usage = batch->dynamic ? GL_STREAM_DRAW : GL_STATIC_DRAW;
+
+	gl.BindBuffer(GL_ARRAY_BUFFER, batch->buffer);
+
+	// Only reallocate GPU storage when the batch has grown
+	// The driver owns that storage, so it's counted by hand
+	if (batch->capacity != batch->uploaded_capacity) {
+		gl.BufferData(GL_ARRAY_BUFFER, sizeof(BatchQuad) * batch->capacity, NULL, usage);
+		Memtrack_untrack(MEMTRACK_RENDER, sizeof(BatchQuad) * batch->uploaded_capacity);
+		Memtrack_track(MEMTRACK_RENDER, sizeof(BatchQuad) * batch->capacity);
+		batch->uploaded_capacity = batch->capacity;
+	}
+
+	gl.BufferSubData(GL_ARRAY_BUFFER, 0, sizeof(BatchQuad) * batch->count, batch->quads);
+	gl.BindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+// Hide the quads of each group whose sequence is below that group's watermark
+// Groups beyond count are left with nothing hidden
+void Batch_set_watermarks(const int* watermarks, int count) {
+	GLfloat values[BATCH_MAX_GROUPS] = { 0 };
+
+	for (int i = 0; i < count && i < BATCH_MAX_GROUPS; i++) {
+		values[i] = (GLfloat)watermarks[i];
+	}
+
+	gl.UseProgram(program);
+	gl.Uniform1fv(watermarks_location, BATCH_MAX_GROUPS, values);
+}
+
+// Set where the chart currently is, for quads that scroll with it
+void Batch_set_view(double position, double measure_height, double judge_line) {
+	gl.UseProgram(program);
+	gl.Uniform3f(view_location, (GLfloat)position, (GLfloat)measure_height, (GLfloat)judge_line);
+}
+
+// Point an instanced attribute at a field of the quads, starting at quad first
+static void instance_attribute(GLuint location, GLint size, GLenum type, GLboolean normalized, size_t offset, int first) {
+	gl.EnableVertexAttribArray(location);
+	gl.VertexAttribPointer(location, size, type, normalized, sizeof(BatchQuad), (const GLvoid*)(offset + sizeof(BatchQuad) * first));
+	gl.VertexAttribDivisor(location, 1);
+}
+
+// Draw count quads of the batch starting at first, in a single instanced call
+void Batch_draw(Batch* batch, int first, int count) {
+	if (count <= 0 || first < 0 || first + count > batch->count) {
+		return;
+	}
+
+	gl.UseProgram(program);
+
+	gl.BindBuffer(GL_ARRAY_BUFFER, corner_buffer);
+	gl.EnableVertexAttribArray(ATTRIB_CORNER);
+	gl.VertexAttribPointer(ATTRIB_CORNER, 2, GL_FLOAT, GL_FALSE, 0, NULL);
+	gl.VertexAttribDivisor(ATTRIB_CORNER, 0);
+
+	gl.BindBuffer(GL_ARRAY_BUFFER, batch->buffer);
+	instance_attribute(ATTRIB_RECT, 4, GL_FLOAT, GL_FALSE, offsetof(BatchQuad, x), first);
+	instance_attribute(ATTRIB_SCROLL, 2, GL_FLOAT, GL_FALSE, offsetof(BatchQuad, position), first);
+	instance_attribute(ATTRIB_TOP, 4, GL_UNSIGNED_BYTE, GL_TRUE, offsetof(BatchQuad, top), first);
+	instance_attribute(ATTRIB_BOTTOM, 4, GL_UNSIGNED_BYTE, GL_TRUE, offsetof(BatchQuad, bottom), first);
+	instance_attribute(ATTRIB_ORDER, 2, GL_FLOAT, GL_FALSE, offsetof(BatchQuad, group), first);
+
+	gl.DrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, count);
+
+	for (GLuint i = ATTRIB_CORNER; i <= ATTRIB_ORDER; i++) {
+		gl.VertexAttribDivisor(i, 0);
+		gl.DisableVertexAttribArray(i);
+	}
+	gl.BindBuffer(GL_ARRAY_BUFFER, 0);
+	gl.UseProgram(0);
+}
+
+void Batch_free(Batch* batch) {
+	if (batch == NULL) {
+		return;
+	}
+
+	gl.DeleteBuffers(1, &batch->buffer);
+	Memtrack_untrack(MEMTRACK_RENDER, sizeof(BatchQuad) * batch->uploaded_capacity);
+	Memtrack_free(batch->quads);
+	Memtrack_free(batch);
+}
@@ -0,0 +1,256 @@
+#include "benchmark.h"
+#include "batch.h"
+#include "bga.h"
+#include "glfuncs.h"
+#include "graphics.h"
+#include "log.h"
+#include "play.h"
+#include "sprite.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef HAVE_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+
+static EGLDisplay display = EGL_NO_DISPLAY;
+static EGLSurface surface = EGL_NO_SURFACE;
+static EGLContext context = EGL_NO_CONTEXT;
+
+static void* get_proc_address(const char* name) {
+	return (void*)eglGetProcAddress(name);
+}
+
+// Create an offscreen OpenGL context the size of the window, preferring Mesa's
+// surfaceless platform so no display server is needed at all
+static int create_context() {
+	PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+
+	if (get_platform_display != NULL) {
+		display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+	}
+	if (display == EGL_NO_DISPLAY) {
+		display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+	}
+
+	if (display == EGL_NO_DISPLAY || !eglInitialize(display, NULL, NULL)) {
+		Log_fatal("Error initializing EGL: 0x%x", eglGetError());
+		return 0;
+	}
+
+	static const EGLint config_attributes[] = {
+		EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+		EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+		EGL_RED_SIZE, 8,
+		EGL_GREEN_SIZE, 8,
+		EGL_BLUE_SIZE, 8,
+		EGL_NONE
+	};
+	static const EGLint surface_attributes[] = {
+		EGL_WIDTH, GRAPHICS_WIN_WIDTH,
+		EGL_HEIGHT, GRAPHICS_WIN_HEIGHT,
+		EGL_NONE
+	};
+
+	EGLConfig config;
+	EGLint config_count;
+
+	if (!eglChooseConfig(display, config_attributes, &config, 1, &config_count) || config_count == 0) {
+		Log_fatal("No EGL config supports offscreen OpenGL rendering");
+		return 0;
+	}
+
+	surface = eglCreatePbufferSurface(display, config, surface_attributes);
+	eglBindAPI(EGL_OPENGL_API);
+	context = eglCreateContext(display, config, EGL_NO_CONTEXT, NULL);
+
+	if (surface == EGL_NO_SURFACE || context == EGL_NO_CONTEXT || !eglMakeCurrent(display, surface, surface, context)) {
+		Log_fatal("Error creating offscreen OpenGL context: 0x%x", eglGetError());
+		return 0;
+	}
+
+	Log_info("Benchmarking on %s (%s)", glGetString(GL_RENDERER), glGetString(GL_VERSION));
+
+	return 1;
+}
+
+static void destroy_context() {
+	if (display == EGL_NO_DISPLAY) {
+		return;
+	}
+
+	eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+	if (context != EGL_NO_CONTEXT) {
+		eglDestroyContext(display, context);
+	}
+	if (surface != EGL_NO_SURFACE) {
+		eglDestroySurface(display, surface);
+	}
+	eglTerminate(display);
+}
+
+static int compare_doubles(const void* a, const void* b) {
+	double x = *(const double*)a;
+	double y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+
+// Returns the value below which the given fraction of values fall
+static double percentile(const double* values, int count, double fraction) {
+	double* sorted = malloc(count * sizeof(double));
+	memcpy(sorted, values, count * sizeof(double));
+	qsort(sorted, count, sizeof(double), compare_doubles);
+
+	double value = sorted[(int)((count - 1) * fraction)];
+	free(sorted);
+
+	return value;
+}
+
+static double average(const double* values, int count) {
+	double total = 0.0;
+
+	for (int i = 0; i < count; i++) {
+		total += values[i];
+	}
+
+	return total / count;
+}
+
+// Replay the loaded chart offscreen for a number of frames, stepping the game
+// by exactly 1/fps between them, and report what each frame cost
+// Per-frame results go to BENCHMARK_REPORT_FILE and a summary to the log
+int Benchmark_run(int frames, int fps) {
+	if (frames <= 0 || fps <= 0) {
+		return 0;
+	}
+
+	if (!create_context()) {
+		destroy_context();
+		return 0;
+	}
+
+	if (!GLFuncs_load(get_proc_address) || !Batch_init() || !Sprite_init()) {
+		Log_fatal("OpenGL 2.1 with instanced arrays is required");
+		destroy_context();
+		return 0;
+	}
+
+	int has_timer_queries = GLFuncs_has_timer_queries();
+	GLuint query = 0;
+	if (has_timer_queries) {
+		gl.GenQueries(1, &query);
+	} else {
+		Log_warn("Timer queries are unsupported, GPU frame times won't be measured");
+	}
+
+	// Images are loaded as they're needed, so every run shows them on the same frames
+	Bga_set_synchronous(1);
+	Play_init_renderer();
+
+	glViewport(0, 0, GRAPHICS_WIN_WIDTH, GRAPHICS_WIN_HEIGHT);
+	glClearColor(0.f, 0.f, 0.f, 1.f);
+
+	double* cpu_times = calloc(frames, sizeof(double));
+	double* gpu_times = calloc(frames, sizeof(double));
+	double* draw_calls = calloc(frames, sizeof(double));
+	long frame_duration = 1000000000L / fps;
+
+	FILE* report = fopen(BENCHMARK_REPORT_FILE, "w");
+	if (report != NULL) {
+		fprintf(report, "frame,draw_calls,cpu_ms,gpu_ms\n");
+	} else {
+		Log_error("Couldn't open %s for writing", BENCHMARK_REPORT_FILE);
+	}
+
+	// The chart runs on a simulated clock rather than the real one, so every run
+	// sees the same positions whatever the host's timing
+	long long clock = get_time_ns();
+	Play_update(0, clock);
+
+	// Draw one frame untimed first, so driver warm-up and lazy shader compilation
+	// don't land in the results
+	if (has_timer_queries) {
+		gl.BeginQuery(GL_TIME_ELAPSED, query);
+	}
+	Graphics_clear();
+	Play_draw(clock);
+	if (has_timer_queries) {
+		gl.EndQuery(GL_TIME_ELAPSED);
+	}
+	glFinish();
+
+	Log_info("Rendering %d frames at a simulated %d fps", frames, fps);
+
+	for (int i = 0; i < frames; i++) {
+		clock += frame_duration;
+		Play_update(frame_duration, clock);
+
+		GLFuncs_reset_draw_calls();
+		long long start = get_time_ns();
+		if (has_timer_queries) {
+			gl.BeginQuery(GL_TIME_ELAPSED, query);
+		}
+
+		Graphics_clear();
+		Play_draw(clock);
+
+		if (has_timer_queries) {
+			gl.EndQuery(GL_TIME_ELAPSED);
+		}
+		long long end = get_time_ns();
+
+		// Waiting here is fine, since nothing is being presented
+		glFinish();
+
+		cpu_times[i] = (end - start) / 1E6;
+		draw_calls[i] = GLFuncs_get_draw_calls();
+		gpu_times[i] = -1.0;
+
+		if (has_timer_queries) {
+			GLuint64 elapsed;
+			gl.GetQueryObjectui64v(query, GL_QUERY_RESULT, &elapsed);
+			gpu_times[i] = elapsed / 1E6;
+		}
+
+		if (report != NULL) {
+			fprintf(report, "%d,%d,%.4f,%.4f\n", i, (int)draw_calls[i], cpu_times[i], gpu_times[i]);
+		}
+	}
+
+	if (report != NULL) {
+		fclose(report);
+	}
+
+	Log_info("Draw calls per frame: %.1f average, %.0f max", average(draw_calls, frames), percentile(draw_calls, frames, 1.0));
+	Log_info("CPU frame time: %.3fms average, %.3fms median, %.3fms 99th percentile, %.3fms max",
+		average(cpu_times, frames), percentile(cpu_times, frames, 0.5), percentile(cpu_times, frames, 0.99), percentile(cpu_times, frames, 1.0));
+	if (has_timer_queries) {
+		Log_info("GPU frame time: %.3fms average, %.3fms median, %.3fms 99th percentile, %.3fms max",
+			average(gpu_times, frames), percentile(gpu_times, frames, 0.5), percentile(gpu_times, frames, 0.99), percentile(gpu_times, frames, 1.0));
+		gl.DeleteQueries(1, &query);
+	}
+
+	free(cpu_times);
+	free(gpu_times);
+	free(draw_calls);
+
+	Play_destroy_renderer();
+	Sprite_shutdown();
+	Batch_shutdown();
+	destroy_context();
+
+	return 1;
+}
+
+#else
+
+int Benchmark_run(int frames, int fps) {
+	Log_fatal("Benchmarking needs EGL, which this build doesn't have");
+	return 0;
+}
+
+#endif
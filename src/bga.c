@@ -0,0 +1,472 @@
+#include "bga.h"
+#include "glfuncs.h"
+#include "log.h"
+#include "memtrack.h"
+#include "metrics.h"
+#include "sprite.h"
+#include "trace.h"
+#include "util.h"
+
+#include <string.h>
+#include <SDL2/SDL.h>
+#include <SDL2/SDL_image.h>
+
+// Images kept on the GPU at once, least recently used first to go
+#define TEXTURE_COUNT 32
+
+// Pixel buffers an image can be decoded straight into while it waits to be uploaded
+#define UPLOAD_SLOT_COUNT 4
+
+#define IMAGE_BYTES (BGA_SIZE * BGA_SIZE * 4)
+
+// The three image layers a chart can change
+enum {
+	LAYER_BASE = 0,
+	LAYER_OVERLAY,
+	LAYER_POOR,
+	LAYER_COUNT
+};
+
+// Which image a layer changes to, and where in the chart
+typedef struct {
+	double position;
+	int id;
+} BgaEvent;
+
+// Upload slots cycle from free, to mapped by the render thread, to filled by the
+// loader thread, and back to free once the render thread has uploaded them
+enum {
+	SLOT_FREE = 0,
+	SLOT_MAPPED,
+	SLOT_FILLED
+};
+
+typedef struct {
+	GLuint buffer;
+	void* pixels;
+	int id;
+	int texture;
+	SDL_atomic_t state;
+} UploadSlot;
+
+typedef struct {
+	GLuint texture;
+	int id;
+	long frame_used;
+} BgaTexture;
+
+// Sorted changes for each layer, built once at load
+static BgaEvent* events[LAYER_COUNT];
+static int event_counts[LAYER_COUNT];
+
+// Per #BMP id: the file, whether black should be transparent, which texture
+// holds it (-1 if none), and whether it is being loaded
+static char** files;
+static int* keyed;
+static int* resident;
+static int* pending;
+static int file_count;
+
+static BgaTexture textures[TEXTURE_COUNT];
+static UploadSlot slots[UPLOAD_SLOT_COUNT];
+static long frame_counter;
+
+static SDL_Thread* loader_thread;
+static SDL_sem* work;
+static SDL_atomic_t quitting;
+static int synchronous = 0;
+static Metric* decode_metric;
+
+// Add every object of a channel in the chart to a layer's events
+static void collect_events(BMS* bms, int channel_num, int layer) {
+	int capacity = 0;
+	int m = 0;
+
+	for (int i = 0; i < bms->measure_count; i++) {
+		if (bms->measures[i] == NULL) {
+			continue;
+		}
+
+		Measure* measure = bms->measures[i];
+		double start = bms->measure_positions[m];
+		double height = bms->measure_positions[m + 1] - start;
+		m++;
+
+		if (channel_num >= measure->channel_count || measure->channels[channel_num] == NULL) {
+			continue;
+		}
+
+		Channel* channel = measure->channels[channel_num];
+
+		for (int j = 0; j < channel->object_count; j++) {
+			int id = channel->objects[j]->id;
+
+			// Don't process rests
+			if (id == 0) {
+				continue;
+			}
+
+			if (event_counts[layer] == capacity) {
+				events[layer] = Memtrack_recalloc(MEMTRACK_RENDER, events[layer], sizeof(BgaEvent), capacity, capacity > 0 ? capacity * 2 : 64);
+				capacity = capacity > 0 ? capacity * 2 : 64;
+			}
+
+			events[layer][event_counts[layer]].position = start + (double)j / channel->object_count * height;
+			events[layer][event_counts[layer]].id = id;
+			event_counts[layer]++;
+
+			if (layer == LAYER_OVERLAY && id < file_count) {
+				keyed[id] = 1;
+			}
+		}
+	}
+}
+
+// Returns the index of the last event of a layer at or before a position, or -1
+static int find_event(int layer, double position) {
+	int low = -1;
+	int high = event_counts[layer] - 1;
+
+	while (low < high) {
+		int middle = (low + high + 1) / 2;
+
+		if (events[layer][middle].position <= position) {
+			low = middle;
+		} else {
+			high = middle - 1;
+		}
+	}
+
+	return low;
+}
+
+// Decode an image into a 256x256 RGBA buffer, centred at the top if it's smaller
+// Images that fail to load are left transparent
+static void decode_image(int id, unsigned char* pixels) {
+	memset(pixels, 0, IMAGE_BYTES);
+
+	if (id >= file_count || files[id] == NULL) {
+		return;
+	}
+
+	SDL_Surface* loaded = IMG_Load(files[id]);
+
+	if (loaded == NULL) {
+		Log_warn("Error loading BMP %s: %s", files[id], IMG_GetError());
+		return;
+	}
+
+	SDL_Surface* image = SDL_ConvertSurfaceFormat(loaded, SDL_PIXELFORMAT_RGBA32, 0);
+	SDL_FreeSurface(loaded);
+
+	if (image == NULL) {
+		return;
+	}
+
+	SDL_Surface* target = SDL_CreateRGBSurfaceWithFormatFrom(pixels, BGA_SIZE, BGA_SIZE, 32, BGA_SIZE * 4, SDL_PIXELFORMAT_RGBA32);
+	SDL_SetSurfaceBlendMode(image, SDL_BLENDMODE_NONE);
+
+	if (image->w <= BGA_SIZE && image->h <= BGA_SIZE) {
+		SDL_Rect dst = { (BGA_SIZE - image->w) / 2, 0, image->w, image->h };
+		SDL_BlitSurface(image, NULL, target, &dst);
+	} else {
+		SDL_BlitScaled(image, NULL, target, NULL);
+	}
+
+	SDL_FreeSurface(target);
+	SDL_FreeSurface(image);
+
+	// Black is see-through on the overlay layer
+	if (keyed[id]) {
+		for (int i = 0; i < IMAGE_BYTES; i += 4) {
+			if (pixels[i] == 0 && pixels[i + 1] == 0 && pixels[i + 2] == 0) {
+				pixels[i + 3] = 0;
+			}
+		}
+	}
+}
+
+// Decode a slot's image into its mapped pixel buffer and hand it back for upload
+static void fill_slot(UploadSlot* slot) {
+	long long start = get_time_ns();
+	long long span = Trace_begin();
+	decode_image(slot->id, slot->pixels);
+	Trace_end("Decode BGA", span);
+	Metrics_record(decode_metric, (int)((get_time_ns() - start) / 1000));
+	SDL_AtomicSet(&slot->state, SLOT_FILLED);
+}
+
+// Decode requested images into the pixel buffers the render thread has mapped
+static int loader_thread_main(void* data) {
+	Trace_name_thread("BGA");
+
+	while (1) {
+		SDL_SemWait(work);
+
+		if (SDL_AtomicGet(&quitting)) {
+			break;
+		}
+
+		for (int i = 0; i < UPLOAD_SLOT_COUNT; i++) {
+			if (SDL_AtomicGet(&slots[i].state) == SLOT_MAPPED) {
+				fill_slot(&slots[i]);
+			}
+		}
+	}
+
+	return 0;
+}
+
+// Have images decoded on the render thread as soon as they're requested, rather than
+// in the background, so which frames show them doesn't depend on thread timing
+// Set before Bga_init
+void Bga_set_synchronous(int enabled) {
+	synchronous = enabled;
+}
+
+// Build the image timeline, and create the textures, pixel buffers and loader thread
+// Must be called on the thread that owns the OpenGL context
+int Bga_init(BMS* bms) {
+	file_count = bms->bmp_def_count;
+	files = Memtrack_calloc(MEMTRACK_RENDER, file_count > 0 ? file_count : 1, sizeof(char*));
+	keyed = Memtrack_calloc(MEMTRACK_RENDER, file_count > 0 ? file_count : 1, sizeof(int));
+	resident = Memtrack_calloc(MEMTRACK_RENDER, file_count > 0 ? file_count : 1, sizeof(int));
+	pending = Memtrack_calloc(MEMTRACK_RENDER, file_count > 0 ? file_count : 1, sizeof(int));
+
+	for (int i = 0; i < file_count; i++) {
+		files[i] = bms->bmp_defs[i] != NULL ? Memtrack_strdup(MEMTRACK_RENDER, bms->bmp_defs[i]->file) : NULL;
+		resident[i] = -1;
+	}
+
+	collect_events(bms, CHANNEL_BGA, LAYER_BASE);
+	collect_events(bms, CHANNEL_LAYER, LAYER_OVERLAY);
+	collect_events(bms, CHANNEL_POOR_CHANGE, LAYER_POOR);
+
+	for (int i = 0; i < TEXTURE_COUNT; i++) {
+		glGenTextures(1, &textures[i].texture);
+		glBindTexture(GL_TEXTURE_2D, textures[i].texture);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, BGA_SIZE, BGA_SIZE, 0, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+		textures[i].id = -1;
+		textures[i].frame_used = -1;
+	}
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	for (int i = 0; i < UPLOAD_SLOT_COUNT; i++) {
+		gl.GenBuffers(1, &slots[i].buffer);
+		SDL_AtomicSet(&slots[i].state, SLOT_FREE);
+	}
+
+	// Textures and pixel buffers are the driver's, so they're counted by hand
+	Memtrack_track(MEMTRACK_RENDER, (TEXTURE_COUNT + UPLOAD_SLOT_COUNT) * (size_t)IMAGE_BYTES);
+
+	frame_counter = 0;
+	decode_metric = Metrics_histogram("bga.decode_us");
+	SDL_AtomicSet(&quitting, 0);
+	work = SDL_CreateSemaphore(0);
+	loader_thread = SDL_CreateThread(loader_thread_main, "BGA", NULL);
+
+	Log_debug("Loaded %d BGA, %d layer and %d POOR changes", event_counts[LAYER_BASE], event_counts[LAYER_OVERLAY], event_counts[LAYER_POOR]);
+
+	return 1;
+}
+
+// Copy decoded images from their pixel buffers into textures
+// The copy is done by the driver from the buffer, so this doesn't wait on it
+static void finish_uploads() {
+	for (int i = 0; i < UPLOAD_SLOT_COUNT; i++) {
+		UploadSlot* slot = &slots[i];
+
+		if (SDL_AtomicGet(&slot->state) != SLOT_FILLED) {
+			continue;
+		}
+
+		gl.BindBuffer(GL_PIXEL_UNPACK_BUFFER, slot->buffer);
+		gl.UnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		glBindTexture(GL_TEXTURE_2D, textures[slot->texture].texture);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, BGA_SIZE, BGA_SIZE, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+		glBindTexture(GL_TEXTURE_2D, 0);
+		gl.BindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+		textures[slot->texture].id = slot->id;
+		resident[slot->id] = slot->texture;
+		pending[slot->id] = 0;
+		slot->pixels = NULL;
+		SDL_AtomicSet(&slot->state, SLOT_FREE);
+	}
+}
+
+// Returns the texture that was least recently needed, or -1 if all are needed this frame
+static int find_victim() {
+	int victim = -1;
+
+	for (int i = 0; i < TEXTURE_COUNT; i++) {
+		if (textures[i].frame_used == frame_counter || textures[i].id == -2) {
+			continue;
+		}
+
+		if (victim == -1 || textures[i].frame_used < textures[victim].frame_used) {
+			victim = i;
+		}
+	}
+
+	return victim;
+}
+
+// Mark an image as needed this frame, and have it loaded if it isn't already
+// An id of -1 means no image. Returns 0 if there is no room to start loading it right now
+static int request_image(int id) {
+	if (id < 0 || id >= file_count) {
+		return 1;
+	}
+
+	if (resident[id] != -1) {
+		textures[resident[id]].frame_used = frame_counter;
+		return 1;
+	} else if (pending[id]) {
+		return 1;
+	}
+
+	int slot_index = -1;
+	for (int i = 0; i < UPLOAD_SLOT_COUNT; i++) {
+		if (SDL_AtomicGet(&slots[i].state) == SLOT_FREE) {
+			slot_index = i;
+			break;
+		}
+	}
+
+	int victim = find_victim();
+
+	if (slot_index == -1 || victim == -1) {
+		return 0;
+	}
+
+	// Evict whatever the texture held; it stays reserved until the upload lands
+	if (textures[victim].id >= 0) {
+		resident[textures[victim].id] = -1;
+	}
+	textures[victim].id = -2;
+	textures[victim].frame_used = frame_counter;
+
+	// Orphan the buffer's old storage so mapping it never waits on a previous upload
+	UploadSlot* slot = &slots[slot_index];
+	gl.BindBuffer(GL_PIXEL_UNPACK_BUFFER, slot->buffer);
+	gl.BufferData(GL_PIXEL_UNPACK_BUFFER, IMAGE_BYTES, NULL, GL_STREAM_DRAW);
+	slot->pixels = gl.MapBuffer(GL_PIXEL_UNPACK_BUFFER, GL_WRITE_ONLY);
+	gl.BindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+	if (slot->pixels == NULL) {
+		textures[victim].id = -1;
+		return 0;
+	}
+
+	slot->id = id;
+	slot->texture = victim;
+	pending[id] = 1;
+	SDL_AtomicSet(&slot->state, SLOT_MAPPED);
+
+	// Loading on the spot means the image is up this very frame
+	if (synchronous) {
+		fill_slot(slot);
+		finish_uploads();
+	} else {
+		SDL_SemPost(work);
+	}
+
+	return 1;
+}
+
+// Draw a layer's image if it is on the GPU
+// Until an image has loaded, whatever was there before stays up
+static void draw_image(int id, float x, float y, float size, const unsigned char* color) {
+	if (id >= 0 && id < file_count && resident[id] != -1) {
+		Sprite_draw_texture(textures[resident[id]].texture, x, y, size, size, color);
+	}
+}
+
+// Draw the images showing at a chart position, and start loading those coming up
+// in the next BGA_LOOKAHEAD seconds at the chart's current velocity
+// If poor is set, the POOR image is shown in place of the others
+void Bga_draw(double position, double velocity, int poor, float x, float y, float size) {
+	frame_counter++;
+
+	finish_uploads();
+
+	int current[LAYER_COUNT];
+	for (int i = 0; i < LAYER_COUNT; i++) {
+		int index = find_event(i, position);
+		current[i] = index >= 0 ? events[i][index].id : -1;
+	}
+
+	// #BMP00 is the POOR image until the chart changes it
+	if (current[LAYER_POOR] == -1 && file_count > 0 && files[0] != NULL) {
+		current[LAYER_POOR] = 0;
+	}
+
+	// What's on screen comes first, then upcoming images in the order they're needed
+	for (int i = 0; i < LAYER_COUNT; i++) {
+		request_image(current[i]);
+	}
+
+	double horizon = position + velocity * BGA_LOOKAHEAD;
+	for (int i = 0; i < LAYER_COUNT; i++) {
+		for (int j = find_event(i, position) + 1; j < event_counts[i] && events[i][j].position <= horizon; j++) {
+			if (!request_image(events[i][j].id)) {
+				break;
+			}
+		}
+	}
+
+	// Dim the BGA so notes drawn over it stay readable
+	static const unsigned char tint[4] = { 160, 160, 160, 255 };
+
+	if (poor) {
+		draw_image(current[LAYER_POOR], x, y, size, tint);
+	} else {
+		draw_image(current[LAYER_BASE], x, y, size, tint);
+		draw_image(current[LAYER_OVERLAY], x, y, size, tint);
+	}
+}
+
+// Stop the loader thread and release everything
+// Must be called on the thread that owns the OpenGL context
+void Bga_destroy() {
+	SDL_AtomicSet(&quitting, 1);
+	SDL_SemPost(work);
+	SDL_WaitThread(loader_thread, NULL);
+	SDL_DestroySemaphore(work);
+
+	for (int i = 0; i < UPLOAD_SLOT_COUNT; i++) {
+		if (SDL_AtomicGet(&slots[i].state) != SLOT_FREE) {
+			gl.BindBuffer(GL_PIXEL_UNPACK_BUFFER, slots[i].buffer);
+			gl.UnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+			gl.BindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		}
+		gl.DeleteBuffers(1, &slots[i].buffer);
+	}
+
+	for (int i = 0; i < TEXTURE_COUNT; i++) {
+		glDeleteTextures(1, &textures[i].texture);
+	}
+	Memtrack_untrack(MEMTRACK_RENDER, (TEXTURE_COUNT + UPLOAD_SLOT_COUNT) * (size_t)IMAGE_BYTES);
+
+	for (int i = 0; i < file_count; i++) {
+		Memtrack_free(files[i]);
+	}
+
+	for (int i = 0; i < LAYER_COUNT; i++) {
+		Memtrack_free(events[i]);
+		events[i] = NULL;
+		event_counts[i] = 0;
+	}
+
+	Memtrack_free(files);
+	Memtrack_free(keyed);
+	Memtrack_free(resident);
+	Memtrack_free(pending);
+	files = NULL;
+	file_count = 0;
+}
@@ -1,6 +1,8 @@
 #include "bms.h"
 #include "mixer.h"
 #include "log.h"
+#include "memtrack.h"
+#include "metrics.h"
 #include "util.h"
 
 #include <math.h>
@@ -34,6 +36,15 @@ static inline int is_visible_channel(int channel) {
 		(channel >= 217 && channel <= 251); // 2P long note
 }
 
+// Extensions to try, in order, when a definition names a file that doesn't exist
+static const char* wav_extensions[] = { "wav", "ogg", "flac", NULL };
+static const char* bmp_extensions[] = { "bmp", "png", "jpg", "jpeg", NULL };
+
+// Copy a header value, which may be NULL when it has no default
+static char* copy_string(const char* str) {
+	return str != NULL ? Memtrack_strdup(MEMTRACK_CHART_PARSE, str) : NULL;
+}
+
 // #PLAYER x
 static int parse_player(BMS* bms, char* command) {
 	if (stristr(command, "#PLAYER")) {
@@ -54,7 +65,8 @@ static int parse_player(BMS* bms, char* command) {
 static int parse_genre(BMS* bms, char* command) {
 	if (stristr(command, "#GENRE") || stristr(command, "#GENLE")) {
 		command += strlen("#GENRE");
-		bms->genre = strdup(command);
+		Memtrack_free(bms->genre);
+		bms->genre = copy_string(command);
 		return 1;
 	}
 
@@ -65,7 +77,8 @@ static int parse_genre(BMS* bms, char* command) {
 static int parse_artist(BMS* bms, char* command) {
 	if (stristr(command, "#ARTIST")) {
 		command += strlen("#ARTIST");
-		bms->artist = strdup(command);
+		Memtrack_free(bms->artist);
+		bms->artist = copy_string(command);
 		return 1;
 	}
 
@@ -80,10 +93,10 @@ static int parse_subartist(BMS* bms, char* command) {
 		// Resize the defs array
 		int old_count = bms->subartist_count;
 		bms->subartist_count++;
-		bms->subartists = recalloc(bms->subartists, sizeof(char*), old_count, bms->subartist_count);
+		bms->subartists = Memtrack_recalloc(MEMTRACK_CHART_PARSE, bms->subartists, sizeof(char*), old_count, bms->subartist_count);
 
 		// Create a new entry in the defs array
-		bms->subartists[old_count] = strdup(command);
+		bms->subartists[old_count] = Memtrack_strdup(MEMTRACK_CHART_PARSE, command);
 		return 1;
 	}
 
@@ -94,7 +107,8 @@ static int parse_subartist(BMS* bms, char* command) {
 static int parse_maker(BMS* bms, char* command) {
 	if (stristr(command, "#MAKER")) {
 		command += strlen("#MAKER");
-		bms->maker = strdup(command);
+		Memtrack_free(bms->maker);
+		bms->maker = copy_string(command);
 		return 1;
 	}
 
@@ -105,7 +119,8 @@ static int parse_maker(BMS* bms, char* command) {
 static int parse_title(BMS* bms, char* command) {
 	if (stristr(command, "#TITLE")) {
 		command += strlen("#TITLE");
-		bms->title = strdup(command);
+		Memtrack_free(bms->title);
+		bms->title = copy_string(command);
 		return 1;
 	}
 
@@ -116,7 +131,8 @@ static int parse_title(BMS* bms, char* command) {
 static int parse_subtitle(BMS* bms, char* command) {
 	if (stristr(command, "#SUBTITLE")) {
 		command += strlen("#SUBTITLE");
-		bms->subtitle = strdup(command);
+		Memtrack_free(bms->subtitle);
+		bms->subtitle = copy_string(command);
 		return 1;
 	}
 
@@ -169,6 +185,14 @@ static int parse_volwav(BMS* bms, char* command) {
 	return 0;
 }
 
+// Release a WAV definition's sample or stream, and free it
+static void free_wav_def(WavDef* def) {
+	Cache_release(def->sample);
+	Mixer_close_stream(def->stream);
+	Memtrack_free(def->file);
+	Memtrack_free(def);
+}
+
 // #WAVxx <filename>
 static int parse_wav(BMS* bms, char* command) {
 	if (stristr(command, "#WAV")) {
@@ -178,34 +202,66 @@ static int parse_wav(BMS* bms, char* command) {
 		char id_base36[] = {command[0], command[1], '\0'};
 		long id = strtol(id_base36, NULL, 36);
 
-		// Resize the defs array
+		// Resize the defs array if need be
+		// IDs can come in any order, so it only ever grows
 		int old_count = bms->wav_def_count;
-		bms->wav_def_count = id + 1;
-		bms->wav_defs = recalloc(bms->wav_defs, sizeof(WavDef*), old_count, bms->wav_def_count);
+		if (old_count <= id) {
+			bms->wav_def_count = id + 1;
+			bms->wav_defs = Memtrack_recalloc(MEMTRACK_CHART_PARSE, bms->wav_defs, sizeof(WavDef*), old_count, bms->wav_def_count);
+		}
 
 		command += 2;
 		trim(command);
 
+		// Find the file through the folder index, ignoring case and extension
+		char* file = Directory_resolve(bms->index, command, wav_extensions);
+
+		if (file == NULL) {
+			Log_error("Could not find WAV%ld (%s).", id, command);
+			return 0;
+		}
+
+		// Replace any earlier definition of this ID, which charts with
+		// #RANDOM branches often have, so its sample can leave the cache
+		if (bms->wav_defs[id] != NULL) {
+			free_wav_def(bms->wav_defs[id]);
+			bms->wav_defs[id] = NULL;
+		}
+
 		// Create a new entry in the defs array
-		bms->wav_defs[id] = malloc(sizeof(WavDef));
-		char file[1024];
-		strcpy(file, bms->directory);
-		strcat(file, "/");
-		strcat(file, command);
-		bms->wav_defs[id]->file = strdup(file);
-
-		// Open the file
-		float* buffer = NULL;
-		size_t size = 0;
-
-		if (!Mixer_load_file(bms->wav_defs[id]->file, &buffer, &size)) {
+		bms->wav_defs[id] = Memtrack_malloc(MEMTRACK_CHART_PARSE, sizeof(WavDef));
+		bms->wav_defs[id]->file = file;
+		bms->wav_defs[id]->data = NULL;
+		bms->wav_defs[id]->size = 0;
+		bms->wav_defs[id]->sample = NULL;
+		bms->wav_defs[id]->stream = NULL;
+
+		// Decode the file, or share it if another chart in the folder already did
+		int result;
+		Sample* sample = Cache_acquire(bms->wav_defs[id]->file, 0, &result);
+
+		// Long sounds (usually a full BGM track) aren't decoded, and are streamed from disk instead
+		if (result == MIXER_LOAD_TOO_LONG) {
+			bms->wav_defs[id]->stream = Mixer_open_stream(bms->wav_defs[id]->file);
+
+			if (bms->wav_defs[id]->stream != NULL) {
+				return 1;
+			}
+
+			// Every stream slot is taken, so it has to fit in memory after all
+			Log_warn("Could not stream WAV%ld (%s), decoding it whole instead.", id, command);
+			sample = Cache_acquire(bms->wav_defs[id]->file, 1, &result);
+		}
+
+		if (sample == NULL) {
 			Log_error("Could not open WAV%ld (%s).", id, command);
 			return 0;
 		}
 
 		// Extract the data
-		bms->wav_defs[id]->data = buffer;
-		bms->wav_defs[id]->size = size;
+		bms->wav_defs[id]->sample = sample;
+		bms->wav_defs[id]->data = sample->data;
+		bms->wav_defs[id]->size = sample->size;
 		return 1;
 	}
 
@@ -221,20 +277,37 @@ static int parse_bmp(BMS* bms, char* command) {
 		char id_base36[] = {command[0], command[1], '\0'};
 		long id = strtol(id_base36, NULL, 36);
 
-		// Resize the defs array
+		// Resize the defs array if need be
+		// IDs can come in any order, so it only ever grows
 		int old_count = bms->bmp_def_count;
-		bms->bmp_def_count = id + 1;
-		bms->bmp_defs = recalloc(bms->bmp_defs, sizeof(BmpDef*), old_count, bms->bmp_def_count);
+		if (old_count <= id) {
+			bms->bmp_def_count = id + 1;
+			bms->bmp_defs = Memtrack_recalloc(MEMTRACK_CHART_PARSE, bms->bmp_defs, sizeof(BmpDef*), old_count, bms->bmp_def_count);
+		}
 
 		command += 2;
+		trim(command);
+
+		// Find the file through the folder index, ignoring case and extension
+		char* file = Directory_resolve(bms->index, command, bmp_extensions);
+
+		// Keep the definition anyway, so a missing image only blanks the BGA
+		if (file == NULL) {
+			Log_warn("Could not find BMP%ld (%s).", id, command);
+			char path[1024];
+			snprintf(path, sizeof path, "%s/%s", bms->directory, command);
+			file = Memtrack_strdup(MEMTRACK_CHART_PARSE, path);
+		}
+
+		// Replace any earlier definition of this ID
+		if (bms->bmp_defs[id] != NULL) {
+			Memtrack_free(bms->bmp_defs[id]->file);
+			Memtrack_free(bms->bmp_defs[id]);
+		}
 
 		// Create a new entry in the defs array
-		bms->bmp_defs[id] = malloc(sizeof(BmpDef));
-		char file[1024];
-		strcpy(file, bms->directory);
-		strcat(file, "/");
-		strcat(file, command);
-		bms->bmp_defs[id]->file = strdup(file);
+		bms->bmp_defs[id] = Memtrack_malloc(MEMTRACK_CHART_PARSE, sizeof(BmpDef));
+		bms->bmp_defs[id]->file = file;
 		return 1;
 	}
 
@@ -251,10 +324,13 @@ static int parse_text(BMS* bms, char* command) {
 		char id_base36[] = {command[0], command[1], '\0'};
 		long id = strtol(id_base36, NULL, 36);
 
-		// Resize the defs array
+		// Resize the defs array if need be
+		// IDs can come in any order, so it only ever grows
 		int old_count = bms->text_def_count;
-		bms->text_def_count = id + 1;
-		bms->text_defs = recalloc(bms->text_defs, sizeof(char*), old_count, bms->text_def_count);
+		if (old_count <= id) {
+			bms->text_def_count = id + 1;
+			bms->text_defs = Memtrack_recalloc(MEMTRACK_CHART_PARSE, bms->text_defs, sizeof(char*), old_count, bms->text_def_count);
+		}
 
 		command += 2;
 
@@ -264,8 +340,9 @@ static int parse_text(BMS* bms, char* command) {
 			command[strlen(command) - 1] = '\0';
 		}
 
-		// Create a new entry in the defs array
-		bms->text_defs[id] = strdup(command);
+		// Create a new entry in the defs array, replacing any earlier one
+		Memtrack_free(bms->text_defs[id]);
+		bms->text_defs[id] = Memtrack_strdup(MEMTRACK_CHART_PARSE, command);
 		return 1;
 	}
 
@@ -281,7 +358,7 @@ static int parse_comment(BMS* bms, char* command) {
 		// Resize the defs array
 		int old_count = bms->comment_count;
 		bms->comment_count++;
-		bms->comments = recalloc(bms->comments, sizeof(char*), old_count, bms->comment_count);
+		bms->comments = Memtrack_recalloc(MEMTRACK_CHART_PARSE, bms->comments, sizeof(char*), old_count, bms->comment_count);
 
 		// Strip quotes
 		if (command[0] == '"') {
@@ -290,7 +367,7 @@ static int parse_comment(BMS* bms, char* command) {
 		}
 
 		// Create a new entry in the defs array
-		bms->comments[old_count] = strdup(command);
+		bms->comments[old_count] = Memtrack_strdup(MEMTRACK_CHART_PARSE, command);
 		return 1;
 	}
 
@@ -306,10 +383,13 @@ static int parse_bpmex(BMS* bms, char* command) {
 		char id_base36[] = {command[0], command[1], '\0'};
 		long id = strtol(id_base36, NULL, 36);
 
-		// Resize the defs array
+		// Resize the defs array if need be
+		// IDs can come in any order, so it only ever grows
 		int old_count = bms->bpm_def_count;
-		bms->bpm_def_count = id + 1;
-		bms->bpm_defs = recalloc(bms->bpm_defs, sizeof(double*), old_count, bms->bpm_def_count);
+		if (old_count <= id) {
+			bms->bpm_def_count = id + 1;
+			bms->bpm_defs = Memtrack_recalloc(MEMTRACK_CHART_PARSE, bms->bpm_defs, sizeof(double), old_count, bms->bpm_def_count);
+		}
 
 		command += 2;
 
@@ -336,13 +416,16 @@ static int parse_line(BMS* bms, char* command) {
 		char* message = command + strlen("#xxxyy:");
 
 		// Resize the measures array if need be
+		// Lines can come in any order, so it only ever grows
 		int old_count = bms->measure_count;
-		bms->measure_count = measure_num + 1;
-		bms->measures = recalloc(bms->measures, sizeof(Measure*), old_count, bms->measure_count);
+		if (old_count <= measure_num) {
+			bms->measure_count = measure_num + 1;
+			bms->measures = Memtrack_recalloc(MEMTRACK_CHART_OBJECTS, bms->measures, sizeof(Measure*), old_count, bms->measure_count);
+		}
 
 		// If the measure doesn't exist, create it
 		if (bms->measures[measure_num] == NULL) {
-			bms->measures[measure_num] = malloc(sizeof(Measure));
+			bms->measures[measure_num] = Memtrack_malloc(MEMTRACK_CHART_OBJECTS, sizeof(Measure));
 			bms->measures[measure_num]->channel_count = 0;
 			bms->measures[measure_num]->channels = NULL;
 			bms->measures[measure_num]->bgm_channel_count = 0;
@@ -367,7 +450,7 @@ static int parse_line(BMS* bms, char* command) {
 			// Incremement the BGM channel count and resize
 			int bgm_channel_index = bms->measures[measure_num]->bgm_channel_count;
 			bms->measures[measure_num]->bgm_channel_count++;
-			bms->measures[measure_num]->bgm_channels = recalloc(
+			bms->measures[measure_num]->bgm_channels = Memtrack_recalloc(MEMTRACK_CHART_OBJECTS,
 				bms->measures[measure_num]->bgm_channels,
 				sizeof(Channel*),
 				bgm_channel_index,
@@ -375,12 +458,12 @@ static int parse_line(BMS* bms, char* command) {
 			);
 
 			// Create a new BGM channel for this measure
-			bms->measures[measure_num]->bgm_channels[bgm_channel_index] = malloc(sizeof(Channel));
+			bms->measures[measure_num]->bgm_channels[bgm_channel_index] = Memtrack_malloc(MEMTRACK_CHART_OBJECTS, sizeof(Channel));
 			bms->measures[measure_num]->bgm_channels[bgm_channel_index]->objects = NULL;
 
 			// Count the objects and allocate an array of objects for this channel
 			bms->measures[measure_num]->bgm_channels[bgm_channel_index]->object_count = strlen(message) / 2;
-			bms->measures[measure_num]->bgm_channels[bgm_channel_index]->objects = calloc(
+			bms->measures[measure_num]->bgm_channels[bgm_channel_index]->objects = Memtrack_calloc(MEMTRACK_CHART_OBJECTS,
 				sizeof(Object*),
 				bms->measures[measure_num]->bgm_channels[bgm_channel_index]->object_count
 			);
@@ -391,7 +474,7 @@ static int parse_line(BMS* bms, char* command) {
 				char id_base36[] = {message[i * 2], message[i * 2 + 1], '\0'};
 				long id = strtol(id_base36, NULL, 36);
 
-				bms->measures[measure_num]->bgm_channels[bgm_channel_index]->objects[i] = malloc(sizeof(Object));
+				bms->measures[measure_num]->bgm_channels[bgm_channel_index]->objects[i] = Memtrack_malloc(MEMTRACK_CHART_OBJECTS, sizeof(Object));
 				bms->measures[measure_num]->bgm_channels[bgm_channel_index]->objects[i]->id = (int)id;
 				bms->measures[measure_num]->bgm_channels[bgm_channel_index]->objects[i]->activated = 0;
 			}
@@ -403,7 +486,7 @@ static int parse_line(BMS* bms, char* command) {
 			old_count = bms->measures[measure_num]->channel_count;
 			if (old_count <= channel_num) {
 				bms->measures[measure_num]->channel_count = channel_num + 1;
-				bms->measures[measure_num]->channels = recalloc(
+				bms->measures[measure_num]->channels = Memtrack_recalloc(MEMTRACK_CHART_OBJECTS,
 					bms->measures[measure_num]->channels,
 					sizeof(Channel*),
 					old_count,
@@ -413,19 +496,22 @@ static int parse_line(BMS* bms, char* command) {
 
 			// If the channel doesn't exist, create it
 			if (bms->measures[measure_num]->channels[channel_num] == NULL) {
-				bms->measures[measure_num]->channels[channel_num] = malloc(sizeof(Channel));
+				bms->measures[measure_num]->channels[channel_num] = Memtrack_malloc(MEMTRACK_CHART_OBJECTS, sizeof(Channel));
 				bms->measures[measure_num]->channels[channel_num]->objects = NULL;
 			}
 
 			// If an objects array already exists, free it so we can overwrite it
 			if (bms->measures[measure_num]->channels[channel_num]->objects != NULL) {
-				free(bms->measures[measure_num]->channels[channel_num]->objects);
+				for (int i = 0; i < bms->measures[measure_num]->channels[channel_num]->object_count; i++) {
+					Memtrack_free(bms->measures[measure_num]->channels[channel_num]->objects[i]);
+				}
+				Memtrack_free(bms->measures[measure_num]->channels[channel_num]->objects);
 				bms->measures[measure_num]->channels[channel_num]->objects = NULL;
 			}
 
 			// Count the objects and allocate an array of objects for this channel
 			bms->measures[measure_num]->channels[channel_num]->object_count = strlen(message) / 2;
-			bms->measures[measure_num]->channels[channel_num]->objects = calloc(
+			bms->measures[measure_num]->channels[channel_num]->objects = Memtrack_calloc(MEMTRACK_CHART_OBJECTS,
 				sizeof(Object*),
 				bms->measures[measure_num]->channels[channel_num]->object_count
 			);
@@ -436,12 +522,13 @@ static int parse_line(BMS* bms, char* command) {
 				char id_base36[] = {message[i * 2], message[i * 2 + 1], '\0'};
 				long id = strtol(id_base36, NULL, 36);
 
-				bms->measures[measure_num]->channels[channel_num]->objects[i] = malloc(sizeof(Object));
+				bms->measures[measure_num]->channels[channel_num]->objects[i] = Memtrack_malloc(MEMTRACK_CHART_OBJECTS, sizeof(Object));
 				bms->measures[measure_num]->channels[channel_num]->objects[i]->id = (int)id;
 				bms->measures[measure_num]->channels[channel_num]->objects[i]->visible = (int)id != 0;
 				bms->measures[measure_num]->channels[channel_num]->objects[i]->activated = 0;
 				bms->measures[measure_num]->channels[channel_num]->objects[i]->ypos = 0.0;
 				bms->measures[measure_num]->channels[channel_num]->objects[i]->lane = bms->lane_channels[channel_num];
+				bms->measures[measure_num]->channels[channel_num]->objects[i]->lane_index = -1;
 				bms->measures[measure_num]->channels[channel_num]->objects[i]->timing = 0.0;
 				bms->measures[measure_num]->channels[channel_num]->objects[i]->judgment = -1;
 			}
@@ -542,57 +629,149 @@ static void calculate_total_measures(BMS* bms) {
 	}
 }
 
-// Returns the nearest object for the specified lane
-static Object* get_nearest_object_for_lane(BMS* bms, int lane) {
-	double closest_timing = -1.0;
-	Object* closest_object = NULL;
+// Build the table of where each measure starts, in 4/4 measures from the start of the chart.
+// Entry i is the start of the i-th existing measure, and the last entry is the end of the chart.
+// Measures are as tall as their metre; there are no scroll speed changes to account for yet.
+static void calculate_measure_positions(BMS* bms) {
+	bms->measure_positions = Memtrack_calloc(MEMTRACK_CHART_OBJECTS, bms->total_measures + 1, sizeof(double));
 
+	int m = 0;
 	for (int i = 0; i < bms->measure_count; i++) {
 		if (bms->measures[i] == NULL) {
 			continue;
 		}
 
-		int channelid = strtol(get_channel_for_lane(bms, lane), NULL, 36);
+		bms->measure_positions[m + 1] = bms->measure_positions[m] + bms->measures[i]->metre;
+		m++;
+	}
+}
 
-		if (channelid >= bms->measures[i]->channel_count) {
+// Number each lane's visible objects in chart order, so a single index per lane
+// is enough to tell which of its notes have been judged, and list them by that index
+static void calculate_lane_indexes(BMS* bms) {
+	int counts[BMS_LANES] = { 0 };
+
+	for (int i = 0; i < bms->measure_count; i++) {
+		if (bms->measures[i] == NULL || bms->measures[i]->channels == NULL) {
 			continue;
 		}
 
-		Channel* channel = bms->measures[i]->channels[channelid];
+		for (int j = 0; j < bms->measures[i]->channel_count; j++) {
+			Channel* channel = bms->measures[i]->channels[j];
+			int lane = bms->lane_channels[j];
 
-		if (channel == NULL) {
+			if (channel == NULL || lane < 0 || lane >= BMS_LANES) {
+				continue;
+			}
+
+			for (int k = 0; k < channel->object_count; k++) {
+				if (channel->objects[k]->visible) {
+					channel->objects[k]->lane_index = counts[lane]++;
+				}
+			}
+		}
+	}
+
+	for (int lane = 0; lane < BMS_LANES; lane++) {
+		bms->lane_notes[lane] = Memtrack_calloc(MEMTRACK_CHART_OBJECTS, counts[lane] > 0 ? counts[lane] : 1, sizeof(LaneNote));
+		bms->lane_note_counts[lane] = counts[lane];
+		bms->lane_next[lane] = 0;
+	}
+	bms->missed = 0;
+
+	for (int i = 0; i < bms->measure_count; i++) {
+		if (bms->measures[i] == NULL || bms->measures[i]->channels == NULL) {
 			continue;
 		}
 
-		for (int j = 0; j < channel->object_count; j++) {
-			Object* object = channel->objects[j];
+		for (int j = 0; j < bms->measures[i]->channel_count; j++) {
+			Channel* channel = bms->measures[i]->channels[j];
+			int lane = bms->lane_channels[j];
 
-			if (object == NULL) {
-				Log_warn("Object is null!");
+			if (channel == NULL || lane < 0 || lane >= BMS_LANES) {
 				continue;
 			}
 
-			// Don't process rests
-			if (object->id == 0) {
-				continue;
+			for (int k = 0; k < channel->object_count; k++) {
+				if (channel->objects[k]->visible) {
+					LaneNote* note = &bms->lane_notes[lane][channel->objects[k]->lane_index];
+					note->object = channel->objects[k];
+					note->actual_measure = i + (double)k / channel->object_count;
+				}
 			}
+		}
+	}
+}
 
-			double object_actual_measure = i + (double)j / channel->object_count;
-			double object_timing = fabs(bms->current_actual_measure - object_actual_measure);
+// Move a lane's next note past those already judged, and those that went by more
+// than the judgment window before the given point in the chart
+static void advance_lane(BMS* bms, int lane, double actual_measure) {
+	double passed = actual_measure - BMS_JUDGE_WINDOW * bms->mps;
 
-			if (closest_timing < 0 || object_timing <= closest_timing) {
-				if (!object->activated) {
-					object->timing = (bms->current_actual_measure - object_actual_measure) / bms->mps;
-				}
-				closest_timing = object_timing;
-				closest_object = object;
-			} else if (object_timing > closest_timing) {
-				return closest_object;
-			}
+	while (bms->lane_next[lane] < bms->lane_note_counts[lane]) {
+		LaneNote* note = &bms->lane_notes[lane][bms->lane_next[lane]];
+
+		if (!note->object->activated && note->actual_measure >= passed) {
+			break;
+		}
+
+		if (!note->object->activated) {
+			bms->missed++;
 		}
+
+		bms->lane_next[lane]++;
 	}
+}
 
-	return closest_object;
+// Play the sound for a wav definition on a mixer bus, if it exists
+static void play_wav(BMS* bms, int id, int bus) {
+	if (id >= bms->wav_def_count || bms->wav_defs[id] == NULL) {
+		return;
+	}
+
+	WavDef* wav = bms->wav_defs[id];
+
+	if (wav->stream != NULL) {
+		Mixer_add_stream(wav->stream, bus);
+	} else if (wav->data != NULL) {
+		Mixer_add(wav->data, wav->size, bus);
+	}
+}
+
+// Returns the nearest unjudged object for the specified lane to a point in the chart
+// Only the notes from the lane's next one onwards can still be judged
+static Object* get_nearest_object_for_lane(BMS* bms, int lane, double actual_measure) {
+	if (lane < 0 || lane >= BMS_LANES) {
+		return NULL;
+	}
+
+	LaneNote* closest = NULL;
+	double closest_timing = 0.0;
+
+	for (int i = bms->lane_next[lane]; i < bms->lane_note_counts[lane]; i++) {
+		LaneNote* note = &bms->lane_notes[lane][i];
+
+		// Skip notes already judged, so quick presses on close notes each find their own
+		if (note->object->activated) {
+			continue;
+		}
+
+		double timing = fabs(actual_measure - note->actual_measure);
+
+		if (closest != NULL && timing > closest_timing) {
+			break;
+		}
+
+		closest = note;
+		closest_timing = timing;
+	}
+
+	if (closest == NULL) {
+		return NULL;
+	}
+
+	closest->object->timing = (actual_measure - closest->actual_measure) / bms->mps;
+	return closest->object;
 }
 
 // Returns the next object for the specified lane
@@ -623,7 +802,7 @@ static Object* get_next_object_for_lane(BMS* bms, int lane) {
 			Object* object = channel->objects[j];
 
 			if (object == NULL) {
-				Log_warn("Object is null!");
+				Log_limited(Log_warn, 5, "Object is null!");
 				continue;
 			}
 
@@ -648,26 +827,28 @@ BMS* BMS_load(const char* path) {
 		return NULL;
 	}
 
-	BMS* bms = malloc(sizeof(BMS));
+	BMS* bms = Memtrack_malloc(MEMTRACK_CHART_PARSE, sizeof(BMS));
 
 	// Copy the path in order to get basename and dirname
 	char file[1024];
 	strcpy(file, path);
 
 	// Initialize metadata fields
-	bms->file = strdup(basename(file));
-	bms->extension = strdup(get_extension(file));
-	bms->directory = strdup(dirname(file));
+	bms->file = Memtrack_strdup(MEMTRACK_CHART_PARSE, basename(file));
+	bms->extension = Memtrack_strdup(MEMTRACK_CHART_PARSE, get_extension(file));
+	bms->directory = Memtrack_strdup(MEMTRACK_CHART_PARSE, dirname(file));
+	bms->index = Directory_open(bms->directory);
 	bms->play_type = PLAY_SINGLE;
-	bms->genre = DEFAULT_GENRE;
-	bms->title = DEFAULT_TITLE;
-	bms->subtitle = DEFAULT_SUBTITLE;
+	bms->genre = copy_string(DEFAULT_GENRE);
+	bms->title = copy_string(DEFAULT_TITLE);
+	bms->subtitle = copy_string(DEFAULT_SUBTITLE);
 	bms->init_bpm = DEFAULT_BPM;
 	bms->play_level = DEFAULT_PLAYLEVEL;
 	bms->rank = DEFAULT_RANK;
 	bms->total = DEFAULT_TOTAL;
-	bms->artist = DEFAULT_ARTIST;
-	bms->maker = DEFAULT_MAKER;
+	bms->volwav = DEFAULT_VOLWAV;
+	bms->artist = copy_string(DEFAULT_ARTIST);
+	bms->maker = copy_string(DEFAULT_MAKER);
 	bms->subartists = NULL;
 	bms->subartist_count = 0;
 	bms->comments = NULL;
@@ -691,7 +872,8 @@ BMS* BMS_load(const char* path) {
 	// Initialize the channel-to-lane lookup table
 	init_lane_channels(bms);
 
-	// Iterate through each line and parse commands
+	// Iterate through each line and parse commands, which decodes the keysounds too
+	long long parse_start = get_time_ns();
 	char line[4096] = "";
 	while (fgets(line, sizeof line, fp)) {
 		char* command = strstr(line, "#");
@@ -727,6 +909,9 @@ BMS* BMS_load(const char* path) {
 		if (parse_line(bms, command)) continue;
 	}
 
+	long long layout_start = get_time_ns();
+	Metrics_set(Metrics_gauge("load.parse_ms"), (int)((layout_start - parse_start) / 1000000));
+
 	// Initialize helpers
 	bms->elapsed = 0;
 	bms->current_actual_measure = 0.0;
@@ -742,6 +927,14 @@ BMS* BMS_load(const char* path) {
 	// Calculate the total actual number of measures
 	calculate_total_measures(bms);
 
+	// Calculate where each measure starts
+	calculate_measure_positions(bms);
+
+	// Number the notes in each lane
+	calculate_lane_indexes(bms);
+
+	Metrics_set(Metrics_gauge("load.layout_ms"), (int)((get_time_ns() - layout_start) / 1000000));
+
 	Log_debug("Loaded BMS \"%s\"", bms->title);
 
 	return bms;
@@ -759,6 +952,12 @@ void BMS_step(BMS* bms, long dt) {
 	int measure_index = (int)bms->current_actual_measure;
 	bms->current_measure_part = bms->current_actual_measure - measure_index;
 
+	// Presses judged after this step happened after the last one, so notes are
+	// only past judging once they're out of the window from there
+	for (int i = 0; i < BMS_LANES; i++) {
+		advance_lane(bms, i, last_measure);
+	}
+
 	while (measure_index < bms->total_measures && bms->measures[measure_index] == NULL) {
 		bms->current_actual_measure += 1.0;
 		measure_index++;
@@ -784,7 +983,7 @@ void BMS_step(BMS* bms, long dt) {
 		Object* object = channel->objects[object_index];
 
 		if (object == NULL) {
-			Log_warn("Object is null!");
+			Log_limited(Log_warn, 5, "Object is null!");
 			continue;
 		}
 
@@ -793,8 +992,8 @@ void BMS_step(BMS* bms, long dt) {
 			continue;
 		}
 
-		if (!object->activated && bms->wav_defs[object->id] != NULL) {
-			Mixer_add(bms->wav_defs[object->id]->data, bms->wav_defs[object->id]->size);
+		if (!object->activated) {
+			play_wav(bms, object->id, MIXER_BUS_BGM);
 			object->activated = 1;
 		}
 	}
@@ -839,21 +1038,35 @@ void BMS_step(BMS* bms, long dt) {
 	}
 }
 
-void BMS_handle_button_press(BMS* bms, int lane) {
-	Object* object = get_nearest_object_for_lane(bms, lane);
+// Judge a press that happened offset nanoseconds of chart time from the current
+// position (negative if before it), so judgment isn't rounded to the last step
+// Keysounds aren't played here; see Play_handle_press
+// Returns the object judged by this press, or NULL if nothing was judged
+Object* BMS_handle_button_press(BMS* bms, int lane, long offset) {
+	double actual_measure = bms->current_actual_measure + bms->mps * ((double)offset / 1000000000.0);
+	Object* object = get_nearest_object_for_lane(bms, lane, actual_measure);
+	Object* judged = NULL;
 	if (object != NULL) {
-		if (!object->activated && object->timing >= -0.200 && object->timing <= 0.200) {
-			Log_debug("Button %d timing: %fms", lane, object->timing * 1000);
+		if (!object->activated && object->timing >= -BMS_JUDGE_WINDOW && object->timing <= BMS_JUDGE_WINDOW) {
+			Log_limited(Log_debug, 5, "Button %d timing: %fms", lane, object->timing * 1000);
 			object->activated = 1;
+			judged = object;
+			advance_lane(bms, lane, -1.0);
 		}
-		Mixer_add(bms->wav_defs[object->id]->data, bms->wav_defs[object->id]->size);
 	}
+	return judged;
+}
+
+// Play a keysound on the key bus
+// Only reads definitions fixed at load, so any thread may call this
+void BMS_play_keysound(BMS* bms, int id) {
+	play_wav(bms, id, MIXER_BUS_KEY);
 }
 
 // Returns all renderable objects (notes) for the whole chart
 Measure** BMS_get_renderable_objects(BMS* bms) {
 	// Create a structure with the same number of measures
-	Measure** measures = calloc(bms->total_measures, sizeof(Measure*));
+	Measure** measures = Memtrack_calloc(MEMTRACK_CHART_OBJECTS, bms->total_measures, sizeof(Measure*));
 
 	// Note: we keep a secondary counter m (measure index), because oftentimes charts
 	// will begin on measure 1 with a nonexistent measure 0, and we want to skip
@@ -865,7 +1078,7 @@ Measure** BMS_get_renderable_objects(BMS* bms) {
 		}
 
 		// Create a new measure in the output array
-		measures[m] = calloc(1, sizeof(Measure));
+		measures[m] = Memtrack_calloc(MEMTRACK_CHART_OBJECTS, 1, sizeof(Measure));
 
 		// Count the visible channels
 		int visible_channels[1400];
@@ -895,11 +1108,11 @@ Measure** BMS_get_renderable_objects(BMS* bms) {
 		}
 
 		// Allocate channels to the measure for every visible channel
-		measures[m]->channels = calloc(visible_channel_count, sizeof(Channel*));
+		measures[m]->channels = Memtrack_calloc(MEMTRACK_CHART_OBJECTS, visible_channel_count, sizeof(Channel*));
 
 		for (int j = 0; j < visible_channel_count; j++) {
 			// Allocate memory for this visible channel
-			measures[m]->channels[j] = calloc(1, sizeof(Channel));
+			measures[m]->channels[j] = Memtrack_calloc(MEMTRACK_CHART_OBJECTS, 1, sizeof(Channel));
 
 			// The index of this visible channel in the master data structure
 			int v = visible_channels[j];
@@ -926,13 +1139,10 @@ Measure** BMS_get_renderable_objects(BMS* bms) {
 			}
 
 			// Allocate enough memory for the returned array of visible objects
-			measures[m]->channels[j]->objects = calloc(visible_object_count, sizeof(Object*));
+			measures[m]->channels[j]->objects = Memtrack_calloc(MEMTRACK_CHART_OBJECTS, visible_object_count, sizeof(Object*));
 
 			// Copy visible objects to returned channel
 			for (int k = 0; k < visible_object_count; k++) {
-				// Allocate memory for this visible object
-				measures[m]->channels[j]->objects[k] = calloc(1, sizeof(Object));
-
 				// Get index of this visible object in the master data structure
 				int o = visible_objects[k];
 
@@ -956,66 +1166,143 @@ Measure** BMS_get_renderable_objects(BMS* bms) {
 	return measures;
 }
 
+// Returns the current position of the chart, in the same units as measure_positions
+double BMS_get_position(BMS* bms) {
+	int m = bms->current_measure;
+
+	if (m < 0) {
+		return 0.0;
+	} else if (m >= bms->total_measures) {
+		return bms->measure_positions[bms->total_measures];
+	}
+
+	double height = bms->measure_positions[m + 1] - bms->measure_positions[m];
+	return bms->measure_positions[m] + bms->current_measure_part * height;
+}
+
+// Returns how fast the position is currently advancing, per second of chart time
+// BMS_step advances one measure per measure duration whatever its metre, so
+// shorter and longer measures scroll at a speed scaled by their height
+double BMS_get_velocity(BMS* bms) {
+	int m = bms->current_measure;
+
+	if (m < 0 || m >= bms->total_measures) {
+		return 0.0;
+	}
+
+	return bms->mps * (bms->measure_positions[m + 1] - bms->measure_positions[m]);
+}
+
+// Binary search for the measure containing a position
+// Returns the index of the last measure starting at or before it, clamped to the chart
+int BMS_find_measure(BMS* bms, double position) {
+	int low = 0;
+	int high = bms->total_measures - 1;
+
+	while (low < high) {
+		int middle = (low + high + 1) / 2;
+
+		if (bms->measure_positions[middle] <= position) {
+			low = middle;
+		} else {
+			high = middle - 1;
+		}
+	}
+
+	return low;
+}
+
 // Free all memory used by a BMS structure
-// TODO: need to add BGM channels
 void BMS_free(BMS* bms) {
 	if (bms == NULL) {
 		return;
 	}
 
 	// Free the file name
-	free(bms->file);
+	Memtrack_free(bms->file);
 
 	// Free the extension
-	free(bms->extension);
+	Memtrack_free(bms->extension);
+
+	// Free the directory name and index
+	Memtrack_free(bms->directory);
+	Directory_free(bms->index);
 
-	// Free the directory name
-	free(bms->directory);
+	// Free header values
+	Memtrack_free(bms->genre);
+	Memtrack_free(bms->title);
+	Memtrack_free(bms->subtitle);
+	Memtrack_free(bms->artist);
+	Memtrack_free(bms->maker);
 
 	// Free subartists
 	if (bms->subartists != NULL) {
 		for (int i = 0; i < bms->subartist_count; i++) {
-			free(bms->subartists[i]);
+			Memtrack_free(bms->subartists[i]);
 		}
 
-		free(bms->subartists);
+		Memtrack_free(bms->subartists);
 	}
 
-	// Free wav definitions
+	// Free comments
+	if (bms->comments != NULL) {
+		for (int i = 0; i < bms->comment_count; i++) {
+			Memtrack_free(bms->comments[i]);
+		}
+
+		Memtrack_free(bms->comments);
+	}
+
+	// Stop anything still playing from this chart before its sounds go away
+	// If the mixer can't confirm it has, the sounds are kept rather than freed under it
+	int halted = Mixer_halt();
+
+	// Free wav definitions, leaving their samples in the cache for sibling charts
 	if (bms->wav_defs != NULL) {
 		for (int i = 0; i < bms->wav_def_count; i++) {
-			if (bms->wav_defs[i] != NULL) {
-				free(bms->wav_defs[i]);
+			if (bms->wav_defs[i] == NULL) {
+				continue;
+			}
+
+			if (halted) {
+				free_wav_def(bms->wav_defs[i]);
+			} else {
+				Memtrack_free(bms->wav_defs[i]->file);
+				Memtrack_free(bms->wav_defs[i]);
 			}
 		}
 
-		free(bms->wav_defs);
+		Memtrack_free(bms->wav_defs);
 	}
 
 	// Free bitmap definitions
 	if (bms->bmp_defs != NULL) {
 		for (int i = 0; i < bms->bmp_def_count; i++) {
 			if (bms->bmp_defs[i] != NULL) {
-				free(bms->bmp_defs[i]);
+				Memtrack_free(bms->bmp_defs[i]->file);
+				Memtrack_free(bms->bmp_defs[i]);
 			}
 		}
 
-		free(bms->bmp_defs);
+		Memtrack_free(bms->bmp_defs);
 	}
 
 	// Free text defs
 	if (bms->text_defs) {
 		for (int i = 0; i < bms->text_def_count; i++) {
 			if (bms->text_defs[i] != NULL) {
-				free(bms->text_defs[i]);
+				Memtrack_free(bms->text_defs[i]);
 			}
 		}
 
-		free(bms->text_defs);
+		Memtrack_free(bms->text_defs);
 	}
 
 	// Free BPM defs
-	free(bms->bpm_defs);
+	Memtrack_free(bms->bpm_defs);
+
+	// Free measure positions
+	Memtrack_free(bms->measure_positions);
 
 	// Free measures
 	if (bms->measures != NULL) {
@@ -1027,24 +1314,65 @@ void BMS_free(BMS* bms) {
 					if (bms->measures[i]->channels[j] != NULL) {
 						for (int k = 0; k < bms->measures[i]->channels[j]->object_count; k++) {
 							if (bms->measures[i]->channels[j]->objects[k] != NULL) {
-								free(bms->measures[i]->channels[j]->objects[k]);
+								Memtrack_free(bms->measures[i]->channels[j]->objects[k]);
 							}
 						}
-						free(bms->measures[i]->channels[j]);
+						Memtrack_free(bms->measures[i]->channels[j]->objects);
+						Memtrack_free(bms->measures[i]->channels[j]);
+					}
+				}
+				Memtrack_free(bms->measures[i]->channels);
+
+				// Free BGM channels
+				for (int j = 0; j < bms->measures[i]->bgm_channel_count; j++) {
+					for (int k = 0; k < bms->measures[i]->bgm_channels[j]->object_count; k++) {
+						Memtrack_free(bms->measures[i]->bgm_channels[j]->objects[k]);
 					}
+					Memtrack_free(bms->measures[i]->bgm_channels[j]->objects);
+					Memtrack_free(bms->measures[i]->bgm_channels[j]);
 				}
-				free(bms->measures[i]);
+				Memtrack_free(bms->measures[i]->bgm_channels);
+				Memtrack_free(bms->measures[i]);
 			}
 		}
-		free(bms->measures);
+		Memtrack_free(bms->measures);
+	}
+
+	// Free the lane lists
+	for (int i = 0; i < BMS_LANES; i++) {
+		Memtrack_free(bms->lane_notes[i]);
 	}
 
 	// Free the base struct
-	free(bms);
+	Memtrack_free(bms);
 
 	Log_debug("BMS successfully freed");
 }
 
+// Free what BMS_get_renderable_objects returned
+// The objects themselves belong to the chart, so only the arrays are freed
+void BMS_free_renderable_objects(BMS* bms, Measure** measures) {
+	if (measures == NULL) {
+		return;
+	}
+
+	for (int m = 0; m < bms->total_measures; m++) {
+		if (measures[m] == NULL) {
+			continue;
+		}
+
+		for (int j = 0; j < measures[m]->channel_count; j++) {
+			Memtrack_free(measures[m]->channels[j]->objects);
+			Memtrack_free(measures[m]->channels[j]);
+		}
+
+		Memtrack_free(measures[m]->channels);
+		Memtrack_free(measures[m]);
+	}
+
+	Memtrack_free(measures);
+}
+
 // Print out BMS header data to the console
 void BMS_print_info(BMS* bms) {
 	Log_info("Play type: %d", bms->play_type);
@@ -1114,7 +1442,7 @@ void BMS_print_info(BMS* bms) {
 								index += snprintf(message + index, 4096 - index, " %d", bms->measures[i]->channels[j]->objects[k]->id);
 							}
 						}
-						Log_info(message);
+						Log_info("%s", message);
 					}
 				}
 			}
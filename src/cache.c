@@ -0,0 +1,170 @@
+#include "cache.h"
+#include "mixer.h"
+#include "log.h"
+#include "memtrack.h"
+#include "metrics.h"
+#include "trace.h"
+#include "util.h"
+
+#include <string.h>
+
+#define NUM_BUCKETS 4096
+
+static Sample* buckets[NUM_BUCKETS];
+static size_t budget = CACHE_DEFAULT_BUDGET;
+static size_t total_bytes = 0;
+
+// Unreferenced samples, most recently released at the head
+static Sample* lru_head = NULL;
+static Sample* lru_tail = NULL;
+
+// FNV-1a hash of a path
+static unsigned int hash_path(const char* path) {
+	unsigned int hash = 2166136261u;
+
+	while (*path) {
+		hash ^= (unsigned char)*path++;
+		hash *= 16777619u;
+	}
+
+	return hash % NUM_BUCKETS;
+}
+
+static size_t sample_bytes(Sample* sample) {
+	return sample->size * sizeof(float);
+}
+
+static void lru_remove(Sample* sample) {
+	if (sample->lru_prev != NULL) {
+		sample->lru_prev->lru_next = sample->lru_next;
+	} else {
+		lru_head = sample->lru_next;
+	}
+
+	if (sample->lru_next != NULL) {
+		sample->lru_next->lru_prev = sample->lru_prev;
+	} else {
+		lru_tail = sample->lru_prev;
+	}
+
+	sample->lru_prev = NULL;
+	sample->lru_next = NULL;
+}
+
+static void lru_push_front(Sample* sample) {
+	sample->lru_prev = NULL;
+	sample->lru_next = lru_head;
+
+	if (lru_head != NULL) {
+		lru_head->lru_prev = sample;
+	} else {
+		lru_tail = sample;
+	}
+
+	lru_head = sample;
+}
+
+// Remove a sample from the cache and free it
+static void evict(Sample* sample) {
+	Sample** link = &buckets[hash_path(sample->path)];
+
+	while (*link != sample) {
+		link = &(*link)->next;
+	}
+	*link = sample->next;
+
+	lru_remove(sample);
+	total_bytes -= sample_bytes(sample);
+
+	Memtrack_free(sample->path);
+	Memtrack_free(sample->data);
+	Memtrack_free(sample);
+}
+
+// Evict the least recently used unreferenced samples until the cache fits its budget
+static void trim_to_budget() {
+	while (total_bytes > budget && lru_tail != NULL) {
+		evict(lru_tail);
+	}
+}
+
+// Set the memory budget, evicting unreferenced samples if necessary
+void Cache_set_budget(size_t bytes) {
+	budget = bytes;
+	trim_to_budget();
+}
+
+// Get a reference to the decoded sample for a file, decoding it only if it isn't cached
+// Long files are only decoded if decode_long is set
+// Returns NULL if the file wasn't decoded, with the reason in result as a MIXER_LOAD_ value
+Sample* Cache_acquire(const char* path, int decode_long, int* result) {
+	unsigned int bucket = hash_path(path);
+
+	for (Sample* sample = buckets[bucket]; sample != NULL; sample = sample->next) {
+		if (strcmp(sample->path, path) == 0) {
+			if (sample->refcount++ == 0) {
+				lru_remove(sample);
+			}
+			*result = MIXER_LOAD_DECODED;
+			return sample;
+		}
+	}
+
+	float* data = NULL;
+	size_t size = 0;
+
+	long long start = get_time_ns();
+	long long span = Trace_begin();
+	*result = Mixer_load_file(path, decode_long, &data, &size);
+	Trace_end("Decode keysound", span);
+
+	if (*result != MIXER_LOAD_DECODED) {
+		return NULL;
+	}
+
+	// Only decodes happen at load, so a lookup each time costs nothing worth noting
+	Metrics_add(Metrics_counter("load.decodes"), 1);
+	Metrics_add(Metrics_counter("load.decode_us"), (int)((get_time_ns() - start) / 1000));
+
+	Sample* sample = Memtrack_calloc(MEMTRACK_SAMPLES, 1, sizeof(Sample));
+	sample->path = Memtrack_strdup(MEMTRACK_SAMPLES, path);
+	sample->data = data;
+	sample->size = size;
+	sample->refcount = 1;
+	sample->next = buckets[bucket];
+	buckets[bucket] = sample;
+
+	total_bytes += sample_bytes(sample);
+	trim_to_budget();
+
+	return sample;
+}
+
+// Drop a reference to a sample
+// Samples with no references stay cached until the budget forces them out
+void Cache_release(Sample* sample) {
+	if (sample == NULL || sample->refcount == 0) {
+		return;
+	}
+
+	if (--sample->refcount == 0) {
+		lru_push_front(sample);
+		trim_to_budget();
+	}
+}
+
+// Returns the number of bytes of sample data currently held by the cache
+size_t Cache_get_size() {
+	return total_bytes;
+}
+
+// Free every cached sample, referenced or not
+void Cache_destroy() {
+	for (int i = 0; i < NUM_BUCKETS; i++) {
+		while (buckets[i] != NULL) {
+			evict(buckets[i]);
+		}
+	}
+
+	Log_debug("Cache successfully destroyed");
+}
@@ -0,0 +1,362 @@
+#include "capture.h"
+#include "glfuncs.h"
+#include "graphics.h"
+#include "log.h"
+#include "memtrack.h"
+#include "mixer.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sndfile.h>
+#include <SDL2/SDL.h>
+#include <SDL2/SDL_image.h>
+
+// Pixel pack buffers read into in turn, so a frame is only mapped once the GPU
+// has had a couple of frames to finish copying it
+#define READBACK_COUNT 3
+
+#define FRAME_BYTES (GRAPHICS_WIN_WIDTH * GRAPHICS_WIN_HEIGHT * 4)
+
+// Interleaved stereo samples buffered between the audio callback and the writer,
+// about 1.5 seconds at 44.1kHz
+#define AUDIO_RING_SAMPLES (1 << 17)
+
+#define PATH_LENGTH 1024
+
+// Frame indexes handed between the render thread and the writer thread, which
+// are the only producer and consumer of each ring
+typedef struct {
+	int items[CAPTURE_QUEUE_FRAMES];
+	SDL_atomic_t head;
+	SDL_atomic_t tail;
+} FrameRing;
+
+static SDL_atomic_t active;
+static char prefix[PATH_LENGTH];
+static int format;
+static long long start_time;
+
+// Frames the render thread can copy into, and frames waiting to be written
+static unsigned char* frames[CAPTURE_QUEUE_FRAMES];
+static long long frame_times[CAPTURE_QUEUE_FRAMES];
+static FrameRing free_frames;
+static FrameRing queued_frames;
+static SDL_atomic_t dropped_frames;
+
+// Written by the audio callback, read by the writer thread
+static float audio_ring[AUDIO_RING_SAMPLES];
+static SDL_atomic_t audio_written;
+static SDL_atomic_t audio_read;
+static SDL_atomic_t dropped_audio;
+
+static SDL_Thread* writer_thread;
+static SDL_sem* work;
+static SDL_atomic_t quitting;
+static SNDFILE* audio_file;
+static FILE* timing_file;
+
+// Only touched by the render thread
+static GLuint readback[READBACK_COUNT];
+static long long readback_times[READBACK_COUNT];
+static int readback_index;
+static int readback_pending;
+static int renderer_ready;
+
+static int ring_push(FrameRing* ring, int item) {
+	int head = SDL_AtomicGet(&ring->head);
+
+	if (head - SDL_AtomicGet(&ring->tail) >= CAPTURE_QUEUE_FRAMES) {
+		return 0;
+	}
+
+	ring->items[head % CAPTURE_QUEUE_FRAMES] = item;
+	SDL_AtomicSet(&ring->head, head + 1);
+	return 1;
+}
+
+static int ring_pop(FrameRing* ring, int* item) {
+	int tail = SDL_AtomicGet(&ring->tail);
+
+	if (tail == SDL_AtomicGet(&ring->head)) {
+		return 0;
+	}
+
+	*item = ring->items[tail % CAPTURE_QUEUE_FRAMES];
+	SDL_AtomicSet(&ring->tail, tail + 1);
+	return 1;
+}
+
+// Mixer tap, on the audio thread: copy the block out, or drop it if the writer
+// has fallen too far behind
+static void capture_audio(const float* samples, unsigned long frame_count) {
+	unsigned int count = frame_count * 2;
+	unsigned int written = SDL_AtomicGet(&audio_written);
+	unsigned int read = SDL_AtomicGet(&audio_read);
+
+	if (AUDIO_RING_SAMPLES - (written - read) < count) {
+		SDL_AtomicAdd(&dropped_audio, frame_count);
+		return;
+	}
+
+	for (unsigned int i = 0; i < count; i++) {
+		audio_ring[(written + i) % AUDIO_RING_SAMPLES] = samples[i];
+	}
+
+	SDL_AtomicSet(&audio_written, written + count);
+}
+
+// Write out whatever audio has been buffered
+static void drain_audio() {
+	unsigned int written = SDL_AtomicGet(&audio_written);
+	unsigned int read = SDL_AtomicGet(&audio_read);
+
+	while (read != written) {
+		unsigned int offset = read % AUDIO_RING_SAMPLES;
+		unsigned int count = written - read;
+
+		// Stop at the end of the ring, and carry on from the start next time round
+		if (offset + count > AUDIO_RING_SAMPLES) {
+			count = AUDIO_RING_SAMPLES - offset;
+		}
+
+		sf_write_float(audio_file, audio_ring + offset, count);
+		read += count;
+	}
+
+	SDL_AtomicSet(&audio_read, read);
+}
+
+// Flip a frame the right way up, make it opaque, and save it
+static void write_frame(int frame, int number, unsigned char* scratch) {
+	const int stride = GRAPHICS_WIN_WIDTH * 4;
+	char path[PATH_LENGTH];
+
+	for (int y = 0; y < GRAPHICS_WIN_HEIGHT; y++) {
+		memcpy(scratch + y * stride, frames[frame] + (GRAPHICS_WIN_HEIGHT - y - 1) * stride, stride);
+	}
+	for (int i = 3; i < FRAME_BYTES; i += 4) {
+		scratch[i] = 0xFF;
+	}
+
+	if (format == CAPTURE_PNG) {
+		snprintf(path, PATH_LENGTH, "%s_%06d.png", prefix, number);
+
+		SDL_Surface* surface = SDL_CreateRGBSurfaceWithFormatFrom(scratch, GRAPHICS_WIN_WIDTH, GRAPHICS_WIN_HEIGHT, 32, stride, SDL_PIXELFORMAT_RGBA32);
+		if (surface == NULL || IMG_SavePNG(surface, path) != 0) {
+			Log_error("Error writing %s: %s", path, IMG_GetError());
+		}
+		SDL_FreeSurface(surface);
+	} else {
+		snprintf(path, PATH_LENGTH, "%s_%06d.rgba", prefix, number);
+
+		FILE* file = fopen(path, "wb");
+		if (file == NULL || fwrite(scratch, 1, FRAME_BYTES, file) != FRAME_BYTES) {
+			Log_error("Error writing %s", path);
+		}
+		if (file != NULL) {
+			fclose(file);
+		}
+	}
+
+	if (timing_file != NULL) {
+		fprintf(timing_file, "%d,%.3f\n", number, (frame_times[frame] - start_time) / 1E6);
+	}
+}
+
+// Write frames and audio as they arrive, until told to stop and everything
+// queued has been written
+static int writer_thread_main(void* data) {
+	unsigned char* scratch = Memtrack_malloc(MEMTRACK_RENDER, FRAME_BYTES);
+	int frame_number = 0;
+
+	while (1) {
+		int stopping = SDL_AtomicGet(&quitting);
+
+		SDL_SemWaitTimeout(work, 50);
+
+		if (audio_file != NULL) {
+			drain_audio();
+		}
+
+		int frame;
+		while (ring_pop(&queued_frames, &frame)) {
+			write_frame(frame, frame_number++, scratch);
+			ring_push(&free_frames, frame);
+		}
+
+		if (stopping) {
+			break;
+		}
+	}
+
+	Memtrack_free(scratch);
+	Log_info("Captured %d frames to %s", frame_number, prefix);
+
+	return 0;
+}
+
+// Start recording gameplay: frames go to numbered files beginning with the prefix,
+// their times to <prefix>.csv, and the mixer's output to <prefix>.wav
+// Call after Mixer_init and before Graphics_init
+int Capture_start(const char* file_prefix, int file_format) {
+	char path[PATH_LENGTH];
+
+	snprintf(prefix, PATH_LENGTH, "%s", file_prefix);
+	format = file_format;
+
+	snprintf(path, PATH_LENGTH, "%s.csv", prefix);
+	timing_file = fopen(path, "w");
+	if (timing_file == NULL) {
+		Log_error("Couldn't open %s for writing", path);
+		return 0;
+	}
+	fprintf(timing_file, "frame,time_ms\n");
+
+	SF_INFO info = {0};
+	info.samplerate = Mixer_get_sample_rate();
+	info.channels = 2;
+	info.format = SF_FORMAT_WAV | SF_FORMAT_PCM_16;
+
+	snprintf(path, PATH_LENGTH, "%s.wav", prefix);
+	audio_file = sf_open(path, SFM_WRITE, &info);
+	if (audio_file == NULL) {
+		Log_error("Couldn't open %s for writing: %s", path, sf_strerror(NULL));
+		fclose(timing_file);
+		timing_file = NULL;
+		return 0;
+	}
+
+	for (int i = 0; i < CAPTURE_QUEUE_FRAMES; i++) {
+		frames[i] = Memtrack_malloc(MEMTRACK_RENDER, FRAME_BYTES);
+		ring_push(&free_frames, i);
+	}
+
+	start_time = get_time_ns();
+	SDL_AtomicSet(&quitting, 0);
+	work = SDL_CreateSemaphore(0);
+	writer_thread = SDL_CreateThread(writer_thread_main, "Capture", NULL);
+
+	Mixer_set_tap(capture_audio);
+	SDL_AtomicSet(&active, 1);
+
+	Log_info("Capturing to %s", prefix);
+
+	return 1;
+}
+
+// Finish writing everything captured
+// Call after Graphics_destroy, so no more frames can arrive
+void Capture_stop() {
+	if (!SDL_AtomicGet(&active)) {
+		return;
+	}
+
+	Mixer_set_tap(NULL);
+	SDL_AtomicSet(&active, 0);
+
+	SDL_AtomicSet(&quitting, 1);
+	SDL_SemPost(work);
+	SDL_WaitThread(writer_thread, NULL);
+	SDL_DestroySemaphore(work);
+
+	if (SDL_AtomicGet(&dropped_frames) > 0 || SDL_AtomicGet(&dropped_audio) > 0) {
+		Log_warn("Capture fell behind, dropping %d frames and %d audio samples", SDL_AtomicGet(&dropped_frames), SDL_AtomicGet(&dropped_audio));
+	}
+
+	sf_close(audio_file);
+	audio_file = NULL;
+	fclose(timing_file);
+	timing_file = NULL;
+
+	for (int i = 0; i < CAPTURE_QUEUE_FRAMES; i++) {
+		Memtrack_free(frames[i]);
+		frames[i] = NULL;
+	}
+}
+
+// Returns the format with the given name, or -1 if there isn't one
+int Capture_parse_format(const char* name) {
+	if (strcmp(name, "raw") == 0) {
+		return CAPTURE_RAW;
+	} else if (strcmp(name, "png") == 0) {
+		return CAPTURE_PNG;
+	}
+
+	return -1;
+}
+
+void Capture_init_renderer() {
+	if (!SDL_AtomicGet(&active)) {
+		return;
+	}
+
+	gl.GenBuffers(READBACK_COUNT, readback);
+	for (int i = 0; i < READBACK_COUNT; i++) {
+		gl.BindBuffer(GL_PIXEL_PACK_BUFFER, readback[i]);
+		gl.BufferData(GL_PIXEL_PACK_BUFFER, FRAME_BYTES, NULL, GL_STREAM_READ);
+	}
+	gl.BindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+	readback_index = 0;
+	readback_pending = 0;
+	renderer_ready = 1;
+}
+
+// Copy a finished readback into a free frame and queue it for the writer
+// Frames are dropped rather than waited for when the writer is behind
+static void collect_readback(int index) {
+	gl.BindBuffer(GL_PIXEL_PACK_BUFFER, readback[index]);
+	void* pixels = gl.MapBuffer(GL_PIXEL_PACK_BUFFER, GL_READ_ONLY);
+
+	if (pixels != NULL) {
+		int frame;
+		if (ring_pop(&free_frames, &frame)) {
+			memcpy(frames[frame], pixels, FRAME_BYTES);
+			frame_times[frame] = readback_times[index];
+			ring_push(&queued_frames, frame);
+			SDL_SemPost(work);
+		} else {
+			SDL_AtomicAdd(&dropped_frames, 1);
+		}
+		gl.UnmapBuffer(GL_PIXEL_PACK_BUFFER);
+	}
+}
+
+// Read back the frame just drawn, before it is presented
+// The copy happens asynchronously; the frame from two calls ago is collected now
+void Capture_frame() {
+	if (!renderer_ready) {
+		return;
+	}
+
+	gl.BindBuffer(GL_PIXEL_PACK_BUFFER, readback[readback_index]);
+	glReadPixels(0, 0, GRAPHICS_WIN_WIDTH, GRAPHICS_WIN_HEIGHT, GL_RGBA, GL_UNSIGNED_BYTE, NULL);
+	readback_times[readback_index] = get_time_ns();
+	readback_index = (readback_index + 1) % READBACK_COUNT;
+	readback_pending++;
+
+	// The oldest readback is the one about to be reused
+	if (readback_pending == READBACK_COUNT) {
+		collect_readback(readback_index);
+		readback_pending--;
+	}
+
+	gl.BindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+}
+
+void Capture_destroy_renderer() {
+	if (!renderer_ready) {
+		return;
+	}
+
+	// Collect the last few frames, oldest first
+	while (readback_pending > 0) {
+		collect_readback((readback_index - readback_pending + READBACK_COUNT) % READBACK_COUNT);
+		readback_pending--;
+	}
+
+	gl.BindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+	gl.DeleteBuffers(READBACK_COUNT, readback);
+	renderer_ready = 0;
+}
@@ -0,0 +1,202 @@
+#include "directory.h"
+#include "log.h"
+#include "memtrack.h"
+#include "util.h"
+
+#include <ctype.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// FNV-1a hash of a string
+static unsigned int hash_string(const char* str) {
+	unsigned int hash = 2166136261u;
+
+	while (*str) {
+		hash ^= (unsigned char)*str++;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+// Returns a lower-cased copy of the first length characters of a string
+static char* lowercase_copy(const char* str, size_t length) {
+	char* copy = Memtrack_malloc(MEMTRACK_CHART_PARSE, length + 1);
+
+	for (size_t i = 0; i < length; i++) {
+		copy[i] = tolower((unsigned char)str[i]);
+	}
+	copy[length] = '\0';
+
+	return copy;
+}
+
+// Split a file name into a lower-cased stem and extension
+static void split_name(const char* name, char** stem, char** extension) {
+	const char* ext = get_extension(name);
+	size_t stem_length = *ext ? (size_t)(ext - name - 1) : strlen(name);
+
+	*stem = lowercase_copy(name, stem_length);
+	*extension = lowercase_copy(ext, strlen(ext));
+}
+
+static void add_entry(Directory* directory, const char* name) {
+	DirectoryEntry* entry = Memtrack_calloc(MEMTRACK_CHART_PARSE, 1, sizeof(DirectoryEntry));
+	entry->name = Memtrack_strdup(MEMTRACK_CHART_PARSE, name);
+	split_name(name, &entry->stem, &entry->extension);
+
+	unsigned int bucket = hash_string(entry->stem) % directory->bucket_count;
+	entry->next = directory->buckets[bucket];
+	directory->buckets[bucket] = entry;
+	directory->entry_count++;
+}
+
+// List a directory into a new index
+// Returns NULL if the directory can't be read
+Directory* Directory_open(const char* path) {
+	DIR* dir = opendir(path);
+
+	if (dir == NULL) {
+		return NULL;
+	}
+
+	Directory* directory = Memtrack_calloc(MEMTRACK_CHART_PARSE, 1, sizeof(Directory));
+	directory->path = Memtrack_strdup(MEMTRACK_CHART_PARSE, path);
+	directory->bucket_count = 1024;
+	directory->buckets = Memtrack_calloc(MEMTRACK_CHART_PARSE, directory->bucket_count, sizeof(DirectoryEntry*));
+
+	struct dirent* dirent;
+	while ((dirent = readdir(dir)) != NULL) {
+		if (strcmp(dirent->d_name, ".") == 0 || strcmp(dirent->d_name, "..") == 0) {
+			continue;
+		}
+
+		add_entry(directory, dirent->d_name);
+	}
+
+	closedir(dir);
+
+	Log_debug("Indexed %d entries in %s", directory->entry_count, path);
+
+	return directory;
+}
+
+// Pick the best entry for a stem out of its bucket: an exact match first, then the same
+// extension in any case, then the first available extension from the fallback list
+static DirectoryEntry* find_entry(Directory* directory, const char* name, const char** extensions) {
+	char* stem;
+	char* extension;
+	split_name(name, &stem, &extension);
+
+	DirectoryEntry* bucket = directory->buckets[hash_string(stem) % directory->bucket_count];
+	DirectoryEntry* best = NULL;
+	int best_rank = -1;
+
+	for (DirectoryEntry* entry = bucket; entry != NULL; entry = entry->next) {
+		if (strcmp(entry->stem, stem) != 0) {
+			continue;
+		}
+
+		int rank = -1;
+
+		if (strcmp(entry->name, name) == 0) {
+			rank = 1000;
+		} else if (strcmp(entry->extension, extension) == 0) {
+			rank = 999;
+		} else if (extensions != NULL) {
+			for (int i = 0; extensions[i] != NULL; i++) {
+				if (strcmp(entry->extension, extensions[i]) == 0) {
+					rank = 998 - i;
+					break;
+				}
+			}
+		}
+
+		if (rank > best_rank) {
+			best = entry;
+			best_rank = rank;
+		}
+	}
+
+	Memtrack_free(stem);
+	Memtrack_free(extension);
+
+	return best;
+}
+
+// Resolve a file name relative to an indexed directory, ignoring case and falling back
+// to the given NULL-terminated list of lower-case extensions when the named file is missing.
+// Subdirectories in the name are resolved the same way, and are indexed on first use.
+// Returns a path allocated with Memtrack (free it with Memtrack_free), or NULL if nothing matches.
+char* Directory_resolve(Directory* directory, const char* name, const char** extensions) {
+	if (directory == NULL) {
+		return NULL;
+	}
+
+	// Charts written on Windows often use backslashes
+	char* relative = Memtrack_strdup(MEMTRACK_CHART_PARSE, name);
+	for (char* c = relative; *c; c++) {
+		if (*c == '\\') {
+			*c = '/';
+		}
+	}
+
+	char* path = NULL;
+	char* slash = strchr(relative, '/');
+
+	if (slash != NULL) {
+		// Resolve the first path component as a subdirectory, then recurse into it
+		*slash = '\0';
+		DirectoryEntry* entry = find_entry(directory, relative, NULL);
+
+		if (entry != NULL && !entry->child_indexed) {
+			char child_path[4096];
+			snprintf(child_path, sizeof child_path, "%s/%s", directory->path, entry->name);
+			entry->child = Directory_open(child_path);
+			entry->child_indexed = 1;
+		}
+
+		if (entry != NULL && entry->child != NULL) {
+			path = Directory_resolve(entry->child, slash + 1, extensions);
+		}
+	} else {
+		DirectoryEntry* entry = find_entry(directory, relative, extensions);
+
+		if (entry != NULL) {
+			size_t length = strlen(directory->path) + strlen(entry->name) + 2;
+			path = Memtrack_malloc(MEMTRACK_CHART_PARSE, length);
+			snprintf(path, length, "%s/%s", directory->path, entry->name);
+		}
+	}
+
+	Memtrack_free(relative);
+
+	return path;
+}
+
+// Free a directory index and any subdirectories indexed beneath it
+void Directory_free(Directory* directory) {
+	if (directory == NULL) {
+		return;
+	}
+
+	for (int i = 0; i < directory->bucket_count; i++) {
+		DirectoryEntry* entry = directory->buckets[i];
+
+		while (entry != NULL) {
+			DirectoryEntry* next = entry->next;
+			Directory_free(entry->child);
+			Memtrack_free(entry->name);
+			Memtrack_free(entry->stem);
+			Memtrack_free(entry->extension);
+			Memtrack_free(entry);
+			entry = next;
+		}
+	}
+
+	Memtrack_free(directory->buckets);
+	Memtrack_free(directory->path);
+	Memtrack_free(directory);
+}
@@ -0,0 +1,158 @@
+#include "glfuncs.h"
+#include "log.h"
+
+#include <stdlib.h>
+
+GLFuncs gl;
+
+static void* (*get_proc)(const char*);
+static int missing;
+
+// Every draw goes through instanced drawing, so counting calls to it counts draw calls
+static PFNGLDRAWARRAYSINSTANCEDARBPROC draw_arrays_instanced;
+static int draw_calls;
+
+static void APIENTRY count_draw_arrays_instanced(GLenum mode, GLint first, GLsizei count, GLsizei primcount) {
+	draw_calls++;
+	draw_arrays_instanced(mode, first, count, primcount);
+}
+
+// Look up a function by its core name, falling back to its ARB extension name,
+// since legacy contexts (notably on macOS) only expose instancing through ARB
+static void* load(const char* name, const char* arb_name) {
+	void* function = get_proc(name);
+
+	if (function == NULL && arb_name != NULL) {
+		function = get_proc(arb_name);
+	}
+
+	if (function == NULL) {
+		Log_error("Missing OpenGL function: %s", name);
+		missing++;
+	}
+
+	return function;
+}
+
+// Look up a function the game can do without
+static void* load_optional(const char* name, const char* ext_name) {
+	void* function = get_proc(name);
+
+	if (function == NULL && ext_name != NULL) {
+		function = get_proc(ext_name);
+	}
+
+	return function;
+}
+
+// Load every function in the table using the context's loader
+// Returns 0 if any of them is unavailable
+int GLFuncs_load(void* (*get_proc_address)(const char*)) {
+	get_proc = get_proc_address;
+	missing = 0;
+
+	gl.GenBuffers = load("glGenBuffers", "glGenBuffersARB");
+	gl.DeleteBuffers = load("glDeleteBuffers", "glDeleteBuffersARB");
+	gl.BindBuffer = load("glBindBuffer", "glBindBufferARB");
+	gl.BufferData = load("glBufferData", "glBufferDataARB");
+	gl.BufferSubData = load("glBufferSubData", "glBufferSubDataARB");
+	gl.MapBuffer = load("glMapBuffer", "glMapBufferARB");
+	gl.UnmapBuffer = load("glUnmapBuffer", "glUnmapBufferARB");
+
+	gl.CreateShader = load("glCreateShader", NULL);
+	gl.DeleteShader = load("glDeleteShader", NULL);
+	gl.ShaderSource = load("glShaderSource", NULL);
+	gl.CompileShader = load("glCompileShader", NULL);
+	gl.GetShaderiv = load("glGetShaderiv", NULL);
+	gl.GetShaderInfoLog = load("glGetShaderInfoLog", NULL);
+	gl.CreateProgram = load("glCreateProgram", NULL);
+	gl.DeleteProgram = load("glDeleteProgram", NULL);
+	gl.AttachShader = load("glAttachShader", NULL);
+	gl.BindAttribLocation = load("glBindAttribLocation", NULL);
+	gl.LinkProgram = load("glLinkProgram", NULL);
+	gl.GetProgramiv = load("glGetProgramiv", NULL);
+	gl.GetProgramInfoLog = load("glGetProgramInfoLog", NULL);
+	gl.UseProgram = load("glUseProgram", NULL);
+	gl.GetUniformLocation = load("glGetUniformLocation", NULL);
+	gl.Uniform1i = load("glUniform1i", NULL);
+	gl.Uniform2f = load("glUniform2f", NULL);
+	gl.Uniform3f = load("glUniform3f", NULL);
+	gl.Uniform1fv = load("glUniform1fv", NULL);
+
+	gl.EnableVertexAttribArray = load("glEnableVertexAttribArray", NULL);
+	gl.DisableVertexAttribArray = load("glDisableVertexAttribArray", NULL);
+	gl.VertexAttribPointer = load("glVertexAttribPointer", NULL);
+	gl.VertexAttribDivisor = load("glVertexAttribDivisor", "glVertexAttribDivisorARB");
+	draw_arrays_instanced = load("glDrawArraysInstanced", "glDrawArraysInstancedARB");
+	gl.DrawArraysInstanced = count_draw_arrays_instanced;
+
+	gl.GenQueries = load_optional("glGenQueries", "glGenQueriesARB");
+	gl.DeleteQueries = load_optional("glDeleteQueries", "glDeleteQueriesARB");
+	gl.BeginQuery = load_optional("glBeginQuery", "glBeginQueryARB");
+	gl.EndQuery = load_optional("glEndQuery", "glEndQueryARB");
+	gl.GetQueryObjectiv = load_optional("glGetQueryObjectiv", "glGetQueryObjectivARB");
+	gl.GetQueryObjectui64v = load_optional("glGetQueryObjectui64v", "glGetQueryObjectui64vEXT");
+
+	if (missing > 0) {
+		return 0;
+	}
+
+	Log_debug("Successfully loaded OpenGL functions");
+
+	return 1;
+}
+
+// Returns the number of draw calls made since the count was last reset
+int GLFuncs_get_draw_calls() {
+	return draw_calls;
+}
+
+void GLFuncs_reset_draw_calls() {
+	draw_calls = 0;
+}
+
+// Timer queries are optional, and only usable if every entry point loaded
+int GLFuncs_has_timer_queries() {
+	return gl.GenQueries != NULL && gl.DeleteQueries != NULL
+		&& gl.BeginQuery != NULL && gl.EndQuery != NULL
+		&& gl.GetQueryObjectiv != NULL && gl.GetQueryObjectui64v != NULL;
+}
+
+// Compile a shader, logging the compiler's message on failure
+// Returns 0 if it doesn't compile
+GLuint GLFuncs_compile_shader(GLenum type, const char* source) {
+	GLuint shader = gl.CreateShader(type);
+	gl.ShaderSource(shader, 1, &source, NULL);
+	gl.CompileShader(shader);
+
+	GLint status;
+	gl.GetShaderiv(shader, GL_COMPILE_STATUS, &status);
+
+	if (!status) {
+		char message[1024];
+		gl.GetShaderInfoLog(shader, sizeof message, NULL, message);
+		Log_error("Error compiling shader: %s", message);
+		gl.DeleteShader(shader);
+		return 0;
+	}
+
+	return shader;
+}
+
+// Link a program whose shaders are attached and attributes bound
+// Returns 0 and logs the linker's message if it doesn't link
+int GLFuncs_link_program(GLuint program) {
+	gl.LinkProgram(program);
+
+	GLint status;
+	gl.GetProgramiv(program, GL_LINK_STATUS, &status);
+
+	if (!status) {
+		char message[1024];
+		gl.GetProgramInfoLog(program, sizeof message, NULL, message);
+		Log_error("Error linking shader program: %s", message);
+		return 0;
+	}
+
+	return 1;
+}
@@ -1,11 +1,49 @@
 #include "graphics.h"
+#include "glfuncs.h"
+#include "batch.h"
+#include "capture.h"
+#include "hud.h"
+#include "sprite.h"
 #include "log.h"
+#include "metrics.h"
 #include "play.h"
+#include "scheduler.h"
+#include "trace.h"
+#include "util.h"
+
+#include <string.h>
+
+// Frames of GPU timer queries kept in flight, so reading a result never stalls
+#define GPU_QUERY_COUNT 4
+
+// How long before the predicted vblank a low-latency frame should be finished by
+#define LOW_LATENCY_MARGIN_NS 1000000LL
+
+// Weight of the newest frame in the smoothed frame times
+#define STATS_SMOOTHING 0.05
 
 static SDL_Window* window;
 static SDL_GLContext context;
 static SDL_Thread* render_thread;
-static int running, render_counter;
+static int running;
+
+// Pacing can be changed from any thread, and is picked up at the start of the next frame
+static SDL_atomic_t pacing_mode;
+static SDL_atomic_t pacing_fps;
+
+// Written by the render thread, read by anyone through Graphics_get_frame_stats
+static SDL_SpinLock stats_lock;
+static GraphicsFrameStats stats;
+
+static GLuint gpu_queries[GPU_QUERY_COUNT];
+static int gpu_queries_issued[GPU_QUERY_COUNT];
+static int gpu_query_index;
+static int has_timer_queries;
+
+static Metric* frames_metric;
+static Metric* frame_time_metric;
+static Metric* cpu_time_metric;
+static Metric* gpu_time_metric;
 
 int Graphics_init() {
 	window = SDL_CreateWindow(
@@ -31,7 +69,133 @@ int Graphics_init() {
 	return 1;
 }
 
+// Choose how frames are paced
+// fps is only used by GRAPHICS_PACING_CAPPED, and falls back to a default if not positive
+void Graphics_set_pacing(int mode, int fps) {
+	SDL_AtomicSet(&pacing_fps, fps > 0 ? fps : GRAPHICS_DEFAULT_FPS_CAP);
+	SDL_AtomicSet(&pacing_mode, mode);
+}
+
+// Returns the pacing mode with the given name, or -1 if there isn't one
+int Graphics_parse_pacing(const char* name) {
+	if (strcmp(name, "vsync") == 0) {
+		return GRAPHICS_PACING_VSYNC;
+	} else if (strcmp(name, "uncapped") == 0) {
+		return GRAPHICS_PACING_UNCAPPED;
+	} else if (strcmp(name, "capped") == 0) {
+		return GRAPHICS_PACING_CAPPED;
+	} else if (strcmp(name, "low-latency") == 0) {
+		return GRAPHICS_PACING_LOW_LATENCY;
+	}
+
+	return -1;
+}
+
+void Graphics_get_frame_stats(GraphicsFrameStats* out) {
+	SDL_AtomicLock(&stats_lock);
+	*out = stats;
+	SDL_AtomicUnlock(&stats_lock);
+}
+
+// Vsync is needed for the modes that wait for the display
+static void apply_swap_interval(int mode) {
+	if (mode == GRAPHICS_PACING_VSYNC) {
+		if (SDL_GL_SetSwapInterval(-1) == -1) {
+			SDL_GL_SetSwapInterval(1);
+		}
+	} else if (mode == GRAPHICS_PACING_LOW_LATENCY) {
+		SDL_GL_SetSwapInterval(1);
+	} else {
+		SDL_GL_SetSwapInterval(0);
+	}
+}
+
+// Returns the display's refresh period in nanoseconds, assuming 60 Hz if it is unknown
+static long long get_refresh_period() {
+	SDL_DisplayMode mode;
+
+	if (SDL_GetWindowDisplayMode(window, &mode) == 0 && mode.refresh_rate > 0) {
+		return 1000000000LL / mode.refresh_rate;
+	}
+
+	return 1000000000LL / 60;
+}
+
+// Start timing the GPU work for this frame, collecting the result of the frame
+// that last used the same query if the GPU has finished it
+// Returns that frame's GPU time in milliseconds, or -1 if there is none
+static double begin_gpu_timer() {
+	if (!has_timer_queries) {
+		return -1.0;
+	}
+
+	GLuint query = gpu_queries[gpu_query_index];
+	double gpu_ms = -1.0;
+
+	if (gpu_queries_issued[gpu_query_index]) {
+		GLint available = 0;
+		gl.GetQueryObjectiv(query, GL_QUERY_RESULT_AVAILABLE, &available);
+
+		if (available) {
+			GLuint64 elapsed;
+			gl.GetQueryObjectui64v(query, GL_QUERY_RESULT, &elapsed);
+			gpu_ms = elapsed / 1E6;
+		}
+	}
+
+	gl.BeginQuery(GL_TIME_ELAPSED, query);
+	gpu_queries_issued[gpu_query_index] = 1;
+
+	return gpu_ms;
+}
+
+static void end_gpu_timer() {
+	if (!has_timer_queries) {
+		return;
+	}
+
+	gl.EndQuery(GL_TIME_ELAPSED);
+	gpu_query_index = (gpu_query_index + 1) % GPU_QUERY_COUNT;
+}
+
+static double smooth(double average, double value) {
+	if (value < 0.0) {
+		return average;
+	} else if (average <= 0.0) {
+		return value;
+	}
+
+	return average + (value - average) * STATS_SMOOTHING;
+}
+
+static void record_frame(double frame_ms, double cpu_ms, double gpu_ms) {
+	SDL_AtomicLock(&stats_lock);
+	stats.frame_ms = frame_ms;
+	stats.cpu_ms = cpu_ms;
+	if (gpu_ms >= 0.0 || !has_timer_queries) {
+		stats.gpu_ms = gpu_ms;
+	}
+	stats.average_frame_ms = smooth(stats.average_frame_ms, frame_ms);
+	stats.average_cpu_ms = smooth(stats.average_cpu_ms, cpu_ms);
+	stats.average_gpu_ms = has_timer_queries ? smooth(stats.average_gpu_ms, gpu_ms) : -1.0;
+	SDL_AtomicUnlock(&stats_lock);
+
+	Metrics_add(frames_metric, 1);
+	Metrics_record(frame_time_metric, (int)(frame_ms * 1000));
+	Metrics_record(cpu_time_metric, (int)(cpu_ms * 1000));
+	if (gpu_ms >= 0.0) {
+		Metrics_record(gpu_time_metric, (int)(gpu_ms * 1000));
+	}
+}
+
 int Graphics_thread(void* data) {
+	Trace_name_thread("Render");
+
+	frames_metric = Metrics_counter("render.frames");
+	frame_time_metric = Metrics_histogram("render.frame_us");
+	cpu_time_metric = Metrics_histogram("render.cpu_us");
+	gpu_time_metric = Metrics_histogram("render.gpu_us");
+
 	running = 1;
 
 	context = SDL_GL_CreateContext(window);
@@ -43,22 +207,107 @@ int Graphics_thread(void* data) {
 
 	Log_debug("Successfully created OpenGL context");
 
-	// setting the projection matrix to match screen size is a temporary fix, move to using proper coords later
-	glOrtho(0, GRAPHICS_WIN_WIDTH, GRAPHICS_WIN_HEIGHT, 0, -1, 1);
-	if (SDL_GL_SetSwapInterval(-1) == -1) {
-		SDL_GL_SetSwapInterval(1);
+	if (!GLFuncs_load(SDL_GL_GetProcAddress) || !Batch_init() || !Sprite_init()) {
+		Log_fatal("OpenGL 2.1 with instanced arrays is required");
+		return 0;
 	}
+
+	has_timer_queries = GLFuncs_has_timer_queries();
+	if (has_timer_queries) {
+		gl.GenQueries(GPU_QUERY_COUNT, gpu_queries);
+	} else {
+		Log_warn("Timer queries are unsupported, GPU frame times won't be measured");
+	}
+
+	Play_init_renderer();
+	Capture_init_renderer();
+	Hud_init_renderer();
+
 	glClearColor(0.f, 0.f, 0.f, 1.f);
 
 	Log_debug("Beginning render thread main loop");
 
+	Scheduler* scheduler = Scheduler_create("Render", 0);
+	int applied_mode = -1;
+	long long refresh_period = get_refresh_period();
+	long long last_present = get_time_ns();
+	long long next_frame = last_present;
+	long long last_vblank = 0;
+
 	while (running) {
+		int mode = SDL_AtomicGet(&pacing_mode);
+
+		if (mode != applied_mode) {
+			apply_swap_interval(mode);
+			applied_mode = mode;
+			next_frame = get_time_ns();
+			last_vblank = 0;
+		}
+
+		if (mode == GRAPHICS_PACING_CAPPED) {
+			// Keep to a fixed schedule, but don't rush to catch up after a long frame
+			long long interval = 1000000000LL / SDL_AtomicGet(&pacing_fps);
+			long long now = get_time_ns();
+			next_frame += interval;
+			if (next_frame < now) {
+				next_frame = now;
+			}
+			Scheduler_wait_until(scheduler, next_frame);
+		} else if (mode == GRAPHICS_PACING_LOW_LATENCY && last_vblank > 0) {
+			// Start just late enough to finish before the next vblank, so the state
+			// drawn is as fresh as possible when it reaches the screen
+			long long cost = (long long)((stats.average_cpu_ms + (stats.average_gpu_ms > 0.0 ? stats.average_gpu_ms : 0.0)) * 1E6);
+			long long wake = last_vblank + refresh_period - cost - LOW_LATENCY_MARGIN_NS;
+			if (wake > get_time_ns()) {
+				Scheduler_wait_until(scheduler, wake);
+			}
+		}
+
+		long long frame_start = get_time_ns();
+		double gpu_ms = begin_gpu_timer();
+
+		long long span = Trace_begin();
 		Graphics_clear();
-		Play_draw();
+		Play_draw(get_time_ns());
+		Trace_end("Play_draw", span);
+
+		end_gpu_timer();
+		Capture_frame();
+		long long cpu_end = get_time_ns();
+
+		Hud_draw();
+
+		span = Trace_begin();
 		Graphics_present();
-		render_counter++;
+		Trace_end("Graphics_present", span);
+
+		// Wait for the swap to actually happen, so its time predicts the next vblank
+		if (mode == GRAPHICS_PACING_LOW_LATENCY) {
+			glFinish();
+			last_vblank = get_time_ns();
+		}
+
+		long long present = get_time_ns();
+		record_frame((present - last_present) / 1E6, (cpu_end - frame_start) / 1E6, gpu_ms);
+		last_present = present;
 	}
 
+	Scheduler_free(scheduler);
+
+	GraphicsFrameStats final_stats;
+	Graphics_get_frame_stats(&final_stats);
+	Log_info("Average frame time: %.2fms (CPU %.2fms, GPU %.2fms)", final_stats.average_frame_ms, final_stats.average_cpu_ms, final_stats.average_gpu_ms);
+
+	if (has_timer_queries) {
+		gl.DeleteQueries(GPU_QUERY_COUNT, gpu_queries);
+	}
+
+	Hud_destroy_renderer();
+	Capture_destroy_renderer();
+	Play_destroy_renderer();
+	Sprite_shutdown();
+	Batch_shutdown();
+
 	Log_debug("Ended render thread event loop");
 	return 1;
 }
@@ -78,11 +327,3 @@ void Graphics_destroy() {
 	SDL_DestroyWindow(window);
 	Log_debug("Graphics successfully destroyed");
 }
-
-int Graphics_get_render_counter() {
-	return render_counter;
-}
-
-void Graphics_reset_render_counter() {
-	render_counter = 0;
-}
@@ -0,0 +1,253 @@
+#include "hud.h"
+#include "batch.h"
+#include "glfuncs.h"
+#include "graphics.h"
+#include "metrics.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <SDL2/SDL.h>
+
+// Size of each font pixel, and the space a character takes up, in screen pixels
+#define FONT_SCALE 2
+#define CHAR_WIDTH (4 * FONT_SCALE)
+#define LINE_HEIGHT (7 * FONT_SCALE)
+
+// Layout of the panel in the top right corner
+#define GRAPH_BAR_WIDTH 2
+#define GRAPH_WIDTH (HUD_HISTORY * GRAPH_BAR_WIDTH)
+#define GRAPH_HEIGHT 36
+#define PANEL_PADDING 6
+#define PANEL_WIDTH (GRAPH_WIDTH + PANEL_PADDING * 2)
+#define PANEL_X (GRAPHICS_WIN_WIDTH - PANEL_WIDTH - 10)
+#define PANEL_Y 10
+
+#define GRAPH_FRAME 0
+#define GRAPH_JITTER 1
+#define GRAPH_AUDIO 2
+#define GRAPH_VOICES 3
+#define GRAPH_COUNT 4
+
+// A rolling graph, scaled to fit its largest value but never to less than min_scale
+typedef struct {
+	const char* label;
+	const char* unit;
+	double min_scale;
+	unsigned char color[4];
+	double values[HUD_HISTORY];
+} Graph;
+
+// 3x5 glyphs, one row per byte, with the leftmost pixel in the 4s bit
+static const unsigned char font[128][5] = {
+	['0'] = { 7, 5, 5, 5, 7 }, ['1'] = { 2, 6, 2, 2, 7 }, ['2'] = { 7, 1, 7, 4, 7 },
+	['3'] = { 7, 1, 3, 1, 7 }, ['4'] = { 5, 5, 7, 1, 1 }, ['5'] = { 7, 4, 7, 1, 7 },
+	['6'] = { 7, 4, 7, 5, 7 }, ['7'] = { 7, 1, 1, 1, 1 }, ['8'] = { 7, 5, 7, 5, 7 },
+	['9'] = { 7, 5, 7, 1, 7 },
+	['A'] = { 2, 5, 7, 5, 5 }, ['B'] = { 6, 5, 6, 5, 6 }, ['C'] = { 3, 4, 4, 4, 3 },
+	['D'] = { 6, 5, 5, 5, 6 }, ['E'] = { 7, 4, 6, 4, 7 }, ['F'] = { 7, 4, 6, 4, 4 },
+	['G'] = { 3, 4, 5, 5, 3 }, ['H'] = { 5, 5, 7, 5, 5 }, ['I'] = { 7, 2, 2, 2, 7 },
+	['J'] = { 1, 1, 1, 5, 2 }, ['K'] = { 5, 5, 6, 5, 5 }, ['L'] = { 4, 4, 4, 4, 7 },
+	['M'] = { 5, 7, 7, 5, 5 }, ['N'] = { 6, 5, 5, 5, 5 }, ['O'] = { 2, 5, 5, 5, 2 },
+	['P'] = { 6, 5, 6, 4, 4 }, ['Q'] = { 2, 5, 5, 6, 3 }, ['R'] = { 6, 5, 6, 5, 5 },
+	['S'] = { 3, 4, 2, 1, 6 }, ['T'] = { 7, 2, 2, 2, 2 }, ['U'] = { 5, 5, 5, 5, 7 },
+	['V'] = { 5, 5, 5, 5, 2 }, ['W'] = { 5, 5, 7, 7, 5 }, ['X'] = { 5, 5, 2, 5, 5 },
+	['Y'] = { 5, 5, 2, 2, 2 }, ['Z'] = { 7, 1, 2, 4, 7 },
+	['.'] = { 0, 0, 0, 0, 2 }, ['%'] = { 5, 1, 2, 4, 5 }, [':'] = { 0, 2, 0, 2, 0 },
+	['/'] = { 1, 1, 2, 4, 4 }, ['-'] = { 0, 0, 7, 0, 0 }
+};
+
+static SDL_atomic_t visible;
+static Batch* batch;
+static int history_position;
+
+static Graph graphs[GRAPH_COUNT] = {
+	{ "FRAME", "MS", 20.0, { 80, 220, 120, 255 } },
+	{ "TICK JITTER", "US", 500.0, { 240, 200, 60, 255 } },
+	{ "AUDIO LOAD", "%", 100.0, { 90, 160, 255, 255 } },
+	{ "VOICES", "", 16.0, { 220, 110, 220, 255 } }
+};
+
+// The logic scheduler, whose worst jitter is taken each frame
+// The lock keeps it from being freed while it's being read
+static Scheduler* scheduler;
+static SDL_SpinLock scheduler_lock;
+
+static Metric* load_metric;
+static Metric* voices_metric;
+
+static long long memory;
+static long long memory_checked;
+
+static void add_quad(float x, float y, float w, float h, const unsigned char* top, const unsigned char* bottom) {
+	BatchQuad quad;
+
+	quad.x = x;
+	quad.y = y;
+	quad.w = w;
+	quad.h = h;
+	quad.position = 0.0f;
+	quad.scroll = 0.0f;
+	quad.group = -1.0f;
+	quad.sequence = 0.0f;
+	memcpy(quad.top, top, 4);
+	memcpy(quad.bottom, bottom, 4);
+
+	Batch_add(batch, &quad);
+}
+
+// Add a line of text, with each run of lit pixels in a row as one quad
+// Characters without a glyph are drawn as spaces
+static void add_text(float x, float y, const char* text, const unsigned char* color) {
+	for (; *text != '\0'; text++, x += CHAR_WIDTH) {
+		const unsigned char* glyph = font[(unsigned char)*text & 127];
+
+		for (int row = 0; row < 5; row++) {
+			int column = 0;
+
+			while (column < 3) {
+				if (!(glyph[row] & (4 >> column))) {
+					column++;
+					continue;
+				}
+
+				int start = column;
+				while (column < 3 && (glyph[row] & (4 >> column))) {
+					column++;
+				}
+
+				add_quad(x + start * FONT_SCALE, y + row * FONT_SCALE, (column - start) * FONT_SCALE, FONT_SCALE, color, color);
+			}
+		}
+	}
+}
+
+// Add a graph's label, latest value and bars, with the oldest value on the left
+static void add_graph(Graph* graph, float x, float y) {
+	static const unsigned char text_color[4] = { 230, 230, 230, 255 };
+	static const unsigned char graph_background[4] = { 40, 40, 40, 200 };
+
+	double latest = graph->values[(history_position + HUD_HISTORY - 1) % HUD_HISTORY];
+	double scale = graph->min_scale;
+
+	for (int i = 0; i < HUD_HISTORY; i++) {
+		if (graph->values[i] > scale) {
+			scale = graph->values[i];
+		}
+	}
+
+	char text[64];
+	snprintf(text, sizeof(text), "%s %.*f%s", graph->label, latest < 10.0 && latest != (int)latest ? 1 : 0, latest, graph->unit);
+	add_text(x, y, text, text_color);
+
+	y += LINE_HEIGHT;
+	add_quad(x, y, GRAPH_WIDTH, GRAPH_HEIGHT, graph_background, graph_background);
+
+	unsigned char bottom[4] = { graph->color[0] / 2, graph->color[1] / 2, graph->color[2] / 2, graph->color[3] };
+
+	for (int i = 0; i < HUD_HISTORY; i++) {
+		double value = graph->values[(history_position + i) % HUD_HISTORY];
+		float height = (float)(value / scale * GRAPH_HEIGHT);
+
+		if (height >= 1.0f) {
+			add_quad(x + i * GRAPH_BAR_WIDTH, y + GRAPH_HEIGHT - height, GRAPH_BAR_WIDTH, height, graph->color, bottom);
+		}
+	}
+}
+
+// Take this frame's values for each graph, and the memory in use if it's shown
+static void sample(int shown) {
+	GraphicsFrameStats stats;
+	Graphics_get_frame_stats(&stats);
+
+	graphs[GRAPH_FRAME].values[history_position] = stats.frame_ms;
+	SDL_AtomicLock(&scheduler_lock);
+	graphs[GRAPH_JITTER].values[history_position] = scheduler != NULL ? Scheduler_take_max_jitter(scheduler) : 0;
+	SDL_AtomicUnlock(&scheduler_lock);
+	graphs[GRAPH_AUDIO].values[history_position] = Metrics_get(load_metric);
+	graphs[GRAPH_VOICES].values[history_position] = Metrics_get(voices_metric);
+	history_position = (history_position + 1) % HUD_HISTORY;
+
+	if (!shown) {
+		return;
+	}
+
+	long long now = get_time_ns();
+	if (now - memory_checked >= HUD_MEMORY_INTERVAL) {
+		memory = get_resident_memory();
+		memory_checked = now;
+	}
+}
+
+// Graph the worst tick jitter of a scheduler between frames, or stop with NULL
+// Ticks usually outnumber frames, so the last tick's jitter alone would miss most spikes
+void Hud_watch_scheduler(Scheduler* watched) {
+	SDL_AtomicLock(&scheduler_lock);
+	scheduler = watched;
+	SDL_AtomicUnlock(&scheduler_lock);
+}
+
+void Hud_toggle() {
+	SDL_AtomicSet(&visible, !SDL_AtomicGet(&visible));
+}
+
+int Hud_is_visible() {
+	return SDL_AtomicGet(&visible);
+}
+
+// Called on the render thread once its OpenGL context exists
+void Hud_init_renderer() {
+	batch = Batch_create(2048, 1);
+
+	// Registering finds the metrics whether or not their owners have started yet
+	load_metric = Metrics_gauge("audio.load_percent");
+	voices_metric = Metrics_gauge("audio.voices");
+}
+
+// Keeps sampling while hidden, so the graphs are full as soon as the HUD is shown,
+// but only reads the memory in use while it's up
+// Call after the frame has been timed and captured, so the HUD never shows up in either
+void Hud_draw() {
+	int shown = SDL_AtomicGet(&visible);
+
+	sample(shown);
+
+	if (!shown) {
+		return;
+	}
+
+	static const unsigned char panel_color[4] = { 0, 0, 0, 180 };
+	static const unsigned char text_color[4] = { 230, 230, 230, 255 };
+
+	float x = PANEL_X + PANEL_PADDING;
+	float y = PANEL_Y + PANEL_PADDING;
+	float graph_height = LINE_HEIGHT + GRAPH_HEIGHT + PANEL_PADDING;
+
+	Batch_clear(batch);
+	add_quad(PANEL_X, PANEL_Y, PANEL_WIDTH, PANEL_PADDING * 2 + LINE_HEIGHT + graph_height * GRAPH_COUNT, panel_color, panel_color);
+
+	for (int i = 0; i < GRAPH_COUNT; i++) {
+		add_graph(&graphs[i], x, y);
+		y += graph_height;
+	}
+
+	char text[64];
+	if (memory >= 0) {
+		snprintf(text, sizeof(text), "MEMORY %.1fMB", memory / (1024.0 * 1024.0));
+	} else {
+		snprintf(text, sizeof(text), "MEMORY UNKNOWN");
+	}
+	add_text(x, y, text, text_color);
+
+	Batch_upload(batch);
+
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	Batch_draw(batch, 0, batch->count);
+	glDisable(GL_BLEND);
+}
+
+void Hud_destroy_renderer() {
+	Batch_free(batch);
+	batch = NULL;
+}
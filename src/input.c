@@ -1,27 +1,86 @@
 #include "input.h"
 #include "log.h"
 
+#include <stdlib.h>
+
+// Bits of InputState.sources: the keyboard, then each device slot's buttons, then its axes
+#define SOURCE_KEYBOARD 1u
+#define SOURCE_GAMEPAD(slot) (1u << (1 + (slot)))
+#define SOURCE_AXIS(slot) (1u << (1 + INPUT_MAX_DEVICES + (slot)))
+
 static InputMapping bindings;
-static InputState last_state;
-static InputState current_state;
+static InputState state;
+static InputPressHandler press_handler;
 
-// Find the button index that the given scancode is bound to
-// Returns -1 if no binding is found
-static inline int get_button_for_scancode(SDL_Scancode key) {
-	for (int i = 0; i < NUM_BUTTONS; i++) {
-		if (bindings.scancodes[i] == key) {
-			return i;
-		}
+// Which button each scancode, gamepad button and axis triggers, or -1 for none
+// Rebuilt from the bindings whenever they change
+static int scancode_buttons[SDL_NUM_SCANCODES];
+static int gamepad_buttons[SDL_CONTROLLER_BUTTON_MAX];
+static int axis_buttons[SDL_CONTROLLER_AXIS_MAX];
+
+// Open gamepads, by slot
+static SDL_GameController* controllers[INPUT_MAX_DEVICES];
+static SDL_JoystickID controller_ids[INPUT_MAX_DEVICES];
+
+// Whether each button is down, for any thread to read
+static SDL_atomic_t down[NUM_BUTTONS];
+
+// Every press and release of each button, in order, until gameplay handles them
+// The event thread is the only producer and the logic thread the only consumer
+typedef struct {
+	InputEvent events[INPUT_QUEUE_SIZE];
+	SDL_atomic_t head;
+	SDL_atomic_t tail;
+} InputQueue;
+
+static InputQueue queues[NUM_BUTTONS];
+
+static void push_event(int button, int pressed, long long time) {
+	InputQueue* queue = &queues[button];
+	int head = SDL_AtomicGet(&queue->head);
+
+	if (head - SDL_AtomicGet(&queue->tail) >= INPUT_QUEUE_SIZE) {
+		Log_limited(Log_warn, 5, "Input queue for button %d is full, dropping an event", button);
+		return;
 	}
 
-	return -1;
+	InputEvent* event = &queue->events[head % INPUT_QUEUE_SIZE];
+	event->button = button;
+	event->pressed = pressed;
+	event->time = time;
+	SDL_AtomicSet(&queue->head, head + 1);
 }
 
-// Find the button index that the given gamepad button is bound to
-// Returns -1 if no binding is found
-static inline int get_button_for_gamepad(SDL_GameControllerButton button) {
+// Fill the reverse lookup tables from the bindings
+static void rebuild_lookup() {
+	for (int i = 0; i < SDL_NUM_SCANCODES; i++) {
+		scancode_buttons[i] = -1;
+	}
+	for (int i = 0; i < SDL_CONTROLLER_BUTTON_MAX; i++) {
+		gamepad_buttons[i] = -1;
+	}
+	for (int i = 0; i < SDL_CONTROLLER_AXIS_MAX; i++) {
+		axis_buttons[i] = -1;
+	}
+
 	for (int i = 0; i < NUM_BUTTONS; i++) {
-		if (bindings.gamepad[i] == button) {
+		if (bindings.scancodes[i] > SDL_SCANCODE_UNKNOWN && bindings.scancodes[i] < SDL_NUM_SCANCODES) {
+			scancode_buttons[bindings.scancodes[i]] = i;
+		}
+		if (bindings.gamepad[i] > SDL_CONTROLLER_BUTTON_INVALID && bindings.gamepad[i] < SDL_CONTROLLER_BUTTON_MAX) {
+			gamepad_buttons[bindings.gamepad[i]] = i;
+		}
+		if (bindings.axes[i] > SDL_CONTROLLER_AXIS_INVALID && bindings.axes[i] < SDL_CONTROLLER_AXIS_MAX) {
+			axis_buttons[bindings.axes[i]] = i;
+		}
+	}
+}
+
+// Find the slot of an open gamepad
+// Returns -1 if it isn't one of ours
+static inline int get_device_slot(SDL_JoystickID device) {
+	for (int i = 0; i < INPUT_MAX_DEVICES; i++) {
+		if (controllers[i] != NULL && controller_ids[i] == device) {
 			return i;
 		}
 	}
@@ -32,18 +91,21 @@ static inline int get_button_for_gamepad(SDL_GameControllerButton button) {
 // Initialize the input module
 int Input_init() {
 	for (int i = 0; i < NUM_BUTTONS; i++) {
-		bindings.scancodes[i] = 0;
-		bindings.gamepad[i] = 0;
-		last_state.buttons[i] = 0;
-		last_state.pressed[i] = 0;
-		last_state.released[i] = 0;
-		last_state.scancodes[i] = 0;
-		last_state.gamepad[i] = 0;
-		current_state.buttons[i] = 0;
-		current_state.pressed[i] = 0;
-		current_state.released[i] = 0;
-		current_state.scancodes[i] = 0;
-		current_state.gamepad[i] = 0;
+		bindings.scancodes[i] = SDL_SCANCODE_UNKNOWN;
+		bindings.gamepad[i] = SDL_CONTROLLER_BUTTON_INVALID;
+		bindings.axes[i] = SDL_CONTROLLER_AXIS_INVALID;
+		state.sources[i] = 0;
+		SDL_AtomicSet(&down[i], 0);
+		SDL_AtomicSet(&queues[i].head, 0);
+		SDL_AtomicSet(&queues[i].tail, 0);
+	}
+
+	for (int i = 0; i < INPUT_MAX_DEVICES; i++) {
+		controllers[i] = NULL;
+		for (int j = 0; j < SDL_CONTROLLER_AXIS_MAX; j++) {
+			state.axes[i][j].valid = 0;
+			state.axes[i][j].direction = 0;
+		}
 	}
 
 	Input_set_default_bindings();
@@ -53,9 +115,20 @@ int Input_init() {
 	return 1;
 }
 
+// Close any gamepads still open
+void Input_destroy() {
+	for (int i = 0; i < INPUT_MAX_DEVICES; i++) {
+		if (controllers[i] != NULL) {
+			SDL_GameControllerClose(controllers[i]);
+			controllers[i] = NULL;
+		}
+	}
+}
+
 // Set default bindings to be suitable for IIDX SP / pop'n style charts
 //        S D F G         2 4 6 8
 // Shift Z X C V B    TT 1 3 5 7 9
+// No axes are bound, since a gamepad's sticks aren't turntables; see Input_bind_axis
 void Input_set_default_bindings() {
 	bindings.scancodes[0] = SDL_SCANCODE_Z;
 	bindings.scancodes[1] = SDL_SCANCODE_S;
@@ -66,71 +139,247 @@ void Input_set_default_bindings() {
 	bindings.scancodes[6] = SDL_SCANCODE_V;
 	bindings.scancodes[7] = SDL_SCANCODE_G;
 	bindings.scancodes[8] = SDL_SCANCODE_B;
-}
 
-// Handle a key being pressed
-void Input_key_pressed(SDL_Scancode key) {
-	int index = get_button_for_scancode(key);
+	rebuild_lookup();
+}
 
-	if (index == -1) {
+// Bind a key to a button, taking it off whatever button had it before
+// Bindings should only change on the event thread
+void Input_bind_key(int button, SDL_Scancode key) {
+	if (button < 0 || button >= NUM_BUTTONS) {
 		return;
 	}
 
-	current_state.scancodes[index] = 1;
+	for (int i = 0; i < NUM_BUTTONS; i++) {
+		if (bindings.scancodes[i] == key) {
+			bindings.scancodes[i] = SDL_SCANCODE_UNKNOWN;
+		}
+	}
+
+	bindings.scancodes[button] = key;
+	rebuild_lookup();
 }
 
-// Handle a key being released
-void Input_key_released(SDL_Scancode key) {
-	int index = get_button_for_scancode(key);
+// Bind a gamepad button, on any gamepad, to a button
+void Input_bind_gamepad(int button, SDL_GameControllerButton gamepad_button) {
+	if (button < 0 || button >= NUM_BUTTONS) {
+		return;
+	}
+
+	for (int i = 0; i < NUM_BUTTONS; i++) {
+		if (bindings.gamepad[i] == gamepad_button) {
+			bindings.gamepad[i] = SDL_CONTROLLER_BUTTON_INVALID;
+		}
+	}
 
-	if (index == -1) {
+	bindings.gamepad[button] = gamepad_button;
+	rebuild_lookup();
+}
+
+// Bind a turntable axis, on any gamepad, to a button
+// Bound axes are read as turntables, which wrap around, so only bind controllers that have one
+void Input_bind_axis(int button, SDL_GameControllerAxis axis) {
+	if (button < 0 || button >= NUM_BUTTONS) {
 		return;
 	}
 
-	current_state.scancodes[index] = 0;
+	for (int i = 0; i < NUM_BUTTONS; i++) {
+		if (bindings.axes[i] == axis) {
+			bindings.axes[i] = SDL_CONTROLLER_AXIS_INVALID;
+		}
+	}
+
+	bindings.axes[button] = axis;
+	rebuild_lookup();
+}
+
+// Have something respond to presses straight away, rather than when they're next polled
+// Set before events start arriving
+void Input_set_press_handler(InputPressHandler handler) {
+	press_handler = handler;
 }
 
-// Handle a button being pressed
-void Input_gamepad_pressed(SDL_GameControllerButton button) {
-	int index = get_button_for_gamepad(button);
+// A source started holding a button; it goes down if nothing else was holding it
+static void press_source(int index, unsigned int source, long long time) {
+	if (state.sources[index] == 0) {
+		SDL_AtomicSet(&down[index], 1);
+		push_event(index, 1, time);
 
-	if (index == -1) {
+		if (press_handler != NULL) {
+			press_handler(index, time);
+		}
+	}
+
+	state.sources[index] |= source;
+}
+
+// A source stopped holding a button; it goes up once nothing else is holding it
+static void release_source(int index, unsigned int source, long long time) {
+	if ((state.sources[index] & source) == 0) {
 		return;
 	}
 
-	current_state.gamepad[index] = 1;
+	state.sources[index] &= ~source;
+
+	if (state.sources[index] == 0) {
+		SDL_AtomicSet(&down[index], 0);
+		push_event(index, 0, time);
+	}
 }
 
-// Handle a button being released
-void Input_gamepad_released(SDL_GameControllerButton button) {
-	int index = get_button_for_gamepad(button);
+// Open a newly connected gamepad, given its device index
+void Input_device_added(int device_index) {
+	for (int i = 0; i < INPUT_MAX_DEVICES; i++) {
+		if (controllers[i] != NULL) {
+			continue;
+		}
+
+		controllers[i] = SDL_GameControllerOpen(device_index);
+		if (controllers[i] == NULL) {
+			Log_warn("Couldn't open gamepad %d: %s", device_index, SDL_GetError());
+			return;
+		}
+
+		controller_ids[i] = SDL_JoystickInstanceID(SDL_GameControllerGetJoystick(controllers[i]));
+		for (int j = 0; j < SDL_CONTROLLER_AXIS_MAX; j++) {
+			state.axes[i][j].valid = 0;
+			state.axes[i][j].direction = 0;
+		}
 
-	if (index == -1) {
+		Log_info("Gamepad connected: %s", SDL_GameControllerName(controllers[i]));
 		return;
 	}
 
-	current_state.gamepad[index] = 0;
+	Log_warn("Too many gamepads connected, ignoring gamepad %d", device_index);
 }
 
-// Copy the current input state to the last input state in preparation for polling new events
-void Input_swap_state() {
+// Release everything a disconnected gamepad was holding, and close it
+void Input_device_removed(SDL_JoystickID device, long long time) {
+	int slot = get_device_slot(device);
+
+	if (slot == -1) {
+		return;
+	}
+
 	for (int i = 0; i < NUM_BUTTONS; i++) {
-		last_state.buttons[i] = current_state.buttons[i];
-		last_state.pressed[i] = current_state.pressed[i];
-		last_state.released[i] = current_state.released[i];
-		last_state.scancodes[i] = current_state.scancodes[i];
-		last_state.gamepad[i] = current_state.gamepad[i];
-		current_state.pressed[i] = 0;
-		current_state.released[i] = 0;
+		release_source(i, SOURCE_GAMEPAD(slot) | SOURCE_AXIS(slot), time);
 	}
+
+	SDL_GameControllerClose(controllers[slot]);
+	controllers[slot] = NULL;
+
+	Log_info("Gamepad disconnected");
 }
 
-// Write the new input state by compositing keyboard and gamepad states
-void Input_write_state() {
-	for (int i = 0; i < NUM_BUTTONS; i++) {
-		current_state.buttons[i] = current_state.scancodes[i] || current_state.gamepad[i];
-		current_state.pressed[i] = current_state.buttons[i] && !last_state.buttons[i];
-		current_state.released[i] = !current_state.buttons[i] && last_state.buttons[i];
+// Handle a key being pressed at the given time
+void Input_key_pressed(SDL_Scancode key, long long time) {
+	if (key < 0 || key >= SDL_NUM_SCANCODES || scancode_buttons[key] == -1) {
+		return;
+	}
+
+	press_source(scancode_buttons[key], SOURCE_KEYBOARD, time);
+}
+
+// Handle a key being released at the given time
+void Input_key_released(SDL_Scancode key, long long time) {
+	if (key < 0 || key >= SDL_NUM_SCANCODES || scancode_buttons[key] == -1) {
+		return;
+	}
+
+	release_source(scancode_buttons[key], SOURCE_KEYBOARD, time);
+}
+
+// Handle a gamepad button being pressed at the given time
+void Input_gamepad_pressed(SDL_JoystickID device, SDL_GameControllerButton button, long long time) {
+	if (button < 0 || button >= SDL_CONTROLLER_BUTTON_MAX || gamepad_buttons[button] == -1) {
+		return;
+	}
+
+	int slot = get_device_slot(device);
+	if (slot != -1) {
+		press_source(gamepad_buttons[button], SOURCE_GAMEPAD(slot), time);
+	}
+}
+
+// Handle a gamepad button being released at the given time
+void Input_gamepad_released(SDL_JoystickID device, SDL_GameControllerButton button, long long time) {
+	if (button < 0 || button >= SDL_CONTROLLER_BUTTON_MAX || gamepad_buttons[button] == -1) {
+		return;
+	}
+
+	int slot = get_device_slot(device);
+	if (slot != -1) {
+		release_source(gamepad_buttons[button], SOURCE_GAMEPAD(slot), time);
+	}
+}
+
+// Handle a turntable axis moving at the given time
+// Turning either way presses the button, and turning back the other way is a fresh
+// press; it's released by Input_update once the turntable stops
+void Input_gamepad_axis(SDL_JoystickID device, SDL_GameControllerAxis axis, int value, long long time) {
+	if (axis < 0 || axis >= SDL_CONTROLLER_AXIS_MAX || axis_buttons[axis] == -1) {
+		return;
+	}
+
+	int slot = get_device_slot(device);
+	if (slot == -1) {
+		return;
+	}
+
+	int index = axis_buttons[axis];
+	InputAxisState* axis_state = &state.axes[slot][axis];
+
+	if (!axis_state->valid) {
+		axis_state->valid = 1;
+		axis_state->value = value;
+		return;
+	}
+
+	// Turntables wrap around, so a jump of more than half the range is a small
+	// step the other way
+	int delta = value - axis_state->value;
+	if (delta > 32767) {
+		delta -= 65536;
+	} else if (delta < -32768) {
+		delta += 65536;
+	}
+
+	// Small changes are noise, but still add up towards the threshold
+	if (abs(delta) < INPUT_AXIS_THRESHOLD) {
+		return;
+	}
+
+	int direction = delta > 0 ? 1 : -1;
+	axis_state->value = value;
+	axis_state->last_motion = time;
+
+	if (direction != axis_state->direction) {
+		if (axis_state->direction != 0) {
+			release_source(index, SOURCE_AXIS(slot), time);
+		}
+		axis_state->direction = direction;
+		press_source(index, SOURCE_AXIS(slot), time);
+	}
+}
+
+// Release turntables that have stopped turning
+// Call regularly on the event thread, whether or not events arrived
+void Input_update(long long time) {
+	for (int i = 0; i < INPUT_MAX_DEVICES; i++) {
+		if (controllers[i] == NULL) {
+			continue;
+		}
+
+		for (int j = 0; j < SDL_CONTROLLER_AXIS_MAX; j++) {
+			InputAxisState* axis_state = &state.axes[i][j];
+
+			if (axis_state->direction != 0 && time - axis_state->last_motion >= INPUT_AXIS_RELEASE_NS) {
+				axis_state->direction = 0;
+				if (axis_buttons[j] != -1) {
+					release_source(axis_buttons[j], SOURCE_AXIS(i), axis_state->last_motion + INPUT_AXIS_RELEASE_NS);
+				}
+			}
+		}
 	}
 }
 
@@ -140,23 +389,25 @@ int Input_is_down(int button) {
 		return 0;
 	}
 
-	return current_state.buttons[button];
+	return SDL_AtomicGet(&down[button]);
 }
 
-// Determine whether a particular button index was pressed between the last update and now
-int Input_was_pressed(int button) {
+// Take the oldest unhandled press or release of a particular button index
+// Returns 0 once there are none left
+int Input_poll_event(int button, InputEvent* event) {
 	if (button < 0 || button >= NUM_BUTTONS) {
 		return 0;
 	}
 
-	return !last_state.pressed[button] && current_state.pressed[button];
-}
+	InputQueue* queue = &queues[button];
+	int tail = SDL_AtomicGet(&queue->tail);
 
-// Determine whether a particular button index was released between the last update and now
-int Input_was_released(int button) {
-	if (button < 0 || button >= NUM_BUTTONS) {
+	if (tail == SDL_AtomicGet(&queue->head)) {
 		return 0;
 	}
 
-	return !last_state.released[button] && current_state.released[button];
+	*event = queue->events[tail % INPUT_QUEUE_SIZE];
+	SDL_AtomicSet(&queue->tail, tail + 1);
+
+	return 1;
 }
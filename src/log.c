@@ -1,7 +1,29 @@
 #include "log.h"
-#include <stdio.h>
+#include "memtrack.h"
+#include "util.h"
+
+#include <ctype.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
 #include <time.h>
+#include <SDL2/SDL.h>
+
+// Every function is built whatever LOG_MIN_LEVEL the rest of the program uses
+#undef Log_debug
+#undef Log_info
+#undef Log_warn
+#undef Log_error
+#undef Log_fatal
+
+// Longest a formatted message can be, and the most its packed arguments can take up
+#define MAX_MESSAGE 4096
+#define MAX_ARGUMENTS 2048
+
+// Marks the unused end of a ring, when a record didn't fit before it wrapped
+#define LEVEL_PADDING -1
 
 static char* log_colors[] = {
 	COLOR_RESET,
@@ -12,44 +34,605 @@ static char* log_colors[] = {
 	COLOR_GREEN
 };
 
+static char* log_prefixes[] = {
+	"LOG",
+	"FATAL",
+	"ERROR",
+	"WARN",
+	"INFO",
+	"DEBUG"
+};
+
+// One logged message: its level, when it was logged, and its format string,
+// followed by its arguments packed into 8 byte slots (strings are copied in
+// whole, padded to a multiple of 8)
+typedef struct {
+	int size;
+	int level;
+	long long time;
+	const char* fmt;
+} LogRecord;
+
+// Messages from one thread, which is the only producer; whoever holds io_lock consumes
+// head and tail are running byte counts, so they wrap around the ring by themselves
+// A ring is retired when its thread exits, and handed to a new thread once it's empty
+typedef struct {
+	unsigned char data[LOG_RING_SIZE];
+	SDL_atomic_t head;
+	SDL_atomic_t tail;
+	SDL_atomic_t dropped;
+	SDL_atomic_t retired;
+} LogRing;
+
+// A printf conversion, minus its length modifier
+// width and precision are -1 when missing and -2 when given as *
+enum {
+	LENGTH_NONE = 0,
+	LENGTH_HH,
+	LENGTH_H,
+	LENGTH_L,
+	LENGTH_LL,
+	LENGTH_J,
+	LENGTH_Z,
+	LENGTH_T,
+	LENGTH_LONG_DOUBLE
+};
+
+typedef struct {
+	char flags[8];
+	int width;
+	int precision;
+	int length;
+	char conversion;
+} FormatSpec;
+
 static FILE* fp;
 static int current_level;
-static int current_color;
 static int mirror;
 
-static void write_line(const char* prefix, const char* fmt, va_list args) {
-	// Get the current timestamp
+// Each thread's ring, found through thread-local storage
+static SDL_TLSID ring_key;
+static LogRing* rings[LOG_MAX_THREADS];
+static SDL_atomic_t ring_count;
+static SDL_SpinLock ring_lock;
+static SDL_atomic_t unregistered_dropped;
+static int limit_reported;
+
+static SDL_Thread* writer_thread;
+static SDL_sem* wake;
+static SDL_atomic_t quitting;
+static SDL_mutex* io_lock;
+
+// Wall clock time when the monotonic clock read monotonic_start, for timestamps
+static time_t wall_start;
+static long long monotonic_start;
+
+// Read one conversion, starting just after its %
+// Returns where the format carries on after it
+static const char* parse_spec(const char* p, FormatSpec* spec) {
+	int flag_count = 0;
+
+	while (*p != '\0' && strchr("-+ #0", *p) != NULL) {
+		if (flag_count < (int)sizeof(spec->flags) - 1) {
+			spec->flags[flag_count++] = *p;
+		}
+		p++;
+	}
+	spec->flags[flag_count] = '\0';
+
+	spec->width = -1;
+	if (*p == '*') {
+		spec->width = -2;
+		p++;
+	} else if (isdigit((unsigned char)*p)) {
+		spec->width = 0;
+		while (isdigit((unsigned char)*p)) {
+			spec->width = spec->width * 10 + (*p++ - '0');
+		}
+	}
+
+	spec->precision = -1;
+	if (*p == '.') {
+		p++;
+		if (*p == '*') {
+			spec->precision = -2;
+			p++;
+		} else {
+			spec->precision = 0;
+			while (isdigit((unsigned char)*p)) {
+				spec->precision = spec->precision * 10 + (*p++ - '0');
+			}
+		}
+	}
+
+	spec->length = LENGTH_NONE;
+	if (p[0] == 'h' && p[1] == 'h') {
+		spec->length = LENGTH_HH;
+		p += 2;
+	} else if (p[0] == 'l' && p[1] == 'l') {
+		spec->length = LENGTH_LL;
+		p += 2;
+	} else if (*p == 'h') {
+		spec->length = LENGTH_H;
+		p++;
+	} else if (*p == 'l') {
+		spec->length = LENGTH_L;
+		p++;
+	} else if (*p == 'q' || *p == 'j') {
+		spec->length = *p == 'q' ? LENGTH_LL : LENGTH_J;
+		p++;
+	} else if (*p == 'z') {
+		spec->length = LENGTH_Z;
+		p++;
+	} else if (*p == 't') {
+		spec->length = LENGTH_T;
+		p++;
+	} else if (*p == 'L') {
+		spec->length = LENGTH_LONG_DOUBLE;
+		p++;
+	}
+
+	spec->conversion = *p;
+	if (*p != '\0') {
+		p++;
+	}
+
+	return p;
+}
+
+// Pack the arguments for a format into buffer, returning how many bytes they took
+static int pack_arguments(unsigned char* buffer, const char* fmt, va_list args) {
+	int size = 0;
+
+	for (const char* p = fmt; *p != '\0';) {
+		if (*p++ != '%') {
+			continue;
+		}
+
+		FormatSpec spec;
+		p = parse_spec(p, &spec);
+
+		// Stop once there's no room for every slot this conversion could need;
+		// the writer stops formatting at the same point
+		if (size + 40 > MAX_ARGUMENTS) {
+			break;
+		}
+
+		long long integer = 0;
+		if (spec.width == -2) {
+			integer = va_arg(args, int);
+			memcpy(buffer + size, &integer, 8);
+			size += 8;
+		}
+		if (spec.precision == -2) {
+			integer = va_arg(args, int);
+			memcpy(buffer + size, &integer, 8);
+			size += 8;
+		}
+
+		switch (spec.conversion) {
+			case 'd':
+			case 'i': {
+				long long value;
+				switch (spec.length) {
+					case LENGTH_HH: value = (signed char)va_arg(args, int); break;
+					case LENGTH_H: value = (short)va_arg(args, int); break;
+					case LENGTH_L: value = va_arg(args, long); break;
+					case LENGTH_LL: value = va_arg(args, long long); break;
+					case LENGTH_J: value = va_arg(args, intmax_t); break;
+					case LENGTH_Z: value = (long long)va_arg(args, size_t); break;
+					case LENGTH_T: value = va_arg(args, ptrdiff_t); break;
+					default: value = va_arg(args, int); break;
+				}
+				memcpy(buffer + size, &value, 8);
+				size += 8;
+				break;
+			}
+
+			case 'u':
+			case 'o':
+			case 'x':
+			case 'X': {
+				unsigned long long value;
+				switch (spec.length) {
+					case LENGTH_HH: value = (unsigned char)va_arg(args, unsigned int); break;
+					case LENGTH_H: value = (unsigned short)va_arg(args, unsigned int); break;
+					case LENGTH_L: value = va_arg(args, unsigned long); break;
+					case LENGTH_LL: value = va_arg(args, unsigned long long); break;
+					case LENGTH_J: value = va_arg(args, uintmax_t); break;
+					case LENGTH_Z: value = va_arg(args, size_t); break;
+					case LENGTH_T: value = (unsigned long long)va_arg(args, ptrdiff_t); break;
+					default: value = va_arg(args, unsigned int); break;
+				}
+				memcpy(buffer + size, &value, 8);
+				size += 8;
+				break;
+			}
+
+			case 'c': {
+				long long value = va_arg(args, int);
+				memcpy(buffer + size, &value, 8);
+				size += 8;
+				break;
+			}
+
+			case 'e':
+			case 'E':
+			case 'f':
+			case 'F':
+			case 'g':
+			case 'G':
+			case 'a':
+			case 'A': {
+				double value = spec.length == LENGTH_LONG_DOUBLE ? (double)va_arg(args, long double) : va_arg(args, double);
+				memcpy(buffer + size, &value, 8);
+				size += 8;
+				break;
+			}
+
+			case 'p':
+			case 'n': {
+				void* value = va_arg(args, void*);
+				memset(buffer + size, 0, 8);
+				memcpy(buffer + size, &value, sizeof(void*));
+				size += 8;
+				break;
+			}
+
+			case 's': {
+				const char* value = va_arg(args, const char*);
+				if (value == NULL) {
+					value = "(null)";
+				}
+
+				// Copy as much of the string as fits
+				int length = strlen(value);
+				int room = MAX_ARGUMENTS - size - 8;
+				if (length > room) {
+					length = room;
+				}
+
+				memcpy(buffer + size, value, length);
+				buffer[size + length] = '\0';
+				size += (length + 8) & ~7;
+				break;
+			}
+
+			default:
+				break;
+		}
+	}
+
+	return size;
+}
+
+static int append(char* message, int length, const char* text) {
+	int written = snprintf(message + length, MAX_MESSAGE - length, "%s", text);
+	length += written;
+	return length < MAX_MESSAGE ? length : MAX_MESSAGE - 1;
+}
+
+// Format a record's message from its format string and packed arguments
+static void format_record(const LogRecord* record, char* message) {
+	const unsigned char* arguments = (const unsigned char*)(record + 1);
+	int length = 0;
+	int offset = 0;
+
+	message[0] = '\0';
+
+	for (const char* p = record->fmt; *p != '\0' && length < MAX_MESSAGE - 1;) {
+		if (*p != '%') {
+			message[length++] = *p++;
+			message[length] = '\0';
+			continue;
+		}
+
+		FormatSpec spec;
+		p = parse_spec(p + 1, &spec);
+
+		if (spec.conversion == '%') {
+			length = append(message, length, "%");
+			continue;
+		}
+		if (offset >= record->size - (int)sizeof(LogRecord)) {
+			break;
+		}
+
+		// Rebuild the conversion with its * values filled in, and every integer
+		// widened to the long long it was packed as
+		long long star;
+		char conversion[48];
+		int spec_length = snprintf(conversion, sizeof(conversion), "%%%s", spec.flags);
+
+		if (spec.width == -2) {
+			memcpy(&star, arguments + offset, 8);
+			offset += 8;
+			spec_length += snprintf(conversion + spec_length, sizeof(conversion) - spec_length, "%d", (int)star);
+		} else if (spec.width >= 0) {
+			spec_length += snprintf(conversion + spec_length, sizeof(conversion) - spec_length, "%d", spec.width);
+		}
+
+		if (spec.precision == -2) {
+			memcpy(&star, arguments + offset, 8);
+			offset += 8;
+			spec_length += snprintf(conversion + spec_length, sizeof(conversion) - spec_length, ".%d", (int)star);
+		} else if (spec.precision >= 0) {
+			spec_length += snprintf(conversion + spec_length, sizeof(conversion) - spec_length, ".%d", spec.precision);
+		}
+
+		int room = MAX_MESSAGE - length;
+		int written = 0;
+
+		switch (spec.conversion) {
+			case 'd':
+			case 'i':
+			case 'u':
+			case 'o':
+			case 'x':
+			case 'X': {
+				long long value;
+				memcpy(&value, arguments + offset, 8);
+				offset += 8;
+				snprintf(conversion + spec_length, sizeof(conversion) - spec_length, "ll%c", spec.conversion);
+				written = snprintf(message + length, room, conversion, value);
+				break;
+			}
+
+			case 'c': {
+				long long value;
+				memcpy(&value, arguments + offset, 8);
+				offset += 8;
+				snprintf(conversion + spec_length, sizeof(conversion) - spec_length, "c");
+				written = snprintf(message + length, room, conversion, (int)value);
+				break;
+			}
+
+			case 'e':
+			case 'E':
+			case 'f':
+			case 'F':
+			case 'g':
+			case 'G':
+			case 'a':
+			case 'A': {
+				double value;
+				memcpy(&value, arguments + offset, 8);
+				offset += 8;
+				snprintf(conversion + spec_length, sizeof(conversion) - spec_length, "%c", spec.conversion);
+				written = snprintf(message + length, room, conversion, value);
+				break;
+			}
+
+			case 'p': {
+				void* value;
+				memcpy(&value, arguments + offset, sizeof(void*));
+				offset += 8;
+				snprintf(conversion + spec_length, sizeof(conversion) - spec_length, "p");
+				written = snprintf(message + length, room, conversion, value);
+				break;
+			}
+
+			case 'n':
+				offset += 8;
+				break;
+
+			case 's': {
+				const char* value = (const char*)arguments + offset;
+				offset += (strlen(value) + 8) & ~7;
+				snprintf(conversion + spec_length, sizeof(conversion) - spec_length, "s");
+				written = snprintf(message + length, room, conversion, value);
+				break;
+			}
+
+			default:
+				break;
+		}
+
+		length += written;
+		if (length >= MAX_MESSAGE) {
+			length = MAX_MESSAGE - 1;
+		}
+	}
+}
+
+// Write a line to the file, and the console if mirroring
+static void write_line(int level, long long time, const char* message) {
+	// Get the timestamp
 	// [YYYY-MM-DD HH:MM:SS]
-	time_t timer;
+	time_t timer = wall_start + (time_t)((time - monotonic_start) / 1000000000LL);
 	char timestamp[20];
-	struct tm* tm_info;
-	timer = time(NULL);
-	tm_info = localtime(&timer);
+	struct tm* tm_info = localtime(&timer);
 	strftime(timestamp, 20, "%Y-%m-%d %H:%M:%S", tm_info);
 
-	// Format the message if necessary
-	if (args != NULL) {
-		char message[4096];
-		vsnprintf(message, 4096, fmt, args);
+	// Write the message with timestamp and prefix to the file
+	fprintf(fp, "[%s] %s: %s\n", timestamp, log_prefixes[level], message);
 
-		// Write the formatted message with timestamp and prefix to the file
-		fprintf(fp, "[%s] %s: %s\n", timestamp, prefix, message);
+	// Do the same thing in stdout if necessary
+	if (mirror) {
+		printf("[%s] %s%s: %s%s\n", timestamp, log_colors[level], log_prefixes[level], message, log_colors[0]);
+	}
+}
 
-		// Do the same thing in stdout if necessary
-		if (mirror) {
-			printf("[%s] %s%s: %s%s\n", timestamp, log_colors[current_color], prefix, message, log_colors[0]);
+// Called as a thread exits, so its ring can go to another thread once it's written out
+static void retire_ring(void* data) {
+	LogRing* ring = data;
+	SDL_AtomicSet(&ring->retired, 1);
+}
+
+// Returns the calling thread's ring, setting one up on its first message
+// Rings of threads that have exited are reused before new ones are made
+static LogRing* get_ring() {
+	LogRing* ring = SDL_TLSGet(ring_key);
+
+	if (ring != NULL) {
+		return ring;
+	}
+
+	SDL_AtomicLock(&ring_lock);
+	int count = SDL_AtomicGet(&ring_count);
+	for (int i = 0; i < count; i++) {
+		if (SDL_AtomicGet(&rings[i]->retired) && SDL_AtomicGet(&rings[i]->head) == SDL_AtomicGet(&rings[i]->tail)) {
+			ring = rings[i];
+			SDL_AtomicSet(&ring->retired, 0);
+			break;
 		}
-	} else {
-		// Write the message with timestamp and prefix to the file
-		fprintf(fp, "[%s] %s: %s\n", timestamp, prefix, fmt);
+	}
+	if (ring == NULL && count < LOG_MAX_THREADS) {
+		ring = Memtrack_calloc(MEMTRACK_LOG, 1, sizeof(LogRing));
+		rings[count] = ring;
+		SDL_AtomicSet(&ring_count, count + 1);
+	}
+	SDL_AtomicUnlock(&ring_lock);
+
+	if (ring != NULL) {
+		SDL_TLSSet(ring_key, ring, retire_ring);
+	}
+
+	return ring;
+}
+
+// Copy a message into the calling thread's ring, or drop it if there's no room
+static void push_record(int level, const char* fmt, va_list args) {
+	LogRing* ring = get_ring();
+
+	if (ring == NULL) {
+		SDL_AtomicAdd(&unregistered_dropped, 1);
+		return;
+	}
+
+	// Built on the stack first, since its size isn't known until the arguments are packed
+	long long record_data[(sizeof(LogRecord) + MAX_ARGUMENTS) / 8];
+	LogRecord* record = (LogRecord*)record_data;
+	record->level = level;
+	record->time = get_time_ns();
+	record->fmt = fmt;
+	record->size = sizeof(LogRecord) + pack_arguments((unsigned char*)(record + 1), fmt, args);
+
+	unsigned int head = SDL_AtomicGet(&ring->head);
+	unsigned int tail = SDL_AtomicGet(&ring->tail);
+	unsigned int offset = head % LOG_RING_SIZE;
+	unsigned int needed = record->size;
+
+	// Records never wrap; skip to the start of the ring when one won't fit at the end
+	unsigned int skip = 0;
+	if (offset + record->size > LOG_RING_SIZE) {
+		skip = LOG_RING_SIZE - offset;
+		needed += skip;
+	}
+
+	if (LOG_RING_SIZE - (head - tail) < needed) {
+		SDL_AtomicAdd(&ring->dropped, 1);
+		return;
+	}
+
+	if (skip >= sizeof(LogRecord)) {
+		LogRecord padding = { (int)skip, LEVEL_PADDING, 0, NULL };
+		memcpy(ring->data + offset, &padding, sizeof(LogRecord));
+	}
+
+	memcpy(ring->data + (head + skip) % LOG_RING_SIZE, record_data, record->size);
+	SDL_AtomicSet(&ring->head, head + needed);
+
+	// Hurry the writer along before the ring fills up
+	if (head + needed - tail > LOG_RING_SIZE / 2) {
+		SDL_SemPost(wake);
+	}
+}
+
+// Returns the next record waiting in a ring, skipping the padding at its end,
+// or NULL if the ring is empty
+static LogRecord* peek_record(LogRing* ring) {
+	unsigned int head = SDL_AtomicGet(&ring->head);
+	unsigned int tail = SDL_AtomicGet(&ring->tail);
+
+	while (tail != head) {
+		unsigned int offset = tail % LOG_RING_SIZE;
+
+		if (LOG_RING_SIZE - offset < sizeof(LogRecord)) {
+			tail += LOG_RING_SIZE - offset;
+		} else {
+			LogRecord* record = (LogRecord*)(ring->data + offset);
+			if (record->level != LEVEL_PADDING) {
+				SDL_AtomicSet(&ring->tail, tail);
+				return record;
+			}
+			tail += record->size;
+		}
+
+		SDL_AtomicSet(&ring->tail, tail);
+	}
+
+	return NULL;
+}
+
+// Write out every waiting message, oldest first across all threads
+// Callers must hold io_lock
+static void drain() {
+	char message[MAX_MESSAGE];
+	int count = SDL_AtomicGet(&ring_count);
+	int written = 0;
+
+	while (1) {
+		LogRing* oldest_ring = NULL;
+		LogRecord* oldest = NULL;
+
+		for (int i = 0; i < count; i++) {
+			LogRecord* record = peek_record(rings[i]);
+			if (record != NULL && (oldest == NULL || record->time < oldest->time)) {
+				oldest = record;
+				oldest_ring = rings[i];
+			}
+		}
+
+		if (oldest == NULL) {
+			break;
+		}
+
+		format_record(oldest, message);
+		write_line(oldest->level, oldest->time, message);
+		SDL_AtomicAdd(&oldest_ring->tail, oldest->size);
+		written++;
+	}
+
+	int dropped = 0;
+	for (int i = 0; i < count; i++) {
+		dropped += SDL_AtomicSet(&rings[i]->dropped, 0);
+	}
+	if (dropped > 0) {
+		snprintf(message, MAX_MESSAGE, "%d messages were dropped because logging fell behind", dropped);
+		write_line(LOG_WARN, get_time_ns(), message);
+		written++;
+	}
 
-		// Do the same thing in stdout if necessary
+	// Only said once, since a thread without a ring drops everything it logs
+	int unregistered = SDL_AtomicSet(&unregistered_dropped, 0);
+	if (unregistered > 0 && !limit_reported) {
+		snprintf(message, MAX_MESSAGE, "More than %d threads are logging at once, so messages from the rest are dropped", LOG_MAX_THREADS);
+		write_line(LOG_WARN, get_time_ns(), message);
+		limit_reported = 1;
+		written++;
+	}
+
+	if (written > 0) {
+		fflush(fp);
 		if (mirror) {
-			printf("[%s] %s%s: %s%s\n", timestamp, log_colors[current_color], prefix, fmt, log_colors[0]);
+			fflush(stdout);
 		}
 	}
 }
 
+static int writer_thread_main(void* data) {
+	while (!SDL_AtomicGet(&quitting)) {
+		SDL_SemWaitTimeout(wake, LOG_FLUSH_INTERVAL);
+
+		SDL_LockMutex(io_lock);
+		drain();
+		SDL_UnlockMutex(io_lock);
+	}
+
+	return 0;
+}
+
 int Log_start(const char* file, int level, int mirror_to_console) {
 	current_level = level;
 	mirror = mirror_to_console;
@@ -60,7 +643,17 @@ int Log_start(const char* file, int level, int mirror_to_console) {
 		return 0;
 	}
 
-	write_line("LOG", "Beginning logging session", NULL);
+	wall_start = time(NULL);
+	monotonic_start = get_time_ns();
+
+	ring_key = SDL_TLSCreate();
+	io_lock = SDL_CreateMutex();
+	wake = SDL_CreateSemaphore(0);
+	SDL_AtomicSet(&quitting, 0);
+	limit_reported = 0;
+	writer_thread = SDL_CreateThread(writer_thread_main, "Log", NULL);
+
+	write_line(LOG_OFF, monotonic_start, "Beginning logging session");
 
 	return 1;
 }
@@ -74,68 +667,126 @@ void Log_set_mirror_to_console(int mirror_to_console) {
 }
 
 void Log_debug(const char* fmt, ...) {
-	if (current_level < LOG_DEBUG) {
+	if (current_level < LOG_DEBUG || fp == NULL) {
 		return;
 	}
-	current_color = LOG_DEBUG;
 
 	va_list args;
 	va_start(args, fmt);
-	write_line("DEBUG", fmt, args);
+	push_record(LOG_DEBUG, fmt, args);
 	va_end(args);
 }
 
 void Log_info(const char* fmt, ...) {
-	if (current_level < LOG_INFO) {
+	if (current_level < LOG_INFO || fp == NULL) {
 		return;
 	}
-	current_color = LOG_INFO;
 
 	va_list args;
 	va_start(args, fmt);
-	write_line("INFO", fmt, args);
+	push_record(LOG_INFO, fmt, args);
 	va_end(args);
 }
 
 void Log_warn(const char* fmt, ...) {
-	if (current_level < LOG_WARN) {
+	if (current_level < LOG_WARN || fp == NULL) {
 		return;
 	}
-	current_color = LOG_WARN;
 
 	va_list args;
 	va_start(args, fmt);
-	write_line("WARN", fmt, args);
+	push_record(LOG_WARN, fmt, args);
 	va_end(args);
 }
 
 void Log_error(const char* fmt, ...) {
-	if (current_level < LOG_ERROR) {
+	if (current_level < LOG_ERROR || fp == NULL) {
 		return;
 	}
-	current_color = LOG_ERROR;
 
 	va_list args;
 	va_start(args, fmt);
-	write_line("ERROR", fmt, args);
+	push_record(LOG_ERROR, fmt, args);
 	va_end(args);
 }
 
+// Fatal messages are written out before returning, in case the program dies next
 void Log_fatal(const char* fmt, ...) {
-	if (current_level < LOG_FATAL) {
+	if (current_level < LOG_FATAL || fp == NULL) {
 		return;
 	}
-	current_color = LOG_FATAL;
 
 	va_list args;
 	va_start(args, fmt);
-	write_line("FATAL", fmt, args);
+	push_record(LOG_FATAL, fmt, args);
 	va_end(args);
+
+	Log_flush();
+}
+
+// Write out everything logged so far, on the calling thread
+void Log_flush() {
+	if (fp == NULL) {
+		return;
+	}
+
+	SDL_LockMutex(io_lock);
+	drain();
+	SDL_UnlockMutex(io_lock);
 }
 
+// Call once every other thread has stopped logging
 void Log_destroy() {
-	current_color = LOG_OFF;
-	write_line("LOG", "Ending logging session", NULL);
+	if (fp == NULL) {
+		return;
+	}
+
+	SDL_AtomicSet(&quitting, 1);
+	SDL_SemPost(wake);
+	SDL_WaitThread(writer_thread, NULL);
+
+	drain();
+
+	write_line(LOG_OFF, get_time_ns(), "Ending logging session");
 	fprintf(fp, "\n");
 	fclose(fp);
+	fp = NULL;
+
+	for (int i = 0; i < SDL_AtomicGet(&ring_count); i++) {
+		Memtrack_free(rings[i]);
+		rings[i] = NULL;
+	}
+	SDL_AtomicSet(&ring_count, 0);
+
+	SDL_DestroySemaphore(wake);
+	SDL_DestroyMutex(io_lock);
+}
+
+// Count a message from one call site, returning whether it may be logged
+// Once a new second starts, suppressed is set to how many were held back before it
+int Log_limit(LogLimit* limit, int per_second, int* suppressed) {
+	long long now = get_time_ns();
+	int allowed = 0;
+
+	*suppressed = 0;
+
+	SDL_AtomicLock(&limit->lock);
+
+	if (now - limit->window_start >= 1000000000LL) {
+		limit->window_start = now;
+		limit->count = 0;
+		*suppressed = limit->suppressed;
+		limit->suppressed = 0;
+	}
+
+	if (limit->count < per_second) {
+		limit->count++;
+		allowed = 1;
+	} else {
+		limit->suppressed++;
+	}
+
+	SDL_AtomicUnlock(&limit->lock);
+
+	return allowed;
 }
@@ -1,38 +1,190 @@
 #include "log.h"
+#include "benchmark.h"
 #include "bms.h"
+#include "cache.h"
+#include "capture.h"
 #include "graphics.h"
+#include "hud.h"
 #include "input.h"
+#include "memtrack.h"
+#include "metrics.h"
 #include "mixer.h"
 #include "play.h"
+#include "scheduler.h"
+#include "trace.h"
 #include "util.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <SDL2/SDL.h>
 
-static const int LOOP_RATE_HZ = 250;
-static const int LOOP_TIME_MS = 1000 / LOOP_RATE_HZ;
+// Logic ticks per second, unless --tick-rate says otherwise
+static const int DEFAULT_TICK_RATE = 250;
+
+// Longest the event thread waits for an event, so gamepads are polled at least at 1 kHz
+static const int EVENT_TIMEOUT_MS = 1;
+
+static SDL_atomic_t logic_running;
+static int tick_rate;
+
+// Work out when an event happened on the get_time_ns clock, given when it was polled
+// SDL only stamps events to the millisecond, so an event is taken to have happened
+// when it was polled unless it had clearly been waiting in the queue for longer
+static long long get_event_time(Uint32 timestamp, long long polled) {
+	Uint32 age = SDL_GetTicks() - timestamp;
+
+	if (age > 1) {
+		return polled - (age - 1) * 1000000LL;
+	}
+
+	return polled;
+}
+
+// Step the game at the tick rate, judging whatever input has arrived since the last step
+static int logic_thread_main(void* data) {
+	Scheduler* scheduler = Scheduler_create("Logic", 1000000000LL / tick_rate);
+	long long last_tick = get_time_ns();
+	Metric* update_metric = Metrics_histogram("logic.update_us");
+
+	Hud_watch_scheduler(scheduler);
+
+	Trace_name_thread("Logic");
+	Log_debug("Beginning logic thread loop");
+
+	while (SDL_AtomicGet(&logic_running)) {
+		long long tick = Scheduler_wait(scheduler);
+
+		long long span = Trace_begin();
+		Play_update((long)(tick - last_tick), tick);
+		Trace_end("Tick", span);
+		Metrics_record(update_metric, (int)((get_time_ns() - tick) / 1000));
+		last_tick = tick;
+	}
+
+	Hud_watch_scheduler(NULL);
+	Scheduler_free(scheduler);
+
+	Log_debug("Ended logic thread loop");
+	return 0;
+}
 
 int main(int argc, char* argv[]) {
+	Memtrack_init();
 	Log_start("dreamnote.log", LOG_DEBUG, 1);
+	Trace_init();
+	Trace_name_thread("Main");
+
+	char* chart = NULL;
+	int pacing = GRAPHICS_PACING_VSYNC;
+	int fps_cap = GRAPHICS_DEFAULT_FPS_CAP;
+	int benchmark_frames = 0;
+	int benchmark_fps = BENCHMARK_DEFAULT_FPS;
+	char* capture_prefix = NULL;
+	int capture_format = CAPTURE_PNG;
+	char* trace_path = TRACE_DEFAULT_FILE;
+	int trace_at_start = 0;
+	char* metrics_path = NULL;
+	int turntable = 0;
+
+	tick_rate = DEFAULT_TICK_RATE;
+
+	// dreamnote [--pacing vsync|uncapped|capped|low-latency] [--fps N] [--tick-rate N]
+	//           [--benchmark FRAMES] [--benchmark-fps N]
+	//           [--capture PREFIX] [--capture-format raw|png] [--trace FILE]
+	//           [--metrics FILE] [--turntable] <chart>
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--pacing") == 0 && i + 1 < argc) {
+			pacing = Graphics_parse_pacing(argv[++i]);
+			if (pacing == -1) {
+				Log_fatal("Unknown pacing mode: %s", argv[i]);
+				return 0;
+			}
+		} else if (strcmp(argv[i], "--fps") == 0 && i + 1 < argc) {
+			fps_cap = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--tick-rate") == 0 && i + 1 < argc) {
+			tick_rate = atoi(argv[++i]);
+			if (tick_rate <= 0) {
+				Log_fatal("Tick rate must be positive");
+				return 0;
+			}
+		} else if (strcmp(argv[i], "--benchmark") == 0 && i + 1 < argc) {
+			benchmark_frames = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--benchmark-fps") == 0 && i + 1 < argc) {
+			benchmark_fps = atoi(argv[++i]);
+		} else if (strcmp(argv[i], "--capture") == 0 && i + 1 < argc) {
+			capture_prefix = argv[++i];
+		} else if (strcmp(argv[i], "--capture-format") == 0 && i + 1 < argc) {
+			capture_format = Capture_parse_format(argv[++i]);
+			if (capture_format == -1) {
+				Log_fatal("Unknown capture format: %s", argv[i]);
+				return 0;
+			}
+		} else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+			trace_path = argv[++i];
+			trace_at_start = 1;
+		} else if (strcmp(argv[i], "--metrics") == 0 && i + 1 < argc) {
+			metrics_path = argv[++i];
+		} else if (strcmp(argv[i], "--turntable") == 0) {
+			turntable = 1;
+		} else {
+			chart = argv[i];
+		}
+	}
 
-	if (argc < 2) {
+	if (chart == NULL) {
 		Log_fatal("No BMS file specified!");
 		return 0;
 	}
 
+	if (trace_at_start) {
+		Trace_start(trace_path);
+	}
+
+	// Benchmarks run offscreen and silent, so they need neither a display nor an audio device
+	if (benchmark_frames > 0) {
+		SDL_Init(0);
+		if (metrics_path != NULL) {
+			Metrics_start(metrics_path, 0);
+		}
+		Mixer_init_silent(44100);
+		Play_init(chart);
+		Memtrack_print_summary("after loading");
+		int result = Benchmark_run(benchmark_frames, benchmark_fps);
+		Mixer_destroy();
+		Metrics_stop();
+		Play_destroy();
+		Cache_destroy();
+		SDL_Quit();
+		Memtrack_print_summary("at exit");
+		Trace_destroy();
+		Log_destroy();
+		return result;
+	}
+
 	if (SDL_Init(SDL_INIT_EVERYTHING) != 0) {
 		Log_fatal("SDL_Init error: %s", SDL_GetError());
 		return 0;
 	}
 
-	Play_init(argv[1]);
+	if (metrics_path != NULL) {
+		Metrics_start(metrics_path, METRICS_DUMP_INTERVAL);
+	}
 
-	if (!Graphics_init()) {
+	if (!Mixer_init(44100, 256)) {
 		return 0;
 	}
 
-	if (!Mixer_init(44100, 256)) {
+	Play_init(chart);
+	Memtrack_print_summary("after loading");
+
+	if (capture_prefix != NULL && !Capture_start(capture_prefix, capture_format)) {
+		return 0;
+	}
+
+	Graphics_set_pacing(pacing, fps_cap);
+
+	if (!Graphics_init()) {
 		return 0;
 	}
 
@@ -40,28 +192,29 @@ int main(int argc, char* argv[]) {
 		return 0;
 	}
 
-	struct timespec loop_last;
-	struct timespec loop_start;
-	struct timespec loop_end;
-	struct timespec loop_target;
-	clock_gettime(CLOCK_MONOTONIC, &loop_last);
+	// Controllers with a turntable report it as the left stick's X axis
+	if (turntable) {
+		Input_bind_axis(0, SDL_CONTROLLER_AXIS_LEFTX);
+	}
+
+	Input_set_press_handler(Play_handle_press);
+
+	SDL_AtomicSet(&logic_running, 1);
+	SDL_Thread* logic_thread = SDL_CreateThread(logic_thread_main, "Logic", NULL);
 
 	int running = 1;
-	int loop_counter = 0;
-	int sleep_time = 0;
-	int rate_timer = loop_last.tv_sec;
 
 	Log_debug("Beginning main thread event loop");
 
+	// The main thread only handles events, which SDL needs done on the thread that
+	// made the window, and hands presses straight to the logic thread's queues
 	while (running) {
-		clock_gettime(CLOCK_MONOTONIC, &loop_start);
-		struct timespec dt = timespec_diff(loop_last, loop_start);
-		loop_target = timespec_add_ns(loop_start, LOOP_TIME_MS * 1E6);
+		SDL_Event event;
+		int has_event = SDL_WaitEventTimeout(&event, EVENT_TIMEOUT_MS);
 
-		Input_swap_state();
+		while (has_event) {
+			long long event_time = get_event_time(event.common.timestamp, get_time_ns());
 
-		SDL_Event event;
-		while (SDL_PollEvent(&event) != 0) {
 			switch (event.type) {
 				case SDL_QUIT:
 					Log_info("Initiating shutdown");
@@ -74,65 +227,73 @@ int main(int argc, char* argv[]) {
 							Play_change_scroll_speed(100);
 						} else if (event.key.keysym.scancode == SDL_SCANCODE_DOWN) {
 							Play_change_scroll_speed(-100);
+						} else if (event.key.keysym.scancode == SDL_SCANCODE_RIGHT) {
+							Play_change_rate(0.1);
+						} else if (event.key.keysym.scancode == SDL_SCANCODE_LEFT) {
+							Play_change_rate(-0.1);
+						} else if (event.key.keysym.scancode == SDL_SCANCODE_F1) {
+							Hud_toggle();
+						} else if (event.key.keysym.scancode == SDL_SCANCODE_F2) {
+							if (Trace_is_enabled()) {
+								Trace_stop();
+							} else {
+								Trace_start(trace_path);
+							}
 						} else {
-							Input_key_pressed(event.key.keysym.scancode);
+							Input_key_pressed(event.key.keysym.scancode, event_time);
 						}
 					}
 					break;
 
 				case SDL_KEYUP:
-					Input_key_released(event.key.keysym.scancode);
+					Input_key_released(event.key.keysym.scancode, event_time);
 					break;
 
 				case SDL_CONTROLLERBUTTONDOWN:
-					Input_gamepad_pressed(event.cbutton.button);
+					Input_gamepad_pressed(event.cbutton.which, event.cbutton.button, event_time);
 					break;
 
 				case SDL_CONTROLLERBUTTONUP:
-					Input_gamepad_released(event.cbutton.button);
+					Input_gamepad_released(event.cbutton.which, event.cbutton.button, event_time);
 					break;
 
-				default:
+				case SDL_CONTROLLERAXISMOTION:
+					Input_gamepad_axis(event.caxis.which, event.caxis.axis, event.caxis.value, event_time);
 					break;
-			}
-		}
 
-		Input_write_state();
+				case SDL_CONTROLLERDEVICEADDED:
+					Input_device_added(event.cdevice.which);
+					break;
 
-		Play_update(dt.tv_nsec);
+				case SDL_CONTROLLERDEVICEREMOVED:
+					Input_device_removed(event.cdevice.which, event_time);
+					break;
 
-		memcpy(&loop_last, &loop_start, sizeof(struct timespec));
+				default:
+					break;
+			}
 
-		/* keep track of and print thread loop rates
-		loop_counter++;
-		if (loop_start.tv_sec >= rate_timer) {
-			printf("\rmain rate: %f, render rate: %f", loop_counter / 3.0, Graphics_get_render_counter() / 3.0);
-			rate_timer += 3;
-			loop_counter = 0;
-			Graphics_reset_render_counter();
-			fflush(stdout);
-		}
-		*/
-
-		clock_gettime(CLOCK_MONOTONIC, &loop_end);
-		dt = timespec_diff(loop_end, loop_target);
-		sleep_time = dt.tv_nsec / 1E6;
-		if (sleep_time > 0 && sleep_time <= LOOP_TIME_MS) {
-			SDL_Delay(sleep_time);
-			do {
-				clock_gettime(CLOCK_MONOTONIC, &loop_end);
-				dt = timespec_diff(loop_end, loop_target);
-			} while (dt.tv_sec >= 0);
+			has_event = SDL_PollEvent(&event);
 		}
+
+		Input_update(get_time_ns());
 	}
 
+	SDL_AtomicSet(&logic_running, 0);
+	SDL_WaitThread(logic_thread, NULL);
+
 	Log_debug("Ended main thread event loop");
 
-	// destroy input
-	// destroy mixer
+	Input_destroy();
+	Mixer_destroy();
 	Graphics_destroy();
+	Capture_stop();
+	Metrics_stop();
 	Play_destroy();
+	Cache_destroy();
 	SDL_Quit();
+	Memtrack_print_summary("at exit");
+	Trace_destroy();
 	Log_destroy();
 
 	return 1;
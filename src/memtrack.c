@@ -0,0 +1,182 @@
+#include "memtrack.h"
+#include "log.h"
+#include "metrics.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <SDL2/SDL.h>
+
+// Stored just before each block, and padded to 16 bytes to keep the block aligned
+typedef union {
+	struct {
+		size_t size;
+		int tag;
+	} info;
+	long double align;
+	char padding[16];
+} BlockHeader;
+
+static const char* tag_names[MEMTRACK_TAGS] = {
+	"chart_parse",
+	"chart_objects",
+	"samples",
+	"render",
+	"log"
+};
+
+static SDL_SpinLock lock;
+static long long live[MEMTRACK_TAGS];
+static long long peak[MEMTRACK_TAGS];
+static long long total_peak;
+
+static Metric* live_metrics[MEMTRACK_TAGS];
+static Metric* peak_metrics[MEMTRACK_TAGS];
+
+// Count size bytes more (or fewer, if negative) against a tag
+static void adjust(int tag, long long size) {
+	SDL_AtomicLock(&lock);
+
+	live[tag] += size;
+	if (live[tag] > peak[tag]) {
+		peak[tag] = live[tag];
+	}
+
+	long long total = 0;
+	for (int i = 0; i < MEMTRACK_TAGS; i++) {
+		total += live[i];
+	}
+	if (total > total_peak) {
+		total_peak = total;
+	}
+
+	long long tag_live = live[tag];
+	long long tag_peak = peak[tag];
+
+	SDL_AtomicUnlock(&lock);
+
+	Metrics_set(live_metrics[tag], (int)(tag_live / 1024));
+	Metrics_set(peak_metrics[tag], (int)(tag_peak / 1024));
+}
+
+// Register the metrics, which then catch up with anything allocated before now
+void Memtrack_init() {
+	for (int i = 0; i < MEMTRACK_TAGS; i++) {
+		char name[METRICS_NAME_LENGTH];
+
+		snprintf(name, sizeof(name), "memory.%s.live_kb", tag_names[i]);
+		live_metrics[i] = Metrics_gauge(name);
+		snprintf(name, sizeof(name), "memory.%s.peak_kb", tag_names[i]);
+		peak_metrics[i] = Metrics_gauge(name);
+
+		adjust(i, 0);
+	}
+}
+
+void* Memtrack_malloc(int tag, size_t size) {
+	BlockHeader* header = malloc(sizeof(BlockHeader) + size);
+
+	if (header == NULL) {
+		return NULL;
+	}
+
+	header->info.size = size;
+	header->info.tag = tag;
+	adjust(tag, size);
+
+	return header + 1;
+}
+
+void* Memtrack_calloc(int tag, size_t count, size_t size) {
+	void* block = Memtrack_malloc(tag, count * size);
+
+	if (block != NULL) {
+		memset(block, 0, count * size);
+	}
+
+	return block;
+}
+
+// Like recalloc, for blocks from Memtrack_calloc
+// Returns NULL if it can't allocate, leaving the old array as it was
+void* Memtrack_recalloc(int tag, void* array, size_t elem_size, int old_count, int new_count) {
+	void* new_array = Memtrack_calloc(tag, new_count, elem_size);
+
+	if (new_array == NULL) {
+		return NULL;
+	}
+
+	if (array != NULL) {
+		memcpy(new_array, array, elem_size * (old_count < new_count ? old_count : new_count));
+		Memtrack_free(array);
+	}
+
+	return new_array;
+}
+
+char* Memtrack_strdup(int tag, const char* str) {
+	size_t length = strlen(str) + 1;
+	char* copy = Memtrack_malloc(tag, length);
+
+	if (copy != NULL) {
+		memcpy(copy, str, length);
+	}
+
+	return copy;
+}
+
+void Memtrack_free(void* ptr) {
+	if (ptr == NULL) {
+		return;
+	}
+
+	BlockHeader* header = (BlockHeader*)ptr - 1;
+	adjust(header->info.tag, -(long long)header->info.size);
+	free(header);
+}
+
+// Count memory that wasn't allocated through Memtrack
+void Memtrack_track(int tag, size_t size) {
+	adjust(tag, size);
+}
+
+void Memtrack_untrack(int tag, size_t size) {
+	adjust(tag, -(long long)size);
+}
+
+long long Memtrack_get_live(int tag) {
+	SDL_AtomicLock(&lock);
+	long long result = live[tag];
+	SDL_AtomicUnlock(&lock);
+
+	return result;
+}
+
+long long Memtrack_get_peak(int tag) {
+	SDL_AtomicLock(&lock);
+	long long result = peak[tag];
+	SDL_AtomicUnlock(&lock);
+
+	return result;
+}
+
+// Log how much memory each subsystem is using, and the most it has used
+void Memtrack_print_summary(const char* when) {
+	long long live_copy[MEMTRACK_TAGS];
+	long long peak_copy[MEMTRACK_TAGS];
+	long long total = 0;
+
+	SDL_AtomicLock(&lock);
+	memcpy(live_copy, live, sizeof(live));
+	memcpy(peak_copy, peak, sizeof(peak));
+	long long total_peak_copy = total_peak;
+	SDL_AtomicUnlock(&lock);
+
+	Log_info("Memory use %s:", when);
+
+	for (int i = 0; i < MEMTRACK_TAGS; i++) {
+		Log_info("  %-14s %9.2f MB live, %9.2f MB peak", tag_names[i], live_copy[i] / (1024.0 * 1024.0), peak_copy[i] / (1024.0 * 1024.0));
+		total += live_copy[i];
+	}
+
+	Log_info("  %-14s %9.2f MB live, %9.2f MB peak", "total", total / (1024.0 * 1024.0), total_peak_copy / (1024.0 * 1024.0));
+}
@@ -0,0 +1,336 @@
+#include "metrics.h"
+#include "log.h"
+#include "util.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <SDL2/SDL.h>
+
+// value is a counter's total, a gauge's value, or the last value a histogram recorded
+struct Metric {
+	char name[METRICS_NAME_LENGTH];
+	int type;
+	SDL_atomic_t value;
+	SDL_atomic_t count;
+	SDL_atomic_t min;
+	SDL_atomic_t max;
+	SDL_atomic_t buckets[METRICS_BUCKETS];
+
+	// A counter's total at the last dump, for its rate
+	int last_total;
+};
+
+static Metric metrics[METRICS_MAX];
+static SDL_atomic_t metric_count;
+static SDL_SpinLock register_lock;
+
+// Where and how often metrics are dumped, and when they last were
+static char path[1024];
+static SDL_TimerID timer;
+static SDL_mutex* dump_lock;
+static long long start_time;
+static long long last_dump;
+
+// Returns the bucket a value is counted in
+// Values below the sub-bucket count get a bucket each; above that, each power
+// of two is split evenly into METRICS_SUB_BUCKETS
+static int get_bucket(int value) {
+	if (value < METRICS_SUB_BUCKETS) {
+		return value < 0 ? 0 : value;
+	}
+
+	int exponent = 0;
+	while ((value >> (exponent + 1)) != 0) {
+		exponent++;
+	}
+
+	// Sub-buckets take the bits just below the leading one (two of them for 4)
+	int sub_bits = 0;
+	while ((1 << sub_bits) < METRICS_SUB_BUCKETS) {
+		sub_bits++;
+	}
+
+	int sub = (value >> (exponent - sub_bits)) & (METRICS_SUB_BUCKETS - 1);
+	return exponent * METRICS_SUB_BUCKETS + sub;
+}
+
+// Returns the middle of the range of values counted in a bucket
+static int get_bucket_value(int bucket) {
+	if (bucket < METRICS_SUB_BUCKETS) {
+		return bucket;
+	}
+
+	int exponent = bucket / METRICS_SUB_BUCKETS;
+	int sub = bucket % METRICS_SUB_BUCKETS;
+	long long width = (1LL << exponent) / METRICS_SUB_BUCKETS;
+	long long low = (1LL << exponent) + sub * width;
+	long long middle = low + width / 2;
+
+	return middle > INT_MAX ? INT_MAX : (int)middle;
+}
+
+// Find a metric by name, or register it with the given type if it's new
+static Metric* get_metric(const char* name, int type) {
+	Metric* metric = NULL;
+
+	SDL_AtomicLock(&register_lock);
+
+	int count = SDL_AtomicGet(&metric_count);
+	for (int i = 0; i < count; i++) {
+		if (strcmp(metrics[i].name, name) == 0) {
+			metric = &metrics[i];
+			break;
+		}
+	}
+
+	if (metric == NULL && count < METRICS_MAX) {
+		metric = &metrics[count];
+		snprintf(metric->name, sizeof(metric->name), "%s", name);
+		metric->type = type;
+		SDL_AtomicSet(&metric->min, INT_MAX);
+		SDL_AtomicSet(&metric->max, INT_MIN);
+		SDL_AtomicSet(&metric_count, count + 1);
+	}
+
+	SDL_AtomicUnlock(&register_lock);
+
+	if (metric == NULL) {
+		Log_warn("Too many metrics, not tracking %s", name);
+	} else if (metric->type != type) {
+		Log_warn("Metric %s is already registered as a different type", name);
+		return NULL;
+	}
+
+	return metric;
+}
+
+Metric* Metrics_counter(const char* name) {
+	return get_metric(name, METRICS_COUNTER);
+}
+
+Metric* Metrics_gauge(const char* name) {
+	return get_metric(name, METRICS_GAUGE);
+}
+
+Metric* Metrics_histogram(const char* name) {
+	return get_metric(name, METRICS_HISTOGRAM);
+}
+
+// Add to a counter
+void Metrics_add(Metric* metric, int amount) {
+	if (metric != NULL) {
+		SDL_AtomicAdd(&metric->value, amount);
+	}
+}
+
+// Set a gauge
+void Metrics_set(Metric* metric, int value) {
+	if (metric != NULL) {
+		SDL_AtomicSet(&metric->value, value);
+	}
+}
+
+// Count a value in a histogram
+void Metrics_record(Metric* metric, int value) {
+	if (metric == NULL) {
+		return;
+	}
+
+	SDL_AtomicSet(&metric->value, value);
+	SDL_AtomicAdd(&metric->count, 1);
+	SDL_AtomicAdd(&metric->buckets[get_bucket(value)], 1);
+
+	int min = SDL_AtomicGet(&metric->min);
+	while (value < min && !SDL_AtomicCAS(&metric->min, min, value)) {
+		min = SDL_AtomicGet(&metric->min);
+	}
+
+	int max = SDL_AtomicGet(&metric->max);
+	while (value > max && !SDL_AtomicCAS(&metric->max, max, value)) {
+		max = SDL_AtomicGet(&metric->max);
+	}
+}
+
+// Returns a counter's total, a gauge's value, or the last value a histogram recorded
+int Metrics_get(Metric* metric) {
+	return metric != NULL ? SDL_AtomicGet(&metric->value) : 0;
+}
+
+// Estimate the value below which the given fraction of a histogram's values fall
+// Returns 0 for an empty histogram
+int Metrics_get_percentile(Metric* metric, double fraction) {
+	if (metric == NULL) {
+		return 0;
+	}
+
+	int count = SDL_AtomicGet(&metric->count);
+	if (count == 0) {
+		return 0;
+	}
+
+	int min = SDL_AtomicGet(&metric->min);
+	int max = SDL_AtomicGet(&metric->max);
+	long long target = (long long)(count * fraction);
+	long long seen = 0;
+
+	for (int i = 0; i < METRICS_BUCKETS; i++) {
+		seen += SDL_AtomicGet(&metric->buckets[i]);
+
+		if (seen > target) {
+			int value = get_bucket_value(i);
+			return value < min ? min : value > max ? max : value;
+		}
+	}
+
+	return max;
+}
+
+// Mean of a histogram's values, going by the middle of each bucket
+static double get_mean(Metric* metric) {
+	long long total = 0;
+	long long count = 0;
+
+	for (int i = 0; i < METRICS_BUCKETS; i++) {
+		int in_bucket = SDL_AtomicGet(&metric->buckets[i]);
+		total += (long long)in_bucket * get_bucket_value(i);
+		count += in_bucket;
+	}
+
+	return count > 0 ? (double)total / count : 0.0;
+}
+
+// Write the metrics of one type as the members of a JSON object
+static void write_section(FILE* fp, int type, double interval) {
+	int first = 1;
+	int count = SDL_AtomicGet(&metric_count);
+
+	for (int i = 0; i < count; i++) {
+		Metric* metric = &metrics[i];
+
+		if (metric->type != type) {
+			continue;
+		}
+
+		fprintf(fp, first ? "\n" : ",\n");
+		first = 0;
+
+		if (type == METRICS_COUNTER) {
+			int total = SDL_AtomicGet(&metric->value);
+			double rate = interval > 0.0 ? (total - metric->last_total) / interval : 0.0;
+			fprintf(fp, "\t\t\"%s\": {\"total\": %d, \"rate\": %.2f}", metric->name, total, rate);
+			metric->last_total = total;
+		} else if (type == METRICS_GAUGE) {
+			fprintf(fp, "\t\t\"%s\": %d", metric->name, SDL_AtomicGet(&metric->value));
+		} else {
+			int samples = SDL_AtomicGet(&metric->count);
+			fprintf(fp, "\t\t\"%s\": {\"count\": %d, \"min\": %d, \"mean\": %.1f, \"p50\": %d, \"p90\": %d, \"p99\": %d, \"max\": %d}",
+				metric->name, samples,
+				samples > 0 ? SDL_AtomicGet(&metric->min) : 0,
+				get_mean(metric),
+				Metrics_get_percentile(metric, 0.5),
+				Metrics_get_percentile(metric, 0.9),
+				Metrics_get_percentile(metric, 0.99),
+				samples > 0 ? SDL_AtomicGet(&metric->max) : 0);
+		}
+	}
+
+	fprintf(fp, first ? "}" : "\n\t}");
+}
+
+// Write every metric to the file given to Metrics_start, replacing what was there
+// Counter rates are per second since the last write
+int Metrics_write() {
+	if (dump_lock == NULL) {
+		return 0;
+	}
+
+	SDL_LockMutex(dump_lock);
+
+	if (path[0] == '\0') {
+		SDL_UnlockMutex(dump_lock);
+		return 0;
+	}
+
+	// Written beside the file and moved over it, so readers never see half a dump
+	char temp_path[sizeof(path) + 4];
+	snprintf(temp_path, sizeof(temp_path), "%s.tmp", path);
+
+	FILE* fp = fopen(temp_path, "w");
+
+	if (fp == NULL) {
+		SDL_UnlockMutex(dump_lock);
+		Log_limited(Log_error, 1, "Couldn't open %s for writing", temp_path);
+		return 0;
+	}
+
+	long long now = get_time_ns();
+	double interval = (now - last_dump) / 1E9;
+	last_dump = now;
+
+	fprintf(fp, "{\n\t\"uptime\": %.3f,\n", (now - start_time) / 1E9);
+	fprintf(fp, "\t\"counters\": {");
+	write_section(fp, METRICS_COUNTER, interval);
+	fprintf(fp, ",\n\t\"gauges\": {");
+	write_section(fp, METRICS_GAUGE, interval);
+	fprintf(fp, ",\n\t\"histograms\": {");
+	write_section(fp, METRICS_HISTOGRAM, interval);
+	fprintf(fp, "\n}\n");
+	fclose(fp);
+
+	int result = rename(temp_path, path) == 0;
+	SDL_UnlockMutex(dump_lock);
+
+	return result;
+}
+
+// Runs on SDL's timer thread
+static Uint32 dump_callback(Uint32 interval, void* data) {
+	Metrics_write();
+	return interval;
+}
+
+// Write metrics to path every interval milliseconds, and once more at Metrics_stop
+// With an interval of 0, or without SDL's timer, they're only written at the end
+int Metrics_start(const char* file, int interval) {
+	if (dump_lock == NULL) {
+		dump_lock = SDL_CreateMutex();
+	}
+
+	SDL_LockMutex(dump_lock);
+	snprintf(path, sizeof(path), "%s", file);
+	start_time = get_time_ns();
+	last_dump = start_time;
+	SDL_UnlockMutex(dump_lock);
+
+	if (interval > 0 && SDL_WasInit(SDL_INIT_TIMER)) {
+		timer = SDL_AddTimer(interval, dump_callback, NULL);
+
+		if (timer == 0) {
+			Log_error("Couldn't start the metrics timer: %s", SDL_GetError());
+			return 0;
+		}
+	}
+
+	Log_info("Writing metrics to %s", path);
+
+	return 1;
+}
+
+// The lock is kept, since a timer callback that was already running may still take it
+void Metrics_stop() {
+	if (dump_lock == NULL) {
+		return;
+	}
+
+	if (timer != 0) {
+		SDL_RemoveTimer(timer);
+		timer = 0;
+	}
+
+	Metrics_write();
+
+	SDL_LockMutex(dump_lock);
+	path[0] = '\0';
+	SDL_UnlockMutex(dump_lock);
+}
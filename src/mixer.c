@@ -1,102 +1,614 @@
 #include "mixer.h"
 #include "log.h"
+#include "memtrack.h"
+#include "metrics.h"
+#include "trace.h"
+#include "util.h"
 
+#include <math.h>
 #include <stdio.h>
+#include <string.h>
 #include <portaudio.h>
 #include <sndfile.h>
 #include <samplerate.h>
+#include <SDL2/SDL.h>
 
 #define NUM_CHANNELS 2048
 #define SAMPLE_RATE 44100
 
+// Streams keep the first half second decoded so they can start instantly,
+// and the decoder thread keeps up to ~3 seconds decoded ahead of playback.
+#define MAX_STREAMS 32
+#define STREAM_PRELOAD_FRAMES (SAMPLE_RATE / 2)
+#define STREAM_RING_SAMPLES (1 << 18)
+#define STREAM_CHUNK_FRAMES 4096
+
+// Channels are mixed in blocks of this many frames
+#define MIX_BLOCK_FRAMES 256
+#define COMMAND_QUEUE_SIZE 1024
+
+// The limiter looks this many frames ahead, which is also the latency it adds
+#define LIMITER_LOOKAHEAD 32
+#define LIMITER_CEILING 0.98f
+#define LIMITER_RELEASE 0.02f
+
+// A sound decoded incrementally from disk
+struct MixerStream {
+	char* path;
+	SNDFILE* file;
+	SF_INFO info;
+	SRC_STATE* resampler;
+	double ratio;
+
+	// The first STREAM_PRELOAD_FRAMES of the sound, decoded at open time
+	float* preload;
+	size_t preload_size;
+
+	// Decoder output waiting to be copied into the ring or preload buffer
+	float* input;
+	float* staging;
+	long staging_size;
+	long staging_index;
+	int end_of_input;
+
+	// Single producer (decoder thread), single consumer (audio callback).
+	// read and write are running sample counts, masked to index the ring.
+	float* ring;
+	SDL_atomic_t read;
+	SDL_atomic_t write;
+	SDL_atomic_t eof;
+
+	// Bumped on every trigger; the decoder rewinds when it sees a new value,
+	// and marks the ring ready for that value once it has been refilled.
+	SDL_atomic_t generation;
+	SDL_atomic_t ready;
+	int decoder_generation;
+};
+
+// A sound playing on the mixer. Only ever touched by the audio callback.
 typedef struct {
 	float* data;
-	size_t size;
-	int index;
-	int finished;
+	long frames;
+	double position;
+	MixerStream* stream;
+	int bus;
+	int generation;
+	int ring_started;
+	int ring_base;
 } Channel;
 
+// Requests from other threads, handed to the audio callback through a queue
+enum {
+	COMMAND_ADD = 0,
+	COMMAND_ADD_STREAM,
+	COMMAND_SET_RATE,
+	COMMAND_SET_BUS_GAIN,
+	COMMAND_SET_CHART_GAIN
+};
+
+typedef struct {
+	SDL_atomic_t sequence;
+	int type;
+	int bus;
+	float* data;
+	size_t size;
+	MixerStream* stream;
+	double value;
+} Command;
+
 static PaStream* stream = NULL;
+static int silent = 0;
 static Channel channels[NUM_CHANNELS];
+static int active_channels = 0;
 static int sample_rate;
 static int buffer_size;
 // static int state = MIXER_PLAYING;
 static float volume = 0.5f;
+static double rate = 1.0;
+
+// Gains applied to each bus and to the whole chart (#VOLWAV), along with the
+// gains used for the previous block so changes can be ramped in smoothly
+static float bus_gains[MIXER_NUM_BUSES] = { 1.0f, 1.0f };
+static float last_bus_gains[MIXER_NUM_BUSES] = { 1.0f, 1.0f };
+static float chart_gain = 1.0f;
+
+// Look-ahead limiter state: the delayed frames, the gain each of them needs,
+// and the gain currently being applied
+static float limiter_delay[LIMITER_LOOKAHEAD * 2];
+static float limiter_targets[LIMITER_LOOKAHEAD];
+static int limiter_position = 0;
+static float limiter_gain = 1.0f;
+
+// Bounded multi-producer, single-consumer command queue
+static Command commands[COMMAND_QUEUE_SIZE];
+static SDL_atomic_t command_write;
+static int command_read = 0;
+
+// Mixer_halt bumps halt_requested and waits for the callback to catch up
+static SDL_atomic_t halt_requested;
+static SDL_atomic_t halt_acknowledged;
+
+// Optional listener for the final output
+static void* tap = NULL;
 
-// Mix the samples of every channel into one
-static float mix_samples() {
-	float sample = 0.0f;
+static Metric* callbacks_metric;
+static Metric* callback_time_metric;
+static Metric* load_metric;
+static Metric* voices_metric;
+static Metric* underruns_metric;
 
-	// Sum up all channels
-	for (int i = 0; i < NUM_CHANNELS; i++) {
-		if (channels[i].finished) {
-			continue;
+static MixerStream* streams[MAX_STREAMS];
+static SDL_mutex* streams_lock = NULL;
+static SDL_Thread* decoder_thread = NULL;
+static int decoder_running = 0;
+
+// Claim a slot in the command queue, fill it, and publish it to the callback
+// Returns 0 if the queue is full
+static int push_command(int type, int bus, float* data, size_t size, MixerStream* s, double value) {
+	// Nothing would ever take commands off the queue
+	if (silent) {
+		return 1;
+	}
+
+	int position = SDL_AtomicGet(&command_write);
+	Command* command;
+
+	for (;;) {
+		command = &commands[position & (COMMAND_QUEUE_SIZE - 1)];
+		int difference = SDL_AtomicGet(&command->sequence) - position;
+
+		if (difference == 0) {
+			if (SDL_AtomicCAS(&command_write, position, position + 1)) {
+				break;
+			}
+		} else if (difference < 0) {
+			return 0;
 		}
 
-		sample += channels[i].data[channels[i].index];
+		position = SDL_AtomicGet(&command_write);
+	}
+
+	command->type = type;
+	command->bus = bus;
+	command->data = data;
+	command->size = size;
+	command->stream = s;
+	command->value = value;
+	SDL_AtomicSet(&command->sequence, position + 1);
+
+	return 1;
+}
+
+// Take the next command off the queue, if there is one
+static Command* peek_command() {
+	Command* command = &commands[command_read & (COMMAND_QUEUE_SIZE - 1)];
 
-		channels[i].index++;
+	if (SDL_AtomicGet(&command->sequence) != command_read + 1) {
+		return NULL;
+	}
+
+	return command;
+}
 
-		if (channels[i].index == channels[i].size) {
-			channels[i].finished = 1;
+// Return a command's slot to the producers
+static void release_command(Command* command) {
+	SDL_AtomicSet(&command->sequence, command_read + COMMAND_QUEUE_SIZE);
+	command_read++;
+}
+
+// Start a new channel for an in-memory sound or a stream
+static void start_channel(int bus, float* data, size_t size, MixerStream* s) {
+	Channel* channel = NULL;
+
+	// A stream only plays on one channel at a time, so restart it if it's already playing
+	if (s != NULL) {
+		for (int i = 0; i < active_channels; i++) {
+			if (channels[i].stream == s) {
+				channel = &channels[i];
+				break;
+			}
 		}
 	}
 
-	// Adjust to the master volume
-	sample *= volume;
+	if (channel == NULL) {
+		// If there are no free channels, give up
+		if (active_channels == NUM_CHANNELS) {
+			return;
+		}
 
-	// Clip the sample
-	if (sample > 1.0f) {
-		sample = 1.0f;
-	} else if (sample < -1.0f) {
-		sample = -1.0f;
+		channel = &channels[active_channels++];
 	}
 
-	return sample;
+	channel->data = data;
+	channel->frames = size / 2;
+	channel->position = 0.0;
+	channel->stream = s;
+	channel->bus = bus;
+	channel->ring_started = 0;
+
+	if (s != NULL) {
+		channel->generation = SDL_AtomicAdd(&s->generation, 1) + 1;
+	}
+}
+
+// Apply every pending command before mixing the next block
+static void process_commands() {
+	if (SDL_AtomicGet(&halt_requested) != SDL_AtomicGet(&halt_acknowledged)) {
+		active_channels = 0;
+		SDL_AtomicSet(&halt_acknowledged, SDL_AtomicGet(&halt_requested));
+	}
+
+	Command* command;
+	while ((command = peek_command()) != NULL) {
+		switch (command->type) {
+			case COMMAND_ADD:
+				start_channel(command->bus, command->data, command->size, NULL);
+				break;
+
+			case COMMAND_ADD_STREAM:
+				start_channel(command->bus, NULL, 0, command->stream);
+				break;
+
+			case COMMAND_SET_RATE:
+				rate = command->value;
+
+				// Snap back onto whole frames so 1x playback can take the direct path again
+				if (rate == 1.0) {
+					for (int i = 0; i < active_channels; i++) {
+						channels[i].position = floor(channels[i].position + 0.5);
+					}
+				}
+				break;
+
+			case COMMAND_SET_BUS_GAIN:
+				bus_gains[command->bus] = (float)command->value;
+				break;
+
+			case COMMAND_SET_CHART_GAIN:
+				chart_gain = (float)command->value;
+				break;
+		}
+
+		release_command(command);
+	}
+}
+
+// Copy frames [first, first + count) of a channel's sound into dst as stereo,
+// padding with silence before the start and after the end of the sound.
+// Returns 0 if a stream hasn't been decoded that far yet, in which case the
+// missing frames are silent too.
+static int fetch_frames(Channel* channel, long first, long count, float* dst) {
+	MixerStream* s = channel->stream;
+
+	// Frames before the start of the sound
+	while (count > 0 && first < 0) {
+		*dst++ = 0.0f;
+		*dst++ = 0.0f;
+		first++;
+		count--;
+	}
+
+	if (s == NULL) {
+		long n = channel->frames - first;
+		n = n < 0 ? 0 : (n > count ? count : n);
+		memcpy(dst, channel->data + first * 2, sizeof(float) * n * 2);
+		memset(dst + n * 2, 0, sizeof(float) * (count - n) * 2);
+		return 1;
+	}
+
+	// Frames inside the preloaded section
+	long preload_frames = s->preload_size / 2;
+	if (count > 0 && first < preload_frames) {
+		long n = preload_frames - first < count ? preload_frames - first : count;
+		memcpy(dst, s->preload + first * 2, sizeof(float) * n * 2);
+		dst += n * 2;
+		first += n;
+		count -= n;
+	}
+
+	if (count == 0) {
+		return 1;
+	}
+
+	// The ring hasn't been refilled since this channel was (re)triggered
+	if (SDL_AtomicGet(&s->ready) != channel->generation) {
+		memset(dst, 0, sizeof(float) * count * 2);
+		return 0;
+	}
+
+	// Nothing has been consumed from the ring yet for this trigger, so the
+	// decoder's restart point is wherever the read counter sits now
+	if (!channel->ring_started) {
+		channel->ring_base = SDL_AtomicGet(&s->read);
+		channel->ring_started = 1;
+	}
+
+	long available = (long)(unsigned int)(SDL_AtomicGet(&s->write) - channel->ring_base) / 2;
+	long ring_first = first - preload_frames;
+	long n = available - ring_first;
+	n = n < 0 ? 0 : (n > count ? count : n);
+
+	for (long i = 0; i < n; i++) {
+		int index = channel->ring_base + (int)(ring_first + i) * 2;
+		dst[i * 2] = s->ring[index & (STREAM_RING_SAMPLES - 1)];
+		dst[i * 2 + 1] = s->ring[(index + 1) & (STREAM_RING_SAMPLES - 1)];
+	}
+	memset(dst + n * 2, 0, sizeof(float) * (count - n) * 2);
+
+	return n == count || SDL_AtomicGet(&s->eof);
+}
+
+// Returns the number of frames in a channel's sound that are known so far
+static long channel_length(Channel* channel) {
+	MixerStream* s = channel->stream;
+
+	if (s == NULL) {
+		return channel->frames;
+	}
+
+	// A stream's length isn't known until the decoder reaches the end of it
+	if (!SDL_AtomicGet(&s->eof) || SDL_AtomicGet(&s->ready) != channel->generation || !channel->ring_started) {
+		return -1;
+	}
+
+	return s->preload_size / 2 + (long)(unsigned int)(SDL_AtomicGet(&s->write) - channel->ring_base) / 2;
+}
+
+// Let the decoder reuse ring space behind a stream's play position
+static void consume_frames(Channel* channel) {
+	MixerStream* s = channel->stream;
+
+	if (s == NULL || !channel->ring_started) {
+		return;
+	}
+
+	// Keep one frame of history for interpolation
+	long keep = (long)channel->position - 1 - s->preload_size / 2;
+
+	if (keep > 0) {
+		SDL_AtomicSet(&s->read, channel->ring_base + (int)keep * 2);
+	}
+}
+
+// Add frames to the mix at the original pitch
+static void mix_direct(float* mix, const float* src, int frames) {
+	for (int i = 0; i < frames * 2; i++) {
+		mix[i] += src[i];
+	}
+}
+
+// Add frames to the mix at a different rate using Catmull-Rom interpolation.
+// src holds stereo frames starting one frame before floor(position), and
+// offsets holds i * step for each output frame, shared by every channel.
+static void mix_cubic(float* mix, const float* src, double fraction, const double* offsets, int frames) {
+	for (int i = 0; i < frames; i++) {
+		double x = fraction + offsets[i];
+		int index = (int)x;
+		float t = (float)(x - index);
+		const float* p = src + index * 2;
+
+		for (int c = 0; c < 2; c++) {
+			float p0 = p[c];
+			float p1 = p[c + 2];
+			float p2 = p[c + 4];
+			float p3 = p[c + 6];
+			mix[i * 2 + c] += p1 + 0.5f * t * (p2 - p0 + t * (2.0f * p0 - 5.0f * p1 + 4.0f * p2 - p3 + t * (3.0f * (p1 - p2) + p3 - p0)));
+		}
+	}
+}
+
+// Bring peaks down under LIMITER_CEILING without clipping.
+// Output is delayed by LIMITER_LOOKAHEAD frames, so the gain can be lowered
+// gradually before a peak reaches the output instead of after.
+static void limit(float* samples, int frames) {
+	float delayed[LIMITER_LOOKAHEAD * 2];
+
+	while (frames > 0) {
+		int n = frames < LIMITER_LOOKAHEAD ? frames : LIMITER_LOOKAHEAD;
+
+		// Find the gain that the incoming chunk needs
+		float peak = 0.0f;
+		for (int i = 0; i < n * 2; i++) {
+			float magnitude = fabsf(samples[i]);
+			peak = magnitude > peak ? magnitude : peak;
+		}
+		float target = peak > LIMITER_CEILING ? LIMITER_CEILING / peak : 1.0f;
+
+		// Every frame in the delay line, including the ones about to leave it,
+		// must be output at or below its own target
+		float lowest = target;
+		for (int i = 0; i < LIMITER_LOOKAHEAD; i++) {
+			lowest = limiter_targets[i] < lowest ? limiter_targets[i] : lowest;
+		}
+
+		// Swap the incoming chunk with the oldest frames in the delay line
+		for (int i = 0; i < n; i++) {
+			int index = (limiter_position + i) % LIMITER_LOOKAHEAD;
+			delayed[i * 2] = limiter_delay[index * 2];
+			delayed[i * 2 + 1] = limiter_delay[index * 2 + 1];
+			limiter_delay[index * 2] = samples[i * 2];
+			limiter_delay[index * 2 + 1] = samples[i * 2 + 1];
+			limiter_targets[index] = target;
+		}
+		limiter_position = (limiter_position + n) % LIMITER_LOOKAHEAD;
+
+		// Attack immediately, release slowly
+		float next = lowest < limiter_gain ? lowest : limiter_gain + (lowest - limiter_gain) * LIMITER_RELEASE;
+		float slope = (next - limiter_gain) / n;
+
+		for (int i = 0; i < n; i++) {
+			float gain = limiter_gain + slope * (i + 1);
+			samples[i * 2] = delayed[i * 2] * gain;
+			samples[i * 2 + 1] = delayed[i * 2 + 1] * gain;
+		}
+
+		limiter_gain = next;
+		samples += n * 2;
+		frames -= n;
+	}
+}
+
+// Mix one block of every active channel into out
+static void mix_block(float* out, int frames) {
+	// Enough source frames for one block at MIXER_MAX_RATE, plus interpolation taps
+	static float source[(MIX_BLOCK_FRAMES * 2 + 4) * 2];
+	static double offsets[MIX_BLOCK_FRAMES];
+	static float buses[MIXER_NUM_BUSES][MIX_BLOCK_FRAMES * 2];
+
+	for (int i = 0; i < MIXER_NUM_BUSES; i++) {
+		memset(buses[i], 0, sizeof(float) * frames * 2);
+	}
+
+	double step = rate;
+	for (int i = 0; i < frames; i++) {
+		offsets[i] = i * step;
+	}
+
+	for (int i = 0; i < active_channels; i++) {
+		Channel* channel = &channels[i];
+		float* mix = buses[channel->bus];
+		long start = (long)channel->position;
+		double fraction = channel->position - start;
+
+		// At the original rate, in-memory sounds are added straight from their buffer
+		if (step == 1.0 && fraction == 0.0 && channel->stream == NULL && start + frames <= channel->frames) {
+			mix_direct(mix, channel->data + start * 2, frames);
+		} else if (step == 1.0 && fraction == 0.0) {
+			if (!fetch_frames(channel, start, frames, source)) {
+				Metrics_add(underruns_metric, 1);
+			}
+			mix_direct(mix, source, frames);
+		} else {
+			long needed = (long)(fraction + offsets[frames - 1]) + 4;
+			if (!fetch_frames(channel, start - 1, needed, source)) {
+				Metrics_add(underruns_metric, 1);
+			}
+			mix_cubic(mix, source, fraction, offsets, frames);
+		}
+
+		// A stream the decoder is behind on moves on regardless, so it stays in
+		// time with the chart; the decoder skips ahead to catch up
+		channel->position += frames * step;
+		consume_frames(channel);
+
+		// Remove finished channels by moving the last active channel into their place
+		long length = channel_length(channel);
+		if (length >= 0 && channel->position >= length) {
+			channels[i--] = channels[--active_channels];
+		}
+	}
+
+	// Sum the buses, ramping each one's gain from the last block's value
+	memset(out, 0, sizeof(float) * frames * 2);
+
+	for (int b = 0; b < MIXER_NUM_BUSES; b++) {
+		float from = last_bus_gains[b] * chart_gain * volume;
+		float to = bus_gains[b] * chart_gain * volume;
+		float slope = (to - from) / frames;
+		const float* bus = buses[b];
+
+		for (int i = 0; i < frames; i++) {
+			float gain = from + slope * i;
+			out[i * 2] += bus[i * 2] * gain;
+			out[i * 2 + 1] += bus[i * 2 + 1] * gain;
+		}
+
+		last_bus_gains[b] = bus_gains[b];
+	}
+
+	limit(out, frames);
 }
 
 // PortAudio callback
 static int Mixer_PACallback(const void* input, void* output, unsigned long frame_count,
 	const PaStreamCallbackTimeInfo* time_info, PaStreamCallbackFlags status_flags, void* user_data) {
 	float* out = (float*)output;
+	unsigned long total_frames = frame_count;
 
-	// For each frame, play back two mixed samples (one per stereo channel)
-	for (int i = 0; i < frame_count; i++) {
-		*out++ = mix_samples(); // Left
-		*out++ = mix_samples(); // Right
+	// PortAudio owns this thread, so it's named the first time it calls back
+	static int named = 0;
+	if (!named) {
+		Trace_name_thread("Audio");
+		named = 1;
 	}
 
+	long long span = Trace_begin();
+	long long start = get_time_ns();
+
+	process_commands();
+
+	// Mix in blocks of interleaved stereo frames
+	while (frame_count > 0) {
+		int frames = frame_count < MIX_BLOCK_FRAMES ? (int)frame_count : MIX_BLOCK_FRAMES;
+		mix_block(out, frames);
+		out += frames * 2;
+		frame_count -= frames;
+	}
+
+	MixerTap listener = (MixerTap)SDL_AtomicGetPtr(&tap);
+	if (listener != NULL) {
+		listener((const float*)output, total_frames);
+	}
+
+	// How much of the time this block lasts was spent mixing it
+	long long elapsed = get_time_ns() - start;
+	Metrics_add(callbacks_metric, 1);
+	Metrics_record(callback_time_metric, (int)(elapsed / 1000));
+	Metrics_set(load_metric, (int)(elapsed * sample_rate / (total_frames * 10000000LL)));
+	Metrics_set(voices_metric, active_channels);
+
+	Trace_end("Mixer_PACallback", span);
+
 	return 0;
 }
 
-int Mixer_load_file(const char* path, float** buffer, size_t* size) {
+// Decode a whole file to stereo at the mixer's sample rate
+// The buffer is counted as samples and must be freed with Memtrack_free
+// Returns MIXER_LOAD_DECODED, MIXER_LOAD_FAILED, or MIXER_LOAD_TOO_LONG without
+// decoding anything if the file is longer than MIXER_STREAM_THRESHOLD and
+// decode_long is 0, since it should be streamed instead
+int Mixer_load_file(const char* path, int decode_long, float** buffer, size_t* size) {
 	// Open the file
-	SF_INFO info = {};
+	SF_INFO info = {0};
 	SNDFILE* file = sf_open(path, SFM_READ, &info);
 
 	if (file == NULL) {
 		Log_error("Error opening sound file: %s", sf_strerror(file));
-		return 0;
+		return MIXER_LOAD_FAILED;
+	}
+
+	if (!decode_long && (size_t)(info.frames * (SAMPLE_RATE / (double)info.samplerate)) * 2 > MIXER_STREAM_THRESHOLD) {
+		sf_close(file);
+		return MIXER_LOAD_TOO_LONG;
 	}
 
 	// Prepare libsamplerate
-	SRC_DATA data = {};
+	SRC_DATA data = {0};
 	data.src_ratio = SAMPLE_RATE / (double)info.samplerate;
 	data.input_frames = info.frames;
 	data.output_frames = (int)(info.frames * data.src_ratio) + 1;
-	float* input_buffer = malloc(sizeof(float) * info.frames * info.channels);
-	data.data_out = malloc(sizeof(float) * data.output_frames * info.channels);
+	float* input_buffer = Memtrack_malloc(MEMTRACK_SAMPLES, sizeof(float) * info.frames * info.channels);
+	data.data_out = Memtrack_malloc(MEMTRACK_SAMPLES, sizeof(float) * data.output_frames * info.channels);
+
+	if (input_buffer == NULL || data.data_out == NULL) {
+		Log_error("Out of memory decoding %s", path);
+		Memtrack_free(input_buffer);
+		Memtrack_free(data.data_out);
+		sf_close(file);
+		return MIXER_LOAD_FAILED;
+	}
 
 	// Read the audio data from the file
 	sf_count_t items_read = sf_read_float(file, input_buffer, info.frames * info.channels);
+	sf_close(file);
 
 	if (items_read != info.frames * info.channels) {
 		Log_error("Read %lld samples instead of %lld!", items_read, info.frames * info.channels);
-		return 0;
+		Memtrack_free(input_buffer);
+		Memtrack_free(data.data_out);
+		return MIXER_LOAD_FAILED;
 	}
 
-	sf_close(file);
-
 	data.data_in = input_buffer;
 
 	// Convert the sample rate to 44.1khz
@@ -104,23 +616,25 @@ int Mixer_load_file(const char* path, float** buffer, size_t* size) {
 
 	if (error) {
 		Log_error("Error converting sample rate: %s", src_strerror(error));
-		return 0;
+		Memtrack_free(input_buffer);
+		Memtrack_free(data.data_out);
+		return MIXER_LOAD_FAILED;
 	}
 
-	free(input_buffer);
+	Memtrack_free(input_buffer);
 
 	*size = data.output_frames_gen * 2;
 
 	// Convert mono to stereo if necessary
 	if (info.channels == 1) {
-		float* stereo = malloc(sizeof(float) * *size);
+		float* stereo = Memtrack_malloc(MEMTRACK_SAMPLES, sizeof(float) * *size);
 
 		for (int i = 0; i < data.output_frames_gen; i++) {
 			stereo[i * 2] = data.data_out[i];
 			stereo[i * 2 + 1] = data.data_out[i];
 		}
 
-		free(data.data_out);
+		Memtrack_free(data.data_out);
 		*buffer = stereo;
 	}
 	// Do nothing for stereo
@@ -130,28 +644,326 @@ int Mixer_load_file(const char* path, float** buffer, size_t* size) {
 	// 0 channels or >2 is not supported right now
 	else {
 		Log_error("Unsupported number of channels.");
-		 return 0;
+		Memtrack_free(data.data_out);
+		return MIXER_LOAD_FAILED;
 	}
 
 	// Log_debug("Chunk loaded and converted: %s, %dhz, %d channels", path, info.samplerate, info.channels);
+	return MIXER_LOAD_DECODED;
+}
+
+// Decode the next chunk of a stream into its staging buffer
+// Returns the number of frames staged, or 0 at the end of the file
+static long stream_decode_chunk(MixerStream* s) {
+	if (s->end_of_input) {
+		return 0;
+	}
+
+	sf_count_t frames_read = sf_readf_float(s->file, s->input, STREAM_CHUNK_FRAMES);
+	s->end_of_input = frames_read < STREAM_CHUNK_FRAMES;
+
+	float* resampled = s->input;
+	long frames = (long)frames_read;
+
+	// Convert the sample rate to 44.1khz, keeping the converter's state between chunks
+	if (s->resampler != NULL) {
+		SRC_DATA data = {0};
+		data.data_in = s->input;
+		data.input_frames = (long)frames_read;
+		data.data_out = s->staging;
+		data.output_frames = (long)(STREAM_CHUNK_FRAMES * s->ratio) + 1;
+		data.src_ratio = s->ratio;
+		data.end_of_input = s->end_of_input;
+
+		int error = src_process(s->resampler, &data);
+
+		if (error) {
+			Log_error("Error converting sample rate of %s: %s", s->path, src_strerror(error));
+			s->end_of_input = 1;
+			return 0;
+		}
+
+		resampled = s->staging;
+		frames = data.output_frames_gen;
+	}
+
+	// Interleave into stereo in the staging buffer, working backwards so mono data
+	// can be expanded in place
+	if (s->info.channels == 1) {
+		for (long i = frames - 1; i >= 0; i--) {
+			float sample = resampled[i];
+			s->staging[i * 2] = sample;
+			s->staging[i * 2 + 1] = sample;
+		}
+	} else if (resampled != s->staging) {
+		memcpy(s->staging, resampled, sizeof(float) * frames * 2);
+	}
+
+	s->staging_size = frames * 2;
+	s->staging_index = 0;
+
+	return frames;
+}
+
+// Copy up to count decoded samples into dst, decoding more as needed
+// Returns the number of samples copied
+static long stream_read(MixerStream* s, float* dst, long count) {
+	long copied = 0;
+
+	while (copied < count) {
+		if (s->staging_index == s->staging_size && stream_decode_chunk(s) == 0) {
+			break;
+		}
+
+		long available = s->staging_size - s->staging_index;
+		long n = available < count - copied ? available : count - copied;
+
+		if (dst != NULL) {
+			memcpy(dst + copied, s->staging + s->staging_index, sizeof(float) * n);
+		}
+
+		s->staging_index += n;
+		copied += n;
+	}
+
+	return copied;
+}
+
+// Seek a stream back to the start of the file and discard the preloaded section,
+// so that decoding picks up exactly where the preload buffer leaves off
+static void stream_rewind(MixerStream* s) {
+	sf_seek(s->file, 0, SEEK_SET);
+
+	if (s->resampler != NULL) {
+		src_reset(s->resampler);
+	}
+
+	s->staging_size = 0;
+	s->staging_index = 0;
+	s->end_of_input = 0;
+
+	stream_read(s, NULL, s->preload_size);
+}
+
+// Keep one stream's ring buffer topped up
+// Returns nonzero if any work was done
+static int stream_service(MixerStream* s) {
+	int generation = SDL_AtomicGet(&s->generation);
+
+	// The stream was (re)triggered; the channel plays from the preload buffer
+	// while the ring is rebuilt from the point where the preload ends
+	if (generation != s->decoder_generation) {
+		stream_rewind(s);
+		SDL_AtomicSet(&s->eof, 0);
+		SDL_AtomicSet(&s->write, SDL_AtomicGet(&s->read));
+		s->decoder_generation = generation;
+	}
+
+	int read = SDL_AtomicGet(&s->read);
+	int write = SDL_AtomicGet(&s->write);
+
+	// Playback got ahead of the decoder, so drop what it has already played past
+	if ((int)(read - write) > 0 && !SDL_AtomicGet(&s->eof)) {
+		long skipped = stream_read(s, NULL, (long)(unsigned int)(read - write));
+
+		if (skipped < (long)(unsigned int)(read - write)) {
+			SDL_AtomicSet(&s->eof, 1);
+		}
+
+		write += (int)skipped;
+		SDL_AtomicSet(&s->write, write);
+	}
+
+	long free_space = STREAM_RING_SAMPLES - (long)(unsigned int)(write - read);
+	long produced = 0;
+
+	// Fill the free space in the ring, which may wrap around the end
+	while (free_space > 0 && !SDL_AtomicGet(&s->eof)) {
+		int offset = write & (STREAM_RING_SAMPLES - 1);
+		long contiguous = STREAM_RING_SAMPLES - offset;
+		long n = stream_read(s, s->ring + offset, free_space < contiguous ? free_space : contiguous);
+
+		if (n == 0) {
+			SDL_AtomicSet(&s->eof, 1);
+			break;
+		}
+
+		write += n;
+		free_space -= n;
+		produced += n;
+		SDL_AtomicSet(&s->write, write);
+	}
+
+	if (SDL_AtomicGet(&s->ready) != generation) {
+		SDL_AtomicSet(&s->ready, generation);
+		return 1;
+	}
+
+	return produced > 0;
+}
+
+// Background thread that decodes ahead of every open stream
+static int decoder_thread_main(void* data) {
+	while (decoder_running) {
+		int busy = 0;
+
+		SDL_LockMutex(streams_lock);
+		for (int i = 0; i < MAX_STREAMS; i++) {
+			if (streams[i] != NULL) {
+				busy |= stream_service(streams[i]);
+			}
+		}
+		SDL_UnlockMutex(streams_lock);
+
+		if (!busy) {
+			SDL_Delay(5);
+		}
+	}
+
 	return 1;
 }
 
-// Initialize the mixer
-int Mixer_init(int rate, int buffer) {
+// Open a sound for streaming playback
+// The start of the sound is decoded immediately, the rest is decoded in the background
+MixerStream* Mixer_open_stream(const char* path) {
+	MixerStream* s = Memtrack_calloc(MEMTRACK_SAMPLES, 1, sizeof(MixerStream));
+	s->file = sf_open(path, SFM_READ, &s->info);
+
+	if (s->file == NULL) {
+		Log_error("Error opening sound file: %s", sf_strerror(NULL));
+		Memtrack_free(s);
+		return NULL;
+	}
+
+	// 0 channels or >2 is not supported right now
+	if (s->info.channels != 1 && s->info.channels != 2) {
+		Log_error("Unsupported number of channels.");
+		sf_close(s->file);
+		Memtrack_free(s);
+		return NULL;
+	}
+
+	s->path = Memtrack_strdup(MEMTRACK_SAMPLES, path);
+	s->ratio = SAMPLE_RATE / (double)s->info.samplerate;
+
+	if (s->info.samplerate != SAMPLE_RATE) {
+		int error = 0;
+		s->resampler = src_new(SRC_SINC_FASTEST, s->info.channels, &error);
+
+		if (s->resampler == NULL) {
+			Log_error("Error creating sample rate converter: %s", src_strerror(error));
+			sf_close(s->file);
+			Memtrack_free(s->path);
+			Memtrack_free(s);
+			return NULL;
+		}
+	}
+
+	s->input = Memtrack_malloc(MEMTRACK_SAMPLES, sizeof(float) * STREAM_CHUNK_FRAMES * s->info.channels);
+	s->staging = Memtrack_malloc(MEMTRACK_SAMPLES, sizeof(float) * ((long)(STREAM_CHUNK_FRAMES * s->ratio) + 1) * 2);
+	s->ring = Memtrack_malloc(MEMTRACK_SAMPLES, sizeof(float) * STREAM_RING_SAMPLES);
+
+	// Decode the preload section
+	s->preload = Memtrack_malloc(MEMTRACK_SAMPLES, sizeof(float) * STREAM_PRELOAD_FRAMES * 2);
+	s->preload_size = stream_read(s, s->preload, STREAM_PRELOAD_FRAMES * 2);
+
+	// Register with the decoder thread
+	if (streams_lock == NULL) {
+		streams_lock = SDL_CreateMutex();
+	}
+
+	SDL_LockMutex(streams_lock);
+	int slot = -1;
+	for (int i = 0; i < MAX_STREAMS; i++) {
+		if (streams[i] == NULL) {
+			streams[i] = s;
+			slot = i;
+			break;
+		}
+	}
+	SDL_UnlockMutex(streams_lock);
+
+	if (slot == -1) {
+		Log_warn("Too many streams open, could not stream %s", path);
+		Mixer_close_stream(s);
+		return NULL;
+	}
+
+	Log_debug("Opened stream: %s, %dhz, %d channels", path, s->info.samplerate, s->info.channels);
+	return s;
+}
+
+// Close a stream and free its buffers
+// The stream must not be playing on any channel
+void Mixer_close_stream(MixerStream* s) {
+	if (s == NULL) {
+		return;
+	}
+
+	if (streams_lock != NULL) {
+		SDL_LockMutex(streams_lock);
+		for (int i = 0; i < MAX_STREAMS; i++) {
+			if (streams[i] == s) {
+				streams[i] = NULL;
+			}
+		}
+		SDL_UnlockMutex(streams_lock);
+	}
+
+	if (s->file != NULL) {
+		sf_close(s->file);
+	}
+
+	if (s->resampler != NULL) {
+		src_delete(s->resampler);
+	}
+
+	Memtrack_free(s->path);
+	Memtrack_free(s->input);
+	Memtrack_free(s->staging);
+	Memtrack_free(s->ring);
+	Memtrack_free(s->preload);
+	Memtrack_free(s);
+}
+
+// Set up everything but the output device
+static void setup(int rate, int buffer) {
 	// Set the sample rate
 	sample_rate = rate;
 
 	// Create the output buffer
 	buffer_size = buffer;
 
-	// Set all channels to null
-	for (int i = 0; i < NUM_CHANNELS; i++) {
-		channels[i].data = NULL;
-		channels[i].size = 0;
-		channels[i].index = 0;
-		channels[i].finished = 1;
+	// Start with no channels playing and an empty command queue
+	active_channels = 0;
+	for (int i = 0; i < COMMAND_QUEUE_SIZE; i++) {
+		SDL_AtomicSet(&commands[i].sequence, i);
+	}
+
+	for (int i = 0; i < LIMITER_LOOKAHEAD; i++) {
+		limiter_targets[i] = 1.0f;
+	}
+
+	callbacks_metric = Metrics_counter("audio.callbacks");
+	callback_time_metric = Metrics_histogram("audio.callback_us");
+	load_metric = Metrics_gauge("audio.load_percent");
+	voices_metric = Metrics_gauge("audio.voices");
+	underruns_metric = Metrics_counter("audio.stream_underruns");
+}
+
+// Start decoding streams in the background
+static void start_decoder() {
+	if (streams_lock == NULL) {
+		streams_lock = SDL_CreateMutex();
 	}
+	decoder_running = 1;
+	decoder_thread = SDL_CreateThread(decoder_thread_main, "Decoder", NULL);
+}
+
+// Initialize the mixer
+int Mixer_init(int rate, int buffer) {
+	setup(rate, buffer);
+	silent = 0;
 
 	// Initialize PortAudio
 	PaError error = Pa_Initialize();
@@ -180,34 +992,117 @@ int Mixer_init(int rate, int buffer) {
 
 	Log_debug("Successfully started PortAudio output stream");
 
+	start_decoder();
+
 	Log_debug("Successfully initialized Mixer");
 
 	return 1;
 }
 
-// Adds a sample to the mix, using any free channel available.
-// If there are no free channels available, -1 will be returned.
-// Otherwise, the channel number that the audio is playing on will be returned.
-int Mixer_add(float* data, size_t size) {
-	int channel = -1;
+// Initialize the mixer without an output device, for running without audio
+// Samples and streams load as usual, but nothing is ever played
+int Mixer_init_silent(int rate) {
+	setup(rate, 0);
+	silent = 1;
 
-	// Find the first channel that is marked as finished (ready to accept data)
-	for (int i = 0; i < NUM_CHANNELS; i++) {
-		if (channels[i].finished) {
-			channel = i;
-		}
+	start_decoder();
+
+	Log_debug("Successfully initialized silent Mixer");
+
+	return 1;
+}
+
+// Adds a sample to the mix on the given bus, using any free channel available.
+// The sample starts playing at the beginning of the next mixed block.
+// Returns 0 if the request could not be queued.
+int Mixer_add(float* data, size_t size, int bus) {
+	return push_command(COMMAND_ADD, bus, data, size, NULL, 0.0);
+}
+
+// Starts a stream playing from the beginning on the given bus.
+// A stream only plays on one channel at a time, so if it is already playing it is restarted.
+// Returns 0 if the request could not be queued.
+int Mixer_add_stream(MixerStream* s, int bus) {
+	return push_command(COMMAND_ADD_STREAM, bus, NULL, 0, s, 0.0);
+}
+
+// Set the playback rate of the whole mix, between MIXER_MIN_RATE and MIXER_MAX_RATE.
+// Pitch changes along with speed.
+void Mixer_set_rate(double new_rate) {
+	if (new_rate < MIXER_MIN_RATE) {
+		new_rate = MIXER_MIN_RATE;
+	} else if (new_rate > MIXER_MAX_RATE) {
+		new_rate = MIXER_MAX_RATE;
 	}
 
-	// If there are no free channels, give up
-	if (channel == -1) {
-		return -1;
+	push_command(COMMAND_SET_RATE, 0, NULL, 0, NULL, new_rate);
+}
+
+// Set the gain of one bus (1.0 = unchanged)
+void Mixer_set_bus_gain(int bus, double gain) {
+	if (bus < 0 || bus >= MIXER_NUM_BUSES) {
+		return;
+	}
+
+	push_command(COMMAND_SET_BUS_GAIN, bus, NULL, 0, NULL, gain);
+}
+
+// Set the gain applied to everything in the chart, as given by #VOLWAV (1.0 = 100%)
+void Mixer_set_chart_gain(double gain) {
+	push_command(COMMAND_SET_CHART_GAIN, 0, NULL, 0, NULL, gain);
+}
+
+// Stop every channel, waiting up to MIXER_HALT_TIMEOUT milliseconds for the callback
+// Returns 1 once the callback has dropped every channel, after which it no longer
+// references any sample data, or 0 if it didn't answer in time (e.g. the device
+// stalled), in which case sample data must not be freed
+int Mixer_halt() {
+	int request = SDL_AtomicAdd(&halt_requested, 1) + 1;
+
+	if (stream == NULL) {
+		SDL_AtomicSet(&halt_acknowledged, request);
+		return 1;
+	}
+
+	for (int i = 0; i < MIXER_HALT_TIMEOUT && SDL_AtomicGet(&halt_acknowledged) != request; i++) {
+		SDL_Delay(1);
+	}
+
+	if (SDL_AtomicGet(&halt_acknowledged) != request) {
+		Log_warn("The audio callback didn't stop its channels within %dms", MIXER_HALT_TIMEOUT);
+		return 0;
+	}
+
+	return 1;
+}
+
+// Stop playback and shut down the mixer
+void Mixer_destroy() {
+	Mixer_halt();
+
+	if (stream != NULL) {
+		Pa_StopStream(stream);
+		Pa_CloseStream(stream);
+		stream = NULL;
+	}
+
+	if (!silent) {
+		Pa_Terminate();
 	}
 
-	// Add the new sample
-	channels[channel].data = data;
-	channels[channel].size = size;
-	channels[channel].index = 0;
-	channels[channel].finished = 0;
+	decoder_running = 0;
+	SDL_WaitThread(decoder_thread, NULL);
+	decoder_thread = NULL;
+
+	Log_debug("Mixer successfully destroyed");
+}
+
+// Have every block of mixed output passed to a tap, or stop with NULL
+// The tap may still be called once more by a callback already running
+void Mixer_set_tap(MixerTap listener) {
+	SDL_AtomicSetPtr(&tap, (void*)listener);
+}
 
-	return channel;
+int Mixer_get_sample_rate() {
+	return sample_rate;
 }
@@ -8,19 +8,135 @@
 #include "util.h"
 #include "animation.h"
 #include "input.h"
-
+#include "memtrack.h"
+#include "metrics.h"
+#include "mixer.h"
+#include "batch.h"
+#include "bga.h"
+#include "trace.h"
+#include "triplebuffer.h"
+
+#include <math.h>
+#include <string.h>
 #include <SDL2/SDL.h>
 
 static BMS* bms;
 static double measure_height = GRAPHICS_WIN_HEIGHT * 2;
 static double lane_width = 80.0;
 static double judge_line = GRAPHICS_WIN_HEIGHT - 100.0;
+static double rate = 1.0;
 static Measure** render_objects;
-//static Animation* bombs[9];
-//static SDL_Rect bomb_positions[9];
+
+// Enough lanes for any format, counting the extra button the beams are drawn for
+#define MAX_LANES 10
+
+// How long the POOR image shows after a press that hits nothing, in seconds
+#define POOR_DURATION 0.5
+
+// How far past the last snapshot the render thread will extrapolate, in seconds
+// Keeps the chart from running away if updates stall
+#define MAX_EXTRAPOLATION 0.05
+
+// How far from each note presses land, how many land nowhere, and how many
+// notes go by unhit
+static Metric* offset_metric;
+static Metric* early_metric;
+static Metric* late_metric;
+static Metric* empty_press_metric;
+static Metric* miss_metric;
+static int missed;
+
+// Scroll speed and rate changes asked for by the event thread, applied by the
+// logic thread at its next update
+static SDL_atomic_t scroll_change;
+static SDL_atomic_t rate_steps;
+
+// Each lane's next note and where the chart was, published by the logic thread
+// after every update, so the event thread can sound a press the moment it arrives
+// The chart is at clock_measure at clock_time, and takes ns_per_measure per measure
+static SDL_atomic_t lane_cursors[MAX_LANES];
+static SDL_SpinLock clock_lock;
+static long long clock_time;
+static double clock_measure;
+static double ns_per_measure;
+
+// The last note of each lane a press sounded inside its judgment window, owned by the
+// event thread, so presses the logic thread hasn't judged yet don't share a note
+static int claimed[MAX_LANES];
+
+// Everything the render thread needs for a frame, published once per update
+// The render thread never reads the chart or input state directly
+// position was current at time, and advances by velocity per second from there
+typedef struct {
+	long long time;
+	double position;
+	double velocity;
+	double end_position;
+	double measure_height;
+	int beams[MAX_LANES];
+	int watermarks[MAX_LANES];
+	long long bomb_times[MAX_LANES];
+	long long poor_time;
+} Snapshot;
+
+static TripleBuffer* snapshots;
+
+// Per lane, one past the lane_index of the last note judged, and when the
+// lane's bomb last went off, owned by the update thread
+static int watermarks[MAX_LANES];
+static long long bomb_times[MAX_LANES];
+static long long poor_time;
+
+// GPU-side copies of the chart and lane beams, owned by the render thread
+static Batch* chart_batch;
+static Batch* beam_batch;
+static int fixed_quad_count;
+
+// Index of the first quad belonging to each measure, plus one past the last quad
+static int* measure_first_quad;
+
+// Every lane's bomb shares one sheet, since when each started is kept in the snapshot
+static Animation* bomb;
+static SDL_Rect bomb_positions[MAX_LANES];
+
+// Hand each lane's next note and the chart's position at time to the event thread
+static void publish_cursors(long long time) {
+	for (int i = 0; i < BMS_LANES; i++) {
+		SDL_AtomicSet(&lane_cursors[i], bms->lane_next[i]);
+	}
+
+	SDL_AtomicLock(&clock_lock);
+	clock_time = time;
+	clock_measure = bms->current_actual_measure;
+	ns_per_measure = 1E9 / (bms->mps * rate);
+	SDL_AtomicUnlock(&clock_lock);
+}
+
+// Copy the state the render thread needs into the next snapshot and hand it over
+// time is when the chart is at the snapshot's position
+static void publish_snapshot(long long time) {
+	Snapshot* snapshot = TripleBuffer_get_write(snapshots);
+
+	snapshot->time = time;
+	snapshot->position = BMS_get_position(bms);
+	snapshot->velocity = BMS_get_velocity(bms) * rate;
+	snapshot->end_position = bms->measure_positions[bms->total_measures];
+	snapshot->measure_height = measure_height;
+
+	for (int i = 0; i < MAX_LANES; i++) {
+		snapshot->beams[i] = Input_is_down(i);
+		snapshot->watermarks[i] = watermarks[i];
+		snapshot->bomb_times[i] = bomb_times[i];
+	}
+
+	snapshot->poor_time = poor_time;
+
+	TripleBuffer_publish(snapshots);
+}
 
 void Play_init(char* path) {
 	Log_debug("Loading BMS file...");
+	long long start = get_time_ns();
 	bms = BMS_load(path);
 
 	if (bms == NULL) {
@@ -28,181 +144,384 @@ void Play_init(char* path) {
 		return;
 	}
 
+	Metrics_set(Metrics_gauge("load.chart_ms"), (int)((get_time_ns() - start) / 1000000));
+
+	offset_metric = Metrics_histogram("judge.offset_us");
+	early_metric = Metrics_counter("judge.early");
+	late_metric = Metrics_counter("judge.late");
+	empty_press_metric = Metrics_counter("judge.empty_presses");
+	miss_metric = Metrics_counter("judge.misses");
+	missed = 0;
+
 	render_objects = BMS_get_renderable_objects(bms);
 
-	/*
-	// Load bomb animations
-	for (int i = 0; i < (bms->format == FORMAT_PMS ? 9 : 8); i++) {
-		bombs[i] = Animation_load_from_file("assets/animations/bomb.png", 13, 128, 1/60.0, 0, 1);
-		bomb_positions[i].x = i * lane_width + (lane_width / 2.0) - (bombs[i]->frame_width / 2.0);
-		bomb_positions[i].y = judge_line - 4 - bombs[i]->height / 2.0;
+	// #VOLWAV is a percentage
+	Mixer_set_chart_gain(bms->volwav / 100.0);
+
+	// Publish a first snapshot so the render thread has something to draw
+	snapshots = TripleBuffer_create(sizeof(Snapshot));
+	for (int i = 0; i < MAX_LANES; i++) {
+		claimed[i] = -1;
 	}
-	*/
+	publish_cursors(get_time_ns());
+	publish_snapshot(get_time_ns());
 }
 
 void Play_destroy() {
+	BMS_free_renderable_objects(bms, render_objects);
+	render_objects = NULL;
 	BMS_free(bms);
+	TripleBuffer_free(snapshots);
 	Log_debug("Play successfully destroyed");
 }
 
+// May be called from any thread
 void Play_change_scroll_speed(int diff) {
-	measure_height += diff;
+	SDL_AtomicAdd(&scroll_change, diff);
 }
 
-void Play_update(long dt) {
-	BMS_step(bms, dt);
+// Speed the chart up or slow it down for practice, in steps of 0.05x
+// May be called from any thread
+void Play_change_rate(double diff) {
+	SDL_AtomicAdd(&rate_steps, (int)floor(diff * 20.0 + 0.5));
+}
 
-	for (int i = 0; i <= (bms->format == FORMAT_PMS ? 9 : 8); i++) {
-		if (Input_was_pressed(i)) {
-			BMS_handle_button_press(bms, i);
-		}
+// Apply scroll speed and rate changes asked for since the last update
+// The chart and the audio always run at the same rate
+static void apply_changes() {
+	measure_height += SDL_AtomicSet(&scroll_change, 0);
+
+	int steps = SDL_AtomicSet(&rate_steps, 0);
+	if (steps == 0) {
+		return;
 	}
-	//Animation_update_all(dt);
+
+	// Round to the nearest step so repeated changes land exactly back on 1x
+	rate = floor((rate + steps / 20.0) * 20.0 + 0.5) / 20.0;
+
+	if (rate < MIXER_MIN_RATE) {
+		rate = MIXER_MIN_RATE;
+	} else if (rate > MIXER_MAX_RATE) {
+		rate = MIXER_MAX_RATE;
+	}
+
+	Mixer_set_rate(rate);
+	Log_info("Playback rate: %.2fx", rate);
 }
 
-void Play_draw() {
-	SDL_Rect rect;
+// Sound a press straight away, on the event thread, rather than at the next update
+// It sounds the lane's next note, or the one after if an earlier press took that
+void Play_handle_press(int button, long long time) {
+	if (button < 0 || button >= BMS_LANES) {
+		return;
+	}
+
+	int index = SDL_AtomicGet(&lane_cursors[button]);
+	if (index <= claimed[button]) {
+		index = claimed[button] + 1;
+	}
 
-	// Draw lane separations
-	glColor3ub(32, 32, 32);
-	for (int i = 0; i <= (bms->format == FORMAT_PMS ? 9 : 8); i++) {
-		rect.x = i * lane_width - 1;
-		rect.y = 0;
-		rect.w = 2;
-		rect.h = judge_line;
-		glRecti(rect.x, rect.y, rect.x + rect.w, rect.y + rect.h);
+	if (index >= bms->lane_note_counts[button]) {
+		return;
 	}
 
-	// Draw the judge line
-	rect.x = 0;
-	rect.y = judge_line - 8;
-	rect.w = GRAPHICS_WIN_WIDTH;
-	rect.h = 8;
-	glColor3ub(128, 0, 0);
-	glRecti(rect.x, rect.y, rect.x + rect.w, rect.y + rect.h);
+	SDL_AtomicLock(&clock_lock);
+	long long due = clock_time + (long long)((bms->lane_notes[button][index].actual_measure - clock_measure) * ns_per_measure);
+	SDL_AtomicUnlock(&clock_lock);
+
+	// A press this close will be judged against the note, so the next press moves on
+	if (llabs(time - due) <= (long long)(BMS_JUDGE_WINDOW * 1E9)) {
+		claimed[button] = index;
+	}
+
+	BMS_play_keysound(bms, bms->lane_notes[button][index].object->id);
+}
+
+// Advance the chart by dt, to where it should be at time, and judge every press
+// since the last update at the chart time it actually happened
+void Play_update(long dt, long long time) {
+	apply_changes();
+
+	long long span = Trace_begin();
+	BMS_step(bms, (long)(dt * rate));
+	Trace_end("BMS_step", span);
+
+	Metrics_add(miss_metric, bms->missed - missed);
+	missed = bms->missed;
+
+	span = Trace_begin();
 
-	// Draw lane beams
 	for (int i = 0; i <= (bms->format == FORMAT_PMS ? 9 : 8); i++) {
-		if (Input_is_down(i)) {
-			rect.x = i * lane_width;
-			rect.y = 0;
-			rect.w = lane_width;
-			rect.h = judge_line - 8;
-			glBegin(GL_POLYGON);
-			glColor3ub(0, 0, 0);
-			glVertex2i(rect.x, rect.y);
-			glVertex2i(rect.x + rect.w, rect.y);
-			glColor3ub(200, 0, 150);
-			glVertex2i(rect.x + rect.w, rect.y + rect.h);
-			glVertex2i(rect.x, rect.y + rect.h);
-			glEnd();
+		InputEvent event;
+
+		while (Input_poll_event(i, &event)) {
+			if (!event.pressed) {
+				continue;
+			}
+
+			long offset = (long)((event.time - time) * rate);
+			Object* judged = BMS_handle_button_press(bms, i, offset);
+
+			// Everything in the lane up to the judged note is done with
+			if (judged != NULL && judged->lane >= 0 && judged->lane < MAX_LANES) {
+				if (judged->lane_index >= watermarks[judged->lane]) {
+					watermarks[judged->lane] = judged->lane_index + 1;
+				}
+				bomb_times[judged->lane] = time;
+			} else if (judged == NULL) {
+				poor_time = time;
+			}
+
+			// Positive timings are late presses
+			if (judged != NULL) {
+				Metrics_record(offset_metric, (int)(fabs(judged->timing) * 1E6));
+				Metrics_add(judged->timing > 0.0 ? late_metric : early_metric, 1);
+			} else {
+				Metrics_add(empty_press_metric, 1);
+			}
+		}
+	}
+
+	Trace_end("Judge", span);
+
+	publish_cursors(time);
+	publish_snapshot(time);
+}
+
+// Set a quad's colour to the colour of a note in the given lane
+static void set_note_color(BatchQuad* quad, int lane) {
+	unsigned char r = 0, g = 0, b = 0;
+
+	switch (bms->format) {
+		case FORMAT_BMS:
+		case FORMAT_BME: {
+			switch (lane) {
+				case 0:
+					r = 255; g = 0; b = 0;
+					break;
+
+				case 1:
+				case 3:
+				case 5:
+				case 7:
+					r = 200; g = 200; b = 200;
+					break;
+
+				case 2:
+				case 4:
+				case 6:
+					r = 66; g = 134; b = 244;
+					break;
+			}
+			break;
+		}
+
+		case FORMAT_PMS:{
+			switch (lane) {
+				case 0:
+				case 8:
+					r = 255; g = 255; b = 255;
+					break;
+
+				case 1:
+				case 7:
+					r = 255; g = 217; b = 0;
+					break;
+
+				case 2:
+				case 6:
+					r = 38; g = 255; b = 0;
+					break;
+
+				case 3:
+				case 5:
+					r = 0; g = 238; b = 255;
+					break;
+
+				case 4:
+					r = 255; g = 0; b = 0;
+					break;
+			}
+			break;
 		}
 	}
 
+	unsigned char color[4] = { r, g, b, 255 };
+	memcpy(quad->top, color, 4);
+	memcpy(quad->bottom, color, 4);
+}
+
+// Fill in a quad that doesn't move with the chart
+static void set_fixed_quad(BatchQuad* quad, float x, float y, float w, float h, const unsigned char* top, const unsigned char* bottom) {
+	quad->x = x;
+	quad->y = y;
+	quad->w = w;
+	quad->h = h;
+	quad->position = 0.0f;
+	quad->scroll = 0.0f;
+	quad->group = -1.0f;
+	quad->sequence = 0.0f;
+	memcpy(quad->top, top, 4);
+	memcpy(quad->bottom, bottom, 4);
+}
+
+// Upload the whole chart to the GPU
+// Called on the render thread once its OpenGL context exists
+void Play_init_renderer() {
+	int lanes = bms->format == FORMAT_PMS ? 9 : 8;
+	BatchQuad quad;
+
+	chart_batch = Batch_create(1024, 0);
+	beam_batch = Batch_create(lanes + 1, 1);
+
+	// Lane separations
+	static const unsigned char separator_color[4] = { 32, 32, 32, 255 };
+	for (int i = 0; i <= lanes; i++) {
+		set_fixed_quad(&quad, i * lane_width - 1, 0, 2, judge_line, separator_color, separator_color);
+		Batch_add(chart_batch, &quad);
+	}
+
+	// The judge line
+	static const unsigned char judge_color[4] = { 128, 0, 0, 255 };
+	set_fixed_quad(&quad, 0, judge_line - 8, GRAPHICS_WIN_WIDTH, 8, judge_color, judge_color);
+	Batch_add(chart_batch, &quad);
+
+	fixed_quad_count = chart_batch->count;
+
+	// Bar lines and notes scroll with the chart, and are grouped by measure
+	// so each frame only has to draw the measures that are on screen
+	measure_first_quad = Memtrack_calloc(MEMTRACK_RENDER, bms->total_measures + 1, sizeof(int));
+
 	for (int i = 0; i < bms->total_measures; i++) {
 		Measure* measure = render_objects[i];
+		double start = bms->measure_positions[i];
+		double height = bms->measure_positions[i + 1] - start;
 
-		double y = judge_line - ((i + 1) * measure_height) + (bms->current_measure + bms->current_measure_part) * measure_height;
-		double x = 0.0;
-
-		// Draw the bar line
-		if (y - 1 <= judge_line) {
-			rect.x = 0;
-			rect.y = y - 1;
-			rect.w = (bms->format == FORMAT_PMS ? 9 : 8) * lane_width;
-			rect.h = 2;
-			glColor3ub(64, 64, 64);
-			glRecti(rect.x, rect.y, rect.x + rect.w, rect.y + rect.h);
-		}
+		measure_first_quad[i] = chart_batch->count;
+
+		// The bar line at the top of this measure
+		static const unsigned char bar_color[4] = { 64, 64, 64, 255 };
+		set_fixed_quad(&quad, 0, -1, lanes * lane_width, 2, bar_color, bar_color);
+		quad.position = start + height;
+		quad.scroll = 1.0f;
+		Batch_add(chart_batch, &quad);
 
-		// Draw notes
 		for (int j = 0; j < measure->channel_count; j++) {
 			Channel* channel = measure->channels[j];
 
 			for (int k = 0; k < channel->object_count; k++) {
 				Object* object = channel->objects[k];
 
-				if (object->activated) {
-					continue;
-				}
+				quad.x = object->lane * lane_width;
+				quad.y = -8;
+				quad.w = lane_width;
+				quad.h = 8;
+				quad.position = start + (1.0 - object->ypos) * height;
+				quad.scroll = 1.0f;
+				set_note_color(&quad, object->lane);
 
-				rect.x = x + object->lane * lane_width;
-				rect.y = y + (object->ypos * measure_height) - 8;
-				rect.w = lane_width;
-				rect.h = 8;
-
-				if (rect.y >= -8 && rect.y <= judge_line - 8) {
-					switch (bms->format) {
-						case FORMAT_BMS:
-						case FORMAT_BME: {
-							switch (object->lane) {
-								case 0:
-									glColor3ub(255, 0, 0);
-									break;
-
-								case 1:
-								case 3:
-								case 5:
-								case 7:
-									glColor3ub(200, 200, 200);
-									break;
-
-								case 2:
-								case 4:
-								case 6:
-									glColor3ub(66, 134, 244);
-									break;
-							}
-							break;
-						}
-
-						case FORMAT_PMS:{
-							switch (object->lane) {
-								case 0:
-								case 8:
-									glColor3ub(255, 255, 255);
-									break;
-
-								case 1:
-								case 7:
-									glColor3ub(255, 217, 0);
-									break;
-
-								case 2:
-								case 6:
-									glColor3ub(38, 255, 0);
-									break;
-
-								case 3:
-								case 5:
-									glColor3ub(0, 238, 255);
-									break;
-
-								case 4:
-									glColor3ub(255, 0, 0);
-									break;
-							}
-							break;
-						}
-					}
-
-					glRecti(rect.x, rect.y, rect.x + rect.w, rect.y + rect.h);
-				}
+				// Judged notes are hidden by their lane's watermark
+				quad.group = object->lane;
+				quad.sequence = object->lane_index;
 
-				/*
-				if (rect.y >= judge_line - 8 && rect.y <= judge_line + 8) {
-					Animation_stop(bombs[object->lane]);
-					Animation_play(bombs[object->lane]);
-				}
-				*/
+				Batch_add(chart_batch, &quad);
 			}
 		}
 	}
 
-	/*
-	for (int i = 0; i < (bms->format == FORMAT_PMS ? 9 : 8); i++) {
-		Animation_draw(bombs[i], bomb_positions[i].x, bomb_positions[i].y);
+	measure_first_quad[bms->total_measures] = chart_batch->count;
+
+	Batch_upload(chart_batch);
+
+	Bga_init(bms);
+
+	// Load the bomb animation, centred on each lane at the judge line
+	bomb = Animation_load_from_file("assets/animations/bomb.png", 13, 128, 1/60.0, 0, 1);
+	if (bomb != NULL) {
+		for (int i = 0; i < lanes; i++) {
+			bomb_positions[i].x = i * lane_width + (lane_width / 2.0) - (bomb->frame_width / 2.0);
+			bomb_positions[i].y = judge_line - 4 - bomb->height / 2.0;
+		}
 	}
-	*/
+
+	Log_debug("Uploaded %d chart quads", chart_batch->count);
+}
+
+void Play_destroy_renderer() {
+	Batch_free(chart_batch);
+	Batch_free(beam_batch);
+	Memtrack_free(measure_first_quad);
+	Animation_free(bomb);
+	Bga_destroy();
+	bomb = NULL;
+	chart_batch = NULL;
+	beam_batch = NULL;
+	measure_first_quad = NULL;
 }
 
+// Draw the chart as it is at now, extrapolating from the last update
+void Play_draw(long long now) {
+	int lanes = bms->format == FORMAT_PMS ? 9 : 8;
+	const Snapshot* snapshot = TripleBuffer_get_read(snapshots);
+	double measure_height = snapshot->measure_height;
+
+	// Work out where the chart is now rather than where it was at the last update,
+	// so scrolling stays smooth whatever the refresh rate
+	double elapsed = (now - snapshot->time) / 1E9;
+	if (elapsed < 0.0) {
+		elapsed = 0.0;
+	} else if (elapsed > MAX_EXTRAPOLATION) {
+		elapsed = MAX_EXTRAPOLATION;
+	}
+
+	double position = snapshot->position + snapshot->velocity * elapsed;
+	if (position > snapshot->end_position) {
+		position = snapshot->end_position;
+	}
+
+	// Find the measures between the judge line and the top of the screen, leaving
+	// room for a note that is partly above it
+	int first_measure = BMS_find_measure(bms, position);
+	int last_measure = BMS_find_measure(bms, position + (judge_line + 8) / measure_height);
+	int first_quad = bms->total_measures > 0 ? measure_first_quad[first_measure] : 0;
+	int last_quad = bms->total_measures > 0 ? measure_first_quad[last_measure + 1] : 0;
+
+	// Draw the BGA behind everything, centred over the lanes
+	int poor = snapshot->poor_time != 0 && now - snapshot->poor_time < POOR_DURATION * 1E9;
+	Bga_draw(position, snapshot->velocity, poor, (lanes * lane_width - BGA_SIZE * 2) / 2.0, 40, BGA_SIZE * 2);
+
+	Batch_set_view(position, measure_height, judge_line);
+	Batch_set_watermarks(snapshot->watermarks, MAX_LANES);
+
+	// Draw lane separations and the judge line
+	Batch_draw(chart_batch, 0, fixed_quad_count);
+
+	// Draw lane beams
+	static const unsigned char beam_top[4] = { 0, 0, 0, 255 };
+	static const unsigned char beam_bottom[4] = { 200, 0, 150, 255 };
+	BatchQuad quad;
+
+	Batch_clear(beam_batch);
+	for (int i = 0; i <= lanes; i++) {
+		if (snapshot->beams[i]) {
+			set_fixed_quad(&quad, i * lane_width, 0, lane_width, judge_line - 8, beam_top, beam_bottom);
+			Batch_add(beam_batch, &quad);
+		}
+	}
+
+	if (beam_batch->count > 0) {
+		Batch_upload(beam_batch);
+		Batch_draw(beam_batch, 0, beam_batch->count);
+	}
+
+	// Draw bar lines and notes in the visible measures
+	Batch_draw(chart_batch, first_quad, last_quad - first_quad);
+
+	// Draw bombs on lanes that have hit a note recently, all in one batch
+	for (int i = 0; i < lanes; i++) {
+		if (snapshot->bomb_times[i] != 0) {
+			Animation_draw(bomb, bomb_positions[i].x, bomb_positions[i].y, now - snapshot->bomb_times[i]);
+		}
+	}
+	Sprite_flush();
+}
@@ -0,0 +1,197 @@
+#include "scheduler.h"
+#include "log.h"
+#include "util.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// A wakeup this far past its deadline counts as late
+#define LATE_THRESHOLD 100000LL
+
+// How quickly the spin shrinks again after a late sleep; the worst recent
+// oversleep decays by this fraction per wakeup
+#define OVERSLEEP_DECAY 0.01
+
+// Extra spin on top of the worst recent oversleep
+#define SPIN_MARGIN 20000LL
+
+// CPU time used by the calling thread, in nanoseconds
+static long long get_thread_cpu_ns() {
+#ifdef CLOCK_THREAD_CPUTIME_ID
+	struct timespec now;
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now) == 0) {
+		return timespec_to_ns(now);
+	}
+#endif
+	return -1;
+}
+
+// Sleep until a time on the monotonic clock, or thereabouts
+static void sleep_until(long long target) {
+#ifdef TIMER_ABSTIME
+	struct timespec deadline;
+	deadline.tv_sec = target / 1000000000LL;
+	deadline.tv_nsec = target % 1000000000LL;
+
+	// Absolute deadlines don't drift when the sleep is interrupted and restarted
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL) == EINTR);
+#else
+	// Without clock_nanosleep (e.g. macOS), a relative sleep is the best there is
+	long long remaining = target - get_time_ns();
+
+	if (remaining > 0) {
+		struct timespec duration;
+		duration.tv_sec = remaining / 1000000000LL;
+		duration.tv_nsec = remaining % 1000000000LL;
+		nanosleep(&duration, NULL);
+	}
+#endif
+}
+
+// Spin for about the given time, but never for more than a quarter of each tick
+static void set_spin(Scheduler* scheduler, long long spin) {
+	long long max_spin = SCHEDULER_MAX_SPIN;
+	if (scheduler->period > 0 && scheduler->period / 4 < max_spin) {
+		max_spin = scheduler->period / 4;
+	}
+
+	if (spin > max_spin) {
+		spin = max_spin;
+	}
+	if (spin < SCHEDULER_MIN_SPIN) {
+		spin = SCHEDULER_MIN_SPIN;
+	}
+
+	scheduler->spin = spin;
+}
+
+// Log how well the scheduler has kept time since the last report, then start a new one
+static void report(Scheduler* scheduler, long long now) {
+	long long cpu = get_thread_cpu_ns();
+	double seconds = (now - scheduler->report_start) / 1E9;
+
+	if (scheduler->wakeups > 0) {
+		if (cpu >= 0 && scheduler->report_cpu_start >= 0) {
+			Log_info("%s: %.1f wakeups/s, jitter %.1fus average, %.1fus max, %d late, spinning %.1fus, CPU %.1f%%",
+				scheduler->name, scheduler->wakeups / seconds,
+				scheduler->total_jitter / 1E3 / scheduler->wakeups, scheduler->max_jitter / 1E3, scheduler->late,
+				scheduler->spin / 1E3, (cpu - scheduler->report_cpu_start) / 1E7 / seconds);
+		} else {
+			Log_info("%s: %.1f wakeups/s, jitter %.1fus average, %.1fus max, %d late, spinning %.1fus",
+				scheduler->name, scheduler->wakeups / seconds,
+				scheduler->total_jitter / 1E3 / scheduler->wakeups, scheduler->max_jitter / 1E3, scheduler->late,
+				scheduler->spin / 1E3);
+		}
+	}
+
+	scheduler->report_start = now;
+	scheduler->report_cpu_start = cpu;
+	scheduler->wakeups = 0;
+	scheduler->late = 0;
+	scheduler->total_jitter = 0;
+	scheduler->max_jitter = 0;
+}
+
+// Register one of a scheduler's metrics, named after it in lower case
+static Metric* register_metric(const char* name, const char* suffix, int histogram) {
+	char metric_name[METRICS_NAME_LENGTH];
+	snprintf(metric_name, sizeof(metric_name), "%s.%s", name, suffix);
+
+	for (char* c = metric_name; *c != '\0'; c++) {
+		*c = tolower((unsigned char)*c);
+	}
+
+	return histogram ? Metrics_histogram(metric_name) : Metrics_counter(metric_name);
+}
+
+// Create a scheduler ticking every period nanoseconds, starting now
+// A period of 0 is fine for schedulers only used with Scheduler_wait_until
+Scheduler* Scheduler_create(const char* name, long long period) {
+	Scheduler* scheduler = calloc(1, sizeof(Scheduler));
+
+	scheduler->name = name;
+	scheduler->period = period;
+	scheduler->next = get_time_ns();
+	scheduler->spin = SCHEDULER_MAX_SPIN / 2;
+	scheduler->oversleep = scheduler->spin;
+	scheduler->wakeup_metric = register_metric(name, "wakeups", 0);
+	scheduler->jitter_metric = register_metric(name, "jitter_us", 1);
+	report(scheduler, scheduler->next);
+
+	return scheduler;
+}
+
+// Wait for the next tick, and return the time it was due
+// Ticks missed by a long stall are skipped rather than run back to back
+long long Scheduler_wait(Scheduler* scheduler) {
+	long long now = get_time_ns();
+
+	scheduler->next += scheduler->period;
+	if (scheduler->next < now) {
+		scheduler->next = now;
+	}
+
+	Scheduler_wait_until(scheduler, scheduler->next);
+
+	return scheduler->next;
+}
+
+// Wait until a time on the monotonic clock
+void Scheduler_wait_until(Scheduler* scheduler, long long deadline) {
+	set_spin(scheduler, scheduler->spin);
+	long long wake = deadline - scheduler->spin;
+
+	if (wake > get_time_ns()) {
+		sleep_until(wake);
+
+		// Keep the spin just long enough to cover how late sleeps have been waking up
+		// Stalls longer than any spin could cover are left out, so one preemption
+		// doesn't leave the thread burning CPU for the next few hundred ticks
+		long long oversleep = get_time_ns() - wake;
+		scheduler->oversleep = (long long)(scheduler->oversleep * (1.0 - OVERSLEEP_DECAY));
+		if (oversleep > scheduler->oversleep && oversleep < SCHEDULER_MAX_SPIN) {
+			scheduler->oversleep = oversleep;
+		}
+
+		set_spin(scheduler, scheduler->oversleep + SPIN_MARGIN);
+	}
+
+	long long now;
+	while ((now = get_time_ns()) < deadline);
+
+	long long jitter = now - deadline;
+	scheduler->wakeups++;
+	scheduler->total_jitter += jitter;
+	if (jitter > scheduler->max_jitter) {
+		scheduler->max_jitter = jitter;
+	}
+	if (jitter > LATE_THRESHOLD) {
+		scheduler->late++;
+	}
+
+	Metrics_add(scheduler->wakeup_metric, 1);
+	Metrics_record(scheduler->jitter_metric, (int)(jitter / 1000));
+
+	int peak = SDL_AtomicGet(&scheduler->peak_jitter);
+	while (jitter / 1000 > peak && !SDL_AtomicCAS(&scheduler->peak_jitter, peak, (int)(jitter / 1000))) {
+		peak = SDL_AtomicGet(&scheduler->peak_jitter);
+	}
+
+	if (now - scheduler->report_start >= SCHEDULER_REPORT_INTERVAL) {
+		report(scheduler, now);
+	}
+}
+
+// Returns the worst jitter since the last call, in microseconds, and starts over
+// Safe to call from any thread, so a reader slower than the ticks still sees every spike
+int Scheduler_take_max_jitter(Scheduler* scheduler) {
+	return SDL_AtomicSet(&scheduler->peak_jitter, 0);
+}
+
+void Scheduler_free(Scheduler* scheduler) {
+	report(scheduler, get_time_ns());
+	free(scheduler);
+}
@@ -0,0 +1,275 @@
+#include "sprite.h"
+#include "graphics.h"
+#include "log.h"
+#include "memtrack.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Blank pixels left around each packed region so filtering never samples a neighbour
+#define PADDING 1
+
+// Attribute locations shared by the shader and the draw call
+enum {
+	ATTRIB_CORNER = 0,
+	ATTRIB_RECT,
+	ATTRIB_UV,
+	ATTRIB_COLOR
+};
+
+// One queued sprite, drawn as an instance of a unit quad
+typedef struct {
+	float x, y, w, h;
+	float u0, v0, u1, v1;
+	unsigned char color[4];
+} SpriteInstance;
+
+static const char* vertex_source =
+	"#version 120\n"
+	"attribute vec2 a_corner;\n"
+	"attribute vec4 a_rect;\n"
+	"attribute vec4 a_uv;\n"
+	"attribute vec4 a_color;\n"
+	"uniform vec2 u_screen;\n"
+	"varying vec2 v_uv;\n"
+	"varying vec4 v_color;\n"
+	"void main() {\n"
+	"	vec2 p = a_rect.xy + a_corner * a_rect.zw;\n"
+	"	gl_Position = vec4(p.x / u_screen.x * 2.0 - 1.0, 1.0 - p.y / u_screen.y * 2.0, 0.0, 1.0);\n"
+	"	v_uv = mix(a_uv.xy, a_uv.zw, a_corner);\n"
+	"	v_color = a_color;\n"
+	"}\n";
+
+static const char* fragment_source =
+	"#version 120\n"
+	"uniform sampler2D u_atlas;\n"
+	"varying vec2 v_uv;\n"
+	"varying vec4 v_color;\n"
+	"void main() {\n"
+	"	gl_FragColor = texture2D(u_atlas, v_uv) * v_color;\n"
+	"}\n";
+
+static GLuint program;
+static GLuint corner_buffer;
+static GLuint instance_buffer;
+static GLuint atlas;
+
+// Regions are packed left to right along shelves, starting a new shelf below
+// the tallest region of the current one when a row fills up
+static int shelf_x;
+static int shelf_y;
+static int shelf_height;
+
+static SpriteInstance queue[SPRITE_MAX_QUEUED];
+static int queue_count;
+
+// Compile the sprite shader, and create the atlas and the instance buffer
+// Must be called on the thread that owns the OpenGL context
+int Sprite_init() {
+	GLuint vertex = GLFuncs_compile_shader(GL_VERTEX_SHADER, vertex_source);
+	GLuint fragment = GLFuncs_compile_shader(GL_FRAGMENT_SHADER, fragment_source);
+
+	if (vertex == 0 || fragment == 0) {
+		return 0;
+	}
+
+	program = gl.CreateProgram();
+	gl.AttachShader(program, vertex);
+	gl.AttachShader(program, fragment);
+	gl.BindAttribLocation(program, ATTRIB_CORNER, "a_corner");
+	gl.BindAttribLocation(program, ATTRIB_RECT, "a_rect");
+	gl.BindAttribLocation(program, ATTRIB_UV, "a_uv");
+	gl.BindAttribLocation(program, ATTRIB_COLOR, "a_color");
+	int linked = GLFuncs_link_program(program);
+	gl.DeleteShader(vertex);
+	gl.DeleteShader(fragment);
+
+	if (!linked) {
+		return 0;
+	}
+
+	gl.UseProgram(program);
+	gl.Uniform2f(gl.GetUniformLocation(program, "u_screen"), GRAPHICS_WIN_WIDTH, GRAPHICS_WIN_HEIGHT);
+	gl.Uniform1i(gl.GetUniformLocation(program, "u_atlas"), 0);
+	gl.UseProgram(0);
+
+	static const GLfloat corners[] = { 0.f, 0.f, 1.f, 0.f, 0.f, 1.f, 1.f, 1.f };
+	gl.GenBuffers(1, &corner_buffer);
+	gl.BindBuffer(GL_ARRAY_BUFFER, corner_buffer);
+	gl.BufferData(GL_ARRAY_BUFFER, sizeof corners, corners, GL_STATIC_DRAW);
+
+	gl.GenBuffers(1, &instance_buffer);
+	gl.BindBuffer(GL_ARRAY_BUFFER, instance_buffer);
+	gl.BufferData(GL_ARRAY_BUFFER, sizeof queue, NULL, GL_STREAM_DRAW);
+	gl.BindBuffer(GL_ARRAY_BUFFER, 0);
+
+	// Start with a fully transparent atlas, so padding samples as nothing
+	glGenTextures(1, &atlas);
+	glBindTexture(GL_TEXTURE_2D, atlas);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+	void* blank = calloc(SPRITE_ATLAS_SIZE * SPRITE_ATLAS_SIZE, 4);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA8, SPRITE_ATLAS_SIZE, SPRITE_ATLAS_SIZE, 0, GL_RGBA, GL_UNSIGNED_BYTE, blank);
+	free(blank);
+	glBindTexture(GL_TEXTURE_2D, 0);
+
+	// The atlas and instance buffer live with the driver, so they're counted by hand
+	Memtrack_track(MEMTRACK_RENDER, SPRITE_ATLAS_SIZE * SPRITE_ATLAS_SIZE * 4 + sizeof queue);
+
+	shelf_x = 0;
+	shelf_y = 0;
+	shelf_height = 0;
+	queue_count = 0;
+
+	Log_debug("Successfully initialized sprite batching");
+
+	return 1;
+}
+
+void Sprite_shutdown() {
+	glDeleteTextures(1, &atlas);
+	gl.DeleteBuffers(1, &corner_buffer);
+	gl.DeleteBuffers(1, &instance_buffer);
+	gl.DeleteProgram(program);
+	Memtrack_untrack(MEMTRACK_RENDER, SPRITE_ATLAS_SIZE * SPRITE_ATLAS_SIZE * 4 + sizeof queue);
+}
+
+// Copy a rectangle of a surface into free space in the atlas
+// Returns 0 if the atlas is full
+int Sprite_pack(SDL_Surface* surface, int x, int y, int w, int h, SpriteRegion* region) {
+	if (shelf_x + w + PADDING > SPRITE_ATLAS_SIZE) {
+		shelf_x = 0;
+		shelf_y += shelf_height;
+		shelf_height = 0;
+	}
+
+	if (w + PADDING > SPRITE_ATLAS_SIZE || shelf_y + h + PADDING > SPRITE_ATLAS_SIZE) {
+		Log_error("Sprite atlas is full, can't fit a %dx%d sprite", w, h);
+		return 0;
+	}
+
+	// Read the surface as bytes in RGBA order, whatever its own format
+	SDL_Surface* converted = SDL_ConvertSurfaceFormat(surface, SDL_PIXELFORMAT_RGBA32, 0);
+
+	if (converted == NULL) {
+		Log_error("Error converting sprite: %s", SDL_GetError());
+		return 0;
+	}
+
+	SDL_LockSurface(converted);
+	glBindTexture(GL_TEXTURE_2D, atlas);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, converted->pitch / 4);
+	glPixelStorei(GL_UNPACK_SKIP_PIXELS, x);
+	glPixelStorei(GL_UNPACK_SKIP_ROWS, y);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, shelf_x, shelf_y, w, h, GL_RGBA, GL_UNSIGNED_BYTE, converted->pixels);
+	glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+	glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
+	glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	SDL_UnlockSurface(converted);
+	SDL_FreeSurface(converted);
+
+	region->u0 = (float)shelf_x / SPRITE_ATLAS_SIZE;
+	region->v0 = (float)shelf_y / SPRITE_ATLAS_SIZE;
+	region->u1 = (float)(shelf_x + w) / SPRITE_ATLAS_SIZE;
+	region->v1 = (float)(shelf_y + h) / SPRITE_ATLAS_SIZE;
+	region->w = w;
+	region->h = h;
+
+	shelf_x += w + PADDING;
+	if (h + PADDING > shelf_height) {
+		shelf_height = h + PADDING;
+	}
+
+	return 1;
+}
+
+// Queue a region to be drawn with its top left corner at x, y, tinted by color
+// (NULL for none). Nothing is drawn until the queue is flushed.
+void Sprite_draw(const SpriteRegion* region, float x, float y, const unsigned char* color) {
+	if (queue_count == SPRITE_MAX_QUEUED) {
+		Sprite_flush();
+	}
+
+	SpriteInstance* instance = &queue[queue_count++];
+	instance->x = x;
+	instance->y = y;
+	instance->w = region->w;
+	instance->h = region->h;
+	instance->u0 = region->u0;
+	instance->v0 = region->v0;
+	instance->u1 = region->u1;
+	instance->v1 = region->v1;
+
+	if (color != NULL) {
+		memcpy(instance->color, color, 4);
+	} else {
+		memset(instance->color, 255, 4);
+	}
+}
+
+static void instance_attribute(GLuint location, GLint size, GLenum type, GLboolean normalized, size_t offset) {
+	gl.EnableVertexAttribArray(location);
+	gl.VertexAttribPointer(location, size, type, normalized, sizeof(SpriteInstance), (const GLvoid*)offset);
+	gl.VertexAttribDivisor(location, 1);
+}
+
+// Draw instances textured from the given texture in a single instanced call,
+// alpha blended in order
+static void draw_instances(GLuint texture, const SpriteInstance* instances, int count) {
+	gl.UseProgram(program);
+	glEnable(GL_BLEND);
+	glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+	glBindTexture(GL_TEXTURE_2D, texture);
+
+	gl.BindBuffer(GL_ARRAY_BUFFER, corner_buffer);
+	gl.EnableVertexAttribArray(ATTRIB_CORNER);
+	gl.VertexAttribPointer(ATTRIB_CORNER, 2, GL_FLOAT, GL_FALSE, 0, NULL);
+	gl.VertexAttribDivisor(ATTRIB_CORNER, 0);
+
+	gl.BindBuffer(GL_ARRAY_BUFFER, instance_buffer);
+	gl.BufferSubData(GL_ARRAY_BUFFER, 0, sizeof(SpriteInstance) * count, instances);
+	instance_attribute(ATTRIB_RECT, 4, GL_FLOAT, GL_FALSE, offsetof(SpriteInstance, x));
+	instance_attribute(ATTRIB_UV, 4, GL_FLOAT, GL_FALSE, offsetof(SpriteInstance, u0));
+	instance_attribute(ATTRIB_COLOR, 4, GL_UNSIGNED_BYTE, GL_TRUE, offsetof(SpriteInstance, color));
+
+	gl.DrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, count);
+
+	for (GLuint i = ATTRIB_CORNER; i <= ATTRIB_COLOR; i++) {
+		gl.VertexAttribDivisor(i, 0);
+		gl.DisableVertexAttribArray(i);
+	}
+	gl.BindBuffer(GL_ARRAY_BUFFER, 0);
+	glBindTexture(GL_TEXTURE_2D, 0);
+	glDisable(GL_BLEND);
+	gl.UseProgram(0);
+}
+
+// Draw every queued sprite in a single instanced call, alpha blended in queue order
+void Sprite_flush() {
+	if (queue_count == 0) {
+		return;
+	}
+
+	draw_instances(atlas, queue, queue_count);
+	queue_count = 0;
+}
+
+// Draw the whole of a texture that isn't in the atlas, stretched to w by h
+// Anything queued is flushed first so drawing order is kept
+void Sprite_draw_texture(GLuint texture, float x, float y, float w, float h, const unsigned char* color) {
+	Sprite_flush();
+
+	SpriteInstance instance = { x, y, w, h, 0.f, 0.f, 1.f, 1.f, { 255, 255, 255, 255 } };
+
+	if (color != NULL) {
+		memcpy(instance.color, color, 4);
+	}
+
+	draw_instances(texture, &instance, 1);
+}
@@ -0,0 +1,257 @@
+#include "trace.h"
+#include "log.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <SDL2/SDL.h>
+
+// One finished span, in get_time_ns time
+typedef struct {
+	const char* name;
+	long long start;
+	long long end;
+} TraceEvent;
+
+// Spans from one thread, which is the only producer; the writer thread consumes
+// head and tail are running counts, so they wrap around the ring by themselves
+typedef struct {
+	const char* name;
+	SDL_threadID id;
+	TraceEvent* events;
+	SDL_atomic_t head;
+	SDL_atomic_t tail;
+	SDL_atomic_t dropped;
+} TraceRing;
+
+static SDL_atomic_t enabled;
+
+// Each thread's ring, found through thread-local storage
+static SDL_TLSID ring_key;
+static TraceRing rings[TRACE_MAX_THREADS];
+static SDL_atomic_t ring_count;
+static SDL_SpinLock ring_lock;
+
+static FILE* fp;
+static char current_path[1024];
+static long long session_start;
+static int event_count;
+
+static SDL_Thread* writer_thread;
+static SDL_sem* wake;
+static SDL_atomic_t quitting;
+
+// Returns the calling thread's ring, claiming one the first time it's needed
+// Claiming only takes a ring Trace_init already set up, so it's safe on the audio thread
+static TraceRing* get_ring() {
+	TraceRing* ring = SDL_TLSGet(ring_key);
+
+	if (ring != NULL) {
+		return ring;
+	}
+
+	SDL_AtomicLock(&ring_lock);
+	int count = SDL_AtomicGet(&ring_count);
+	if (count < TRACE_MAX_THREADS) {
+		ring = &rings[count];
+		ring->id = SDL_ThreadID();
+		SDL_AtomicSet(&ring_count, count + 1);
+	}
+	SDL_AtomicUnlock(&ring_lock);
+
+	if (ring != NULL) {
+		SDL_TLSSet(ring_key, ring, NULL);
+	}
+
+	return ring;
+}
+
+// Separates events in the traceEvents array
+static void write_separator() {
+	fprintf(fp, event_count++ == 0 ? "\n" : ",\n");
+}
+
+// Write out every span waiting in every ring
+static void drain() {
+	int count = SDL_AtomicGet(&ring_count);
+
+	for (int i = 0; i < count; i++) {
+		TraceRing* ring = &rings[i];
+		unsigned int head = SDL_AtomicGet(&ring->head);
+		unsigned int tail = SDL_AtomicGet(&ring->tail);
+
+		for (; tail != head; tail++) {
+			TraceEvent* event = &ring->events[tail % TRACE_RING_SIZE];
+
+			// Left over from a span that finished after the last trace stopped
+			if (event->start < session_start) {
+				continue;
+			}
+
+			write_separator();
+			fprintf(fp, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%lu,\"ts\":%.3f,\"dur\":%.3f}",
+				event->name, (unsigned long)ring->id, (event->start - session_start) / 1E3, (event->end - event->start) / 1E3);
+		}
+
+		SDL_AtomicSet(&ring->tail, tail);
+	}
+}
+
+static int writer_thread_main(void* data) {
+	while (!SDL_AtomicGet(&quitting)) {
+		SDL_SemWaitTimeout(wake, TRACE_FLUSH_INTERVAL);
+		drain();
+	}
+
+	drain();
+	return 0;
+}
+
+void Trace_init() {
+	ring_key = SDL_TLSCreate();
+	wake = SDL_CreateSemaphore(0);
+
+	for (int i = 0; i < TRACE_MAX_THREADS; i++) {
+		rings[i].events = malloc(TRACE_RING_SIZE * sizeof(TraceEvent));
+	}
+}
+
+// Start recording spans into a new trace at path, replacing any file already there
+int Trace_start(const char* path) {
+	if (SDL_AtomicGet(&enabled)) {
+		return 1;
+	}
+
+	fp = fopen(path, "w");
+
+	if (fp == NULL) {
+		Log_error("Couldn't open %s for writing", path);
+		return 0;
+	}
+
+	snprintf(current_path, sizeof(current_path), "%s", path);
+	session_start = get_time_ns();
+	event_count = 0;
+
+	fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	write_separator();
+	fprintf(fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"dreamnote\"}}");
+
+	// Anything still queued belongs to the last trace
+	int count = SDL_AtomicGet(&ring_count);
+	for (int i = 0; i < count; i++) {
+		SDL_AtomicSet(&rings[i].tail, SDL_AtomicGet(&rings[i].head));
+		SDL_AtomicSet(&rings[i].dropped, 0);
+	}
+
+	SDL_AtomicSet(&quitting, 0);
+	writer_thread = SDL_CreateThread(writer_thread_main, "Trace", NULL);
+	SDL_AtomicSet(&enabled, 1);
+
+	Log_info("Tracing to %s", path);
+
+	return 1;
+}
+
+// Stop recording, and finish writing the trace
+void Trace_stop() {
+	if (!SDL_AtomicGet(&enabled)) {
+		return;
+	}
+
+	SDL_AtomicSet(&enabled, 0);
+	SDL_AtomicSet(&quitting, 1);
+	SDL_SemPost(wake);
+	SDL_WaitThread(writer_thread, NULL);
+	writer_thread = NULL;
+
+	// Name every thread that has a ring, so the viewer can label them
+	int dropped = 0;
+	int count = SDL_AtomicGet(&ring_count);
+	for (int i = 0; i < count; i++) {
+		write_separator();
+		if (rings[i].name != NULL) {
+			fprintf(fp, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%lu,\"args\":{\"name\":\"%s\"}}",
+				(unsigned long)rings[i].id, rings[i].name);
+		} else {
+			fprintf(fp, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%lu,\"args\":{\"name\":\"Thread %lu\"}}",
+				(unsigned long)rings[i].id, (unsigned long)rings[i].id);
+		}
+
+		dropped += SDL_AtomicGet(&rings[i].dropped);
+	}
+
+	fprintf(fp, "\n]}\n");
+	fclose(fp);
+	fp = NULL;
+
+	if (dropped > 0) {
+		Log_warn("%d spans didn't fit in their rings and were left out of the trace", dropped);
+	}
+	Log_info("Trace written to %s", current_path);
+}
+
+int Trace_is_enabled() {
+	return SDL_AtomicGet(&enabled);
+}
+
+// Label the calling thread in traces
+void Trace_name_thread(const char* name) {
+	TraceRing* ring = get_ring();
+
+	if (ring != NULL) {
+		ring->name = name;
+	}
+}
+
+// Returns when a span starts, or 0 if tracing is off
+long long Trace_begin() {
+	if (!SDL_AtomicGet(&enabled)) {
+		return 0;
+	}
+
+	return get_time_ns();
+}
+
+// Record a span that started at start, as returned by Trace_begin
+void Trace_end(const char* name, long long start) {
+	if (start == 0) {
+		return;
+	}
+
+	long long end = get_time_ns();
+	TraceRing* ring = get_ring();
+
+	if (ring == NULL || ring->events == NULL) {
+		return;
+	}
+
+	unsigned int head = SDL_AtomicGet(&ring->head);
+
+	if (head - SDL_AtomicGet(&ring->tail) >= TRACE_RING_SIZE) {
+		SDL_AtomicAdd(&ring->dropped, 1);
+		return;
+	}
+
+	TraceEvent* event = &ring->events[head % TRACE_RING_SIZE];
+	event->name = name;
+	event->start = start;
+	event->end = end;
+
+	SDL_AtomicSet(&ring->head, head + 1);
+}
+
+void Trace_destroy() {
+	Trace_stop();
+
+	for (int i = 0; i < TRACE_MAX_THREADS; i++) {
+		free(rings[i].events);
+		rings[i].events = NULL;
+	}
+	SDL_AtomicSet(&ring_count, 0);
+
+	if (wake != NULL) {
+		SDL_DestroySemaphore(wake);
+		wake = NULL;
+	}
+}
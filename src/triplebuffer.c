@@ -0,0 +1,57 @@
+#include "triplebuffer.h"
+
+#include <string.h>
+
+// Set on the middle slot index when it holds a snapshot the reader hasn't taken yet
+#define FRESH 4
+#define INDEX_MASK 3
+
+// Create a triple buffer of zeroed slots, each size bytes
+TripleBuffer* TripleBuffer_create(size_t size) {
+	TripleBuffer* buffer = calloc(1, sizeof(TripleBuffer));
+
+	for (int i = 0; i < 3; i++) {
+		buffer->slots[i] = calloc(1, size);
+	}
+
+	buffer->back = 0;
+	SDL_AtomicSet(&buffer->middle, 1);
+	buffer->front = 2;
+
+	return buffer;
+}
+
+// Returns the slot the writer may fill, which the reader never touches
+void* TripleBuffer_get_write(TripleBuffer* buffer) {
+	return buffer->slots[buffer->back];
+}
+
+// Publish the filled slot, taking back whichever slot was shared before
+// The new write slot still holds an older snapshot, so it must be filled completely
+void TripleBuffer_publish(TripleBuffer* buffer) {
+	int old = SDL_AtomicSet(&buffer->middle, buffer->back | FRESH);
+	buffer->back = old & INDEX_MASK;
+}
+
+// Returns the most recently published snapshot
+// It stays valid and unchanged until the next call from the reader
+void* TripleBuffer_get_read(TripleBuffer* buffer) {
+	if (SDL_AtomicGet(&buffer->middle) & FRESH) {
+		int old = SDL_AtomicSet(&buffer->middle, buffer->front);
+		buffer->front = old & INDEX_MASK;
+	}
+
+	return buffer->slots[buffer->front];
+}
+
+void TripleBuffer_free(TripleBuffer* buffer) {
+	if (buffer == NULL) {
+		return;
+	}
+
+	for (int i = 0; i < 3; i++) {
+		free(buffer->slots[i]);
+	}
+
+	free(buffer);
+}
@@ -5,6 +5,12 @@
 #include <stdio.h>
 #include <time.h>
 
+#ifdef __linux__
+#include <unistd.h>
+#elif defined(__APPLE__)
+#include <sys/resource.h>
+#endif
+
 int iswhitespace(char c) {
 	return c == ' ' || c == '\t' || c == '\r' || c == '\n';
 }
@@ -122,3 +128,43 @@ struct timespec timespec_add_ns(struct timespec time, long ns) {
 
 	return temp;
 }
+
+long long timespec_to_ns(struct timespec time) {
+	return (long long)time.tv_sec * 1000000000LL + time.tv_nsec;
+}
+
+// Returns the monotonic clock in nanoseconds, for comparing times across threads
+long long get_time_ns() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return timespec_to_ns(now);
+}
+
+// Returns how many bytes of memory the process has resident, or -1 if unknown
+// macOS only gives the peak, and Windows isn't supported
+long long get_resident_memory() {
+#ifdef __linux__
+	FILE* fp = fopen("/proc/self/statm", "r");
+	long size, resident;
+
+	if (fp == NULL) {
+		return -1;
+	}
+
+	int read = fscanf(fp, "%ld %ld", &size, &resident);
+	fclose(fp);
+
+	return read == 2 ? (long long)resident * sysconf(_SC_PAGESIZE) : -1;
+#elif defined(__APPLE__)
+	struct rusage usage;
+
+	if (getrusage(RUSAGE_SELF, &usage) != 0) {
+		return -1;
+	}
+
+	// ru_maxrss is in bytes on macOS
+	return usage.ru_maxrss;
+#else
+	return -1;
+#endif
+}